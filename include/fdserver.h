@@ -11,17 +11,311 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+
+/* maximum size of the metadata attached to a registered file descriptor */
+#define FDSERVER_MAX_METADATA 256
+/* maximum number of keys in a single batch request */
+#define FDSERVER_MAX_BATCH 64
+/* maximum number of file descriptors registered under a single key */
+#define FDSERVER_MAX_GROUP 64
+/* maximum size of a context name, including the terminating NUL */
+#define FDSERVER_MAX_CONTEXT_NAME 64
+/* maximum number of file descriptors waiting in a work queue */
+#define FDSERVER_MAX_QUEUE 1024
 
 typedef struct fdserver_context fdserver_context_t;
 
+/*
+ * All functions return -1 on failure, with errno telling why, e.g.:
+ * ENOENT: the key is not registered in the context
+ * ESRCH: the context does not exist (anymore)
+ * ENOSPC: the server tables or quotas are full
+ * EEXIST: the key is already registered in the context
+ * EINVAL: invalid arguments
+ * ETIMEDOUT: the deadline of the call passed, see fdserver_set_timeout()
+ * ECONNREFUSED, EPIPE, ...: the server could not be reached
+ */
+
 int fdserver_init(const char *path);
+
+/*
+ * Deadlines: by default calls wait for the server as long as it takes.
+ * fdserver_set_timeout() bounds every call of the process to timeout_ms
+ * milliseconds (-1 for no timeout), and fdserver_set_deadline() bounds the
+ * calls of the calling thread by an absolute CLOCK_MONOTONIC deadline, e.g.
+ * for a whole worker startup (NULL for no deadline); the earliest applies.
+ * Calls failing with ETIMEDOUT drop their connection, and the server skips
+ * the requests it gets past their deadline.
+ */
+int fdserver_set_timeout(int timeout_ms);
+int fdserver_set_deadline(const struct timespec *deadline);
+
+/*
+ * Journal: the contexts and registrations of a process vanish when the
+ * server restarts. Once fdserver_set_journal(1) is called, the library
+ * remembers the contexts the process creates and the file descriptors it
+ * registers in them (keeping a dup of each), and replays them as soon as
+ * it connects to a new instance of the server: the contexts are created
+ * anew, their registrations sent in batches, and the handles of the
+ * process keep working, mapped to the new contexts. Contexts opened by
+ * name are left to their creator, subscriptions made before the restart
+ * must be renewed, and a child process starts with an empty journal.
+ * fdserver_set_journal(0) forgets everything.
+ */
+int fdserver_set_journal(int enable);
+
+/*
+ * Embedded server: fdserver_server_start() runs the server in a thread of
+ * the calling process, listening on path (FDSERVER_SOCKET_PATH if NULL).
+ * Other processes connect to it as usual, while the lookups of this process
+ * through that path are served without leaving the process: they only cost
+ * a dup() of the file descriptor. Only one server may run per process, and
+ * the children of a fork do not inherit it.
+ */
+int fdserver_server_start(const char *path);
+int fdserver_server_stop(void);
 int fdserver_new_context(fdserver_context_t **context);
 int fdserver_del_context(fdserver_context_t **context);
+
+/*
+ * Room for a context handle provided by the caller, e.g. on the stack or
+ * embedded in a larger structure, to spare the allocation done by
+ * fdserver_new_context(). The storage holds plain data: it may be copied
+ * around, as long as the context is deleted only once.
+ */
+typedef struct fdserver_context_storage {
+	uint64_t opaque[2];
+} fdserver_context_storage_t;
+
+/*
+ * Same as fdserver_new_context() and fdserver_del_context(), with *context
+ * pointing into storage instead of allocated memory.
+ */
+int fdserver_new_context_at(fdserver_context_storage_t *storage,
+			    fdserver_context_t **context);
+int fdserver_del_context_at(fdserver_context_t *context);
+
+/*
+ * Create a new context holding the same registrations as source, in a
+ * single request. The registrations are shared with source rather than
+ * copied: they are only closed once neither context holds them anymore,
+ * and registering or deregistering keys in one context does not affect
+ * the other.
+ */
+int fdserver_clone_context(fdserver_context_t *source,
+			   fdserver_context_t **context);
+int fdserver_clone_context_at(fdserver_context_t *source,
+			      fdserver_context_storage_t *storage,
+			      fdserver_context_t **context);
+
+/*
+ * Named contexts: a context handle is otherwise only known to the process
+ * which created it and its children. fdserver_new_named_context() creates
+ * a context which unrelated processes can get with fdserver_open_context(),
+ * provided they run as the same user, or with FDSERVER_CONTEXT_GROUP the
+ * same group, or with FDSERVER_CONTEXT_ANYONE whatever their credentials
+ * (EACCES otherwise). Names are unique in a server tenant (EEXIST).
+ * Only processes of the user which created the context may delete it
+ * (EPERM); fdserver_close_context() frees the handle of an opened context
+ * without deleting it, leaving it to its creator.
+ */
+#define FDSERVER_CONTEXT_GROUP	0x1
+#define FDSERVER_CONTEXT_ANYONE	0x2
+
+int fdserver_new_named_context(const char *name, int access,
+			       fdserver_context_t **context);
+int fdserver_open_context(const char *name, fdserver_context_t **context);
+int fdserver_close_context(fdserver_context_t **context);
 int fdserver_register_fd(fdserver_context_t *context, uint64_t key, int fd);
 int fdserver_deregister_fd(fdserver_context_t *context, uint64_t key);
 int fdserver_lookup_fd(fdserver_context_t *context, uint64_t key);
 
+/*
+ * Same as fdserver_register_fd() and fdserver_lookup_fd(), but an opaque
+ * blob of up to FDSERVER_MAX_METADATA bytes is stored along with the file
+ * descriptor and returned by the lookup (e.g. the size of a memfd, or a
+ * queue id), sparing the caller further syscalls to learn about the fd.
+ * On lookup, *size is the size of the meta buffer on input, and the size of
+ * the stored metadata on output; the metadata is truncated to fit the buffer.
+ */
+int fdserver_register_fd_meta(fdserver_context_t *context, uint64_t key,
+			      int fd, const void *meta, size_t size);
+int fdserver_lookup_fd_meta(fdserver_context_t *context, uint64_t key,
+			    void *meta, size_t *size);
+
+/*
+ * Same as fdserver_register_fd_meta(), with flags:
+ * FDSERVER_REGISTER_EVICTABLE: the server may drop the registration to
+ * make room for others when its quotas are reached, starting with the
+ * least recently looked up. Subscribers see it as deregistered. Only
+ * registrations of the same server tenant are evicted for one another.
+ */
+#define FDSERVER_REGISTER_EVICTABLE	0x1
+
+int fdserver_register_fd_flags(fdserver_context_t *context, uint64_t key,
+			       int fd, const void *meta, size_t size,
+			       int flags);
+
+/*
+ * Register an ordered group of n file descriptors (at most
+ * FDSERVER_MAX_GROUP) under a single key, e.g. both ends of a pipe, in a
+ * single request: lookups get either the whole group or nothing, and
+ * deregistering the key drops the whole group.
+ * fdserver_lookup_fds() returns the number of file descriptors of the group
+ * stored in fds, failing with EMSGSIZE if there are more than max. Other
+ * lookups of the key, including batches and events, get its first fd.
+ */
+int fdserver_register_fds(fdserver_context_t *context, uint64_t key,
+			  const int *fds, int n);
+int fdserver_lookup_fds(fdserver_context_t *context, uint64_t key,
+			int *fds, int max);
+
+/*
+ * Lazy registration: rather than an open fd, register a path which the
+ * server opens with the given O_* flags on the first lookup of key, e.g.
+ * for large sets of rarely used files or devices. A relative path is
+ * resolved from dirfd (AT_FDCWD for the current directory of the caller).
+ * The file is opened with the file system credentials of the caller, and a
+ * lookup fails with the errno of open() if it fails. The open never blocks:
+ * it is done with O_NONBLOCK, cleared afterwards unless given, so that e.g.
+ * the write end of a FIFO without a reader fails with ENXIO. Once not
+ * looked up for idle_ms, the server closes it again until the next lookup
+ * (0 to keep it open). Opening must not change the file: O_CREAT, O_TRUNC
+ * and O_TMPFILE are refused (EINVAL). Quotas count the registration as one
+ * fd.
+ */
+int fdserver_register_path(fdserver_context_t *context, uint64_t key,
+			   int dirfd, const char *path, int flags,
+			   int idle_ms);
+
+/*
+ * Atomic replacement: the file descriptor registered under key (if any) is
+ * replaced by fd in a single server step, so that concurrent lookups get
+ * either the old or the new one but never miss the key.
+ * Every registration has a generation, unique in the server, returned in
+ * *generation if not NULL. fdserver_compare_replace_fd() only replaces the
+ * registration if it is of the expected generation (0 meaning the key must
+ * not be registered), and fails with ESTALE otherwise, *generation being
+ * set to the current generation.
+ */
+int fdserver_replace_fd(fdserver_context_t *context, uint64_t key, int fd,
+			uint64_t *generation);
+int fdserver_replace_fd_meta(fdserver_context_t *context, uint64_t key,
+			     int fd, const void *meta, size_t size,
+			     uint64_t *generation);
+int fdserver_compare_replace_fd(fdserver_context_t *context, uint64_t key,
+				int fd, uint64_t expected,
+				uint64_t *generation);
+int fdserver_lookup_fd_generation(fdserver_context_t *context, uint64_t key,
+				  uint64_t *generation);
+
+/*
+ * Change feed: fdserver_subscribe() opens a connection of its own on which
+ * the server streams the changes made to the n given contexts (at most
+ * FDSERVER_MAX_SUBSCRIBE). fdserver_subscription_fd() can be polled for
+ * readability, and fdserver_next_event() blocks until an event comes.
+ * If the subscriber falls behind, pending events of the same key are
+ * coalesced into the latest one, and when too many keys changed the events
+ * are dropped in favour of a FDSERVER_EVENT_OVERFLOW, after which the
+ * subscriber should lookup whatever it cares about again.
+ * With FDSERVER_SUBSCRIBE_FDS, register events carry the new fd, which the
+ * caller must close; event->fd is -1 otherwise.
+ * fdserver_publish() sends the n given fds (at most FDSERVER_MAX_GROUP) to
+ * every subscriber of the context in a single publish event, event->fds
+ * holding the event->nfds fds the caller must close (event->fd being the
+ * first). Publications are never coalesced, nor dropped but for an
+ * overflow: subscribers too far behind are skipped instead, and counted in
+ * *skipped if not NULL. Return the number of subscribers the fds were sent
+ * or queued to, or -1.
+ * A subscription ends with its context being deleted, or
+ * fdserver_unsubscribe().
+ */
+#define FDSERVER_MAX_SUBSCRIBE		64
+#define FDSERVER_SUBSCRIBE_FDS		0x1
+
+#define FDSERVER_EVENT_REGISTER		1 /* registered or replaced */
+#define FDSERVER_EVENT_DEREGISTER	2
+#define FDSERVER_EVENT_CONTEXT_DELETED	3
+#define FDSERVER_EVENT_OVERFLOW		4 /* events were lost */
+#define FDSERVER_EVENT_PUBLISH		5 /* see fdserver_publish() */
+
+typedef struct fdserver_subscription fdserver_subscription_t;
+
+typedef struct fdserver_event {
+	int type;			/* FDSERVER_EVENT_* */
+	fdserver_context_t *context;	/* as given to fdserver_subscribe() */
+	uint64_t key;
+	uint64_t generation;
+	int fd;
+	int nfds;
+	int fds[FDSERVER_MAX_GROUP];
+} fdserver_event_t;
+
+fdserver_subscription_t *fdserver_subscribe(fdserver_context_t **contexts,
+					    int n, int flags);
+int fdserver_subscription_fd(fdserver_subscription_t *subscription);
+int fdserver_next_event(fdserver_subscription_t *subscription,
+			fdserver_event_t *event);
+void fdserver_unsubscribe(fdserver_subscription_t *subscription);
+int fdserver_publish(fdserver_context_t *context, uint64_t key,
+		     const int *fds, int n, int *skipped);
+
+/*
+ * Lookup n keys (at most FDSERVER_MAX_BATCH) in a single request.
+ * fds[i] is set to the file descriptor registered for keys[i], or -1 if
+ * there is none. Return the number of file descriptors found, or -1.
+ */
+int fdserver_lookup_batch(fdserver_context_t *context, const uint64_t *keys,
+			  int n, int *fds);
+
+/*
+ * Reverse lookup: find the keys registered to the same open file as fd,
+ * alone or in a group, e.g. for a file descriptor inherited through fork
+ * or received from a third party, rather than looking up every candidate
+ * key. At most max keys (FDSERVER_MAX_BATCH in all) are stored in keys.
+ * Return the number of keys stored, or -1 (ENOENT if there are none).
+ */
+int fdserver_reverse_lookup(fdserver_context_t *context, int fd,
+			    uint64_t *keys, int max);
+
+/*
+ * Work queues: file descriptors pushed under a key of the context, apart
+ * from its registrations, are each handed to a single popping process, in
+ * the order they were pushed, e.g. accepted connections spread over
+ * workers. fdserver_queue_push() passes a copy of fd, left open for the
+ * caller (ENOSPC if FDSERVER_MAX_QUEUE are already waiting).
+ * fdserver_queue_pop() returns the oldest fd pushed, waiting up to
+ * timeout_ms for one (0 not to wait, -1 for ever, within the deadline of
+ * fdserver_set_timeout() if any), or fails with ETIMEDOUT. Processes
+ * waiting are served in the order they called.
+ */
+int fdserver_queue_push(fdserver_context_t *context, uint64_t key, int fd);
+int fdserver_queue_pop(fdserver_context_t *context, uint64_t key,
+		       int timeout_ms);
+
+/*
+ * Shared memory helpers:
+ * fdserver_shm_create() creates a memfd of the given size, registers it
+ * under key and returns it mapped in the caller's address space.
+ * fdserver_shm_attach() maps the memory registered under key, and returns
+ * its size in *size if size is not NULL.
+ * Mappings are cached per process: attaching an already mapped key returns
+ * the existing mapping, which is only unmapped once fdserver_shm_detach()
+ * has been called as many times as it was created or attached.
+ * Return NULL on error.
+ */
+#define FDSERVER_SHM_HUGEPAGES	0x1 /* back the memory with huge pages */
+#define FDSERVER_SHM_SEAL	0x2 /* seal the size of the memory */
+
+void *fdserver_shm_create(fdserver_context_t *context, uint64_t key,
+			  size_t size, int flags);
+void *fdserver_shm_attach(fdserver_context_t *context, uint64_t key,
+			  size_t *size);
+int fdserver_shm_detach(void *addr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,242 @@
+/* Copyright (c) 2018, Linaro Limited
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier:     BSD-3-Clause
+ */
+
+/*
+ * Header only C++ wrapper of the fdserver API.
+ *
+ * UniqueFd owns a file descriptor and closes it when destroyed, Context owns
+ * a server context, whose handle lives inside the object (no allocation),
+ * and deletes it when destroyed. Both are move-only.
+ * Errors are reported as the C API does: -1 or an empty object, with errno
+ * set; everything is inline so the wrapper costs nothing over the C calls.
+ */
+
+#ifndef _FD_SERVER_HPP
+#define _FD_SERVER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <unistd.h>
+
+#include <fdserver.h>
+
+namespace fdserver {
+
+class UniqueFd {
+public:
+	UniqueFd() noexcept : fd_(-1) {}
+	explicit UniqueFd(int fd) noexcept : fd_(fd) {}
+	UniqueFd(UniqueFd &&other) noexcept : fd_(other.release()) {}
+	UniqueFd(const UniqueFd &) = delete;
+	~UniqueFd() { reset(); }
+
+	UniqueFd &operator=(UniqueFd &&other) noexcept
+	{
+		if (this != &other)
+			reset(other.release());
+		return *this;
+	}
+	UniqueFd &operator=(const UniqueFd &) = delete;
+
+	int get() const noexcept { return fd_; }
+	explicit operator bool() const noexcept { return fd_ >= 0; }
+
+	/* give up ownership of the file descriptor */
+	int release() noexcept
+	{
+		int fd = fd_;
+
+		fd_ = -1;
+		return fd;
+	}
+
+	void reset(int fd = -1) noexcept
+	{
+		if (fd_ >= 0)
+			::close(fd_);
+		fd_ = fd;
+	}
+
+private:
+	int fd_;
+};
+
+class Context {
+public:
+	/* an empty context, see create() */
+	Context() noexcept : ctx_(nullptr) {}
+	Context(Context &&other) noexcept : ctx_(nullptr) { take(other); }
+	Context(const Context &) = delete;
+	~Context() { reset(); }
+
+	Context &operator=(Context &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			take(other);
+		}
+		return *this;
+	}
+	Context &operator=(const Context &) = delete;
+
+	/* create a new server context, deleting the one held if any */
+	int create() noexcept
+	{
+		reset();
+		return fdserver_new_context_at(&storage_, &ctx_);
+	}
+
+	/* replace the context held, if any, by a clone of source */
+	int clone(const Context &source) noexcept
+	{
+		Context copy;
+
+		if (fdserver_clone_context_at(source.ctx_, &copy.storage_,
+					      &copy.ctx_) != 0)
+			return -1;
+		*this = static_cast<Context &&>(copy);
+		return 0;
+	}
+
+	/* delete the server context held, if any */
+	int reset() noexcept
+	{
+		int ret = 0;
+
+		if (ctx_ != nullptr) {
+			ret = fdserver_del_context_at(ctx_);
+			ctx_ = nullptr;
+		}
+		return ret;
+	}
+
+	fdserver_context_t *get() const noexcept { return ctx_; }
+	explicit operator bool() const noexcept { return ctx_ != nullptr; }
+
+	int register_fd(uint64_t key, int fd) noexcept
+	{
+		return fdserver_register_fd(ctx_, key, fd);
+	}
+
+	int register_fd(uint64_t key, int fd,
+			const void *meta, size_t size) noexcept
+	{
+		return fdserver_register_fd_meta(ctx_, key, fd, meta, size);
+	}
+
+	/* see fdserver_replace_fd() and fdserver_compare_replace_fd() */
+	int replace_fd(uint64_t key, int fd,
+		       uint64_t *generation = nullptr) noexcept
+	{
+		return fdserver_replace_fd(ctx_, key, fd, generation);
+	}
+
+	int compare_replace_fd(uint64_t key, int fd, uint64_t expected,
+			       uint64_t *generation = nullptr) noexcept
+	{
+		return fdserver_compare_replace_fd(ctx_, key, fd, expected,
+						   generation);
+	}
+
+	/* see fdserver_register_fds() */
+	int register_fds(uint64_t key, const int *fds, int n) noexcept
+	{
+		return fdserver_register_fds(ctx_, key, fds, n);
+	}
+
+	/* see fdserver_register_path() */
+	int register_path(uint64_t key, int dirfd, const char *path,
+			  int flags, int idle_ms = 0) noexcept
+	{
+		return fdserver_register_path(ctx_, key, dirfd, path, flags,
+					      idle_ms);
+	}
+
+	int deregister_fd(uint64_t key) noexcept
+	{
+		return fdserver_deregister_fd(ctx_, key);
+	}
+
+	UniqueFd lookup_fd(uint64_t key) noexcept
+	{
+		return UniqueFd(fdserver_lookup_fd(ctx_, key));
+	}
+
+	UniqueFd lookup_fd(uint64_t key, void *meta, size_t *size) noexcept
+	{
+		return UniqueFd(fdserver_lookup_fd_meta(ctx_, key, meta, size));
+	}
+
+	/* see fdserver_lookup_fds() */
+	int lookup_fds(uint64_t key, UniqueFd *fds, int max) noexcept
+	{
+		int raw[FDSERVER_MAX_GROUP];
+		int ret;
+
+		ret = fdserver_lookup_fds(ctx_, key, raw,
+					  max < FDSERVER_MAX_GROUP ?
+					  max : FDSERVER_MAX_GROUP);
+		for (int i = 0; i < ret; i++)
+			fds[i].reset(raw[i]);
+		return ret;
+	}
+
+	/* see fdserver_lookup_batch(), fds[i] is left empty if not found */
+	int lookup_batch(const uint64_t *keys, int n, UniqueFd *fds) noexcept
+	{
+		int raw[FDSERVER_MAX_BATCH];
+		int ret;
+
+		ret = fdserver_lookup_batch(ctx_, keys, n, raw);
+		if (ret < 0)
+			return ret;
+		for (int i = 0; i < n; i++)
+			fds[i].reset(raw[i]);
+		return ret;
+	}
+
+	/* see fdserver_reverse_lookup() */
+	int reverse_lookup(int fd, uint64_t *keys, int max) noexcept
+	{
+		return fdserver_reverse_lookup(ctx_, fd, keys, max);
+	}
+
+	/* see fdserver_queue_push() and fdserver_queue_pop() */
+	int queue_push(uint64_t key, int fd) noexcept
+	{
+		return fdserver_queue_push(ctx_, key, fd);
+	}
+
+	UniqueFd queue_pop(uint64_t key, int timeout_ms) noexcept
+	{
+		return UniqueFd(fdserver_queue_pop(ctx_, key, timeout_ms));
+	}
+
+	/* see fdserver_publish() */
+	int publish(uint64_t key, const int *fds, int n,
+		    int *skipped = nullptr) noexcept
+	{
+		return fdserver_publish(ctx_, key, fds, n, skipped);
+	}
+
+private:
+	/* the handle is plain data living in storage_, see fdserver.h */
+	void take(Context &other) noexcept
+	{
+		if (other.ctx_ == nullptr)
+			return;
+		storage_ = other.storage_;
+		ctx_ = reinterpret_cast<fdserver_context_t *>(&storage_);
+		other.ctx_ = nullptr;
+	}
+
+	fdserver_context_storage_t storage_;
+	fdserver_context_t *ctx_;
+};
+
+} /* namespace fdserver */
+
+#endif
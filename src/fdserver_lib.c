@@ -34,6 +34,16 @@
  *
  * Note again that the file descriptors stored here are local to this server
  * process and get converted both when registered or looked up.
+ *
+ * Each thread keeps its own connection to the server, opened on first use
+ * and reused by all later requests of that thread, so that requests from
+ * different threads never wait on each other.
+ *
+ * With the journal enabled, the contexts created by the process and their
+ * registrations are remembered (with a dup of the fds), and replayed when
+ * a connection finds the server restarted, i.e. of another epoch. The
+ * handles of the process keep their original identity, which requests map
+ * to the context standing for it in the current server.
  */
 
 
@@ -43,24 +53,223 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include <fdserver.h>
 #include <fdserver_internal.h>
 #include <fdserver_common.h>
 
 struct sockaddr_un fdserver_socket = {
-	.sun_family = SOCK_STREAM,
+	.sun_family = AF_UNIX,
 	.sun_path = FDSERVER_SOCKET_PATH
 };
 
-/* opens and returns a connected socket to the server */
-static int get_socket(void)
+/*
+ * type of the server socket: SOCK_SEQPACKET is tried first, falling back to
+ * SOCK_STREAM, and the type found is used by the later connections
+ */
+static int socket_type = SOCK_SEQPACKET;
+
+/* per thread connection to the server */
+struct client_conn {
+	int sock;
+	int seqpacket;
+	unsigned int generation;
+	uint32_t seq;
+	uint32_t capabilities;
+	uint64_t epoch;
+};
+
+static __thread struct client_conn conn = { .sock = -1 };
+/* bumped to have every thread reconnect, e.g. when the path changes */
+static unsigned int conn_generation;
+static pthread_once_t conn_once = PTHREAD_ONCE_INIT;
+static pthread_key_t conn_key;
+
+/* registration to replay, holding a dup of its fds */
+struct journal_entry {
+	struct journal_entry *next;
+	uint64_t key;
+	uint32_t command;	/* FD_REGISTER_REQ or FD_REGISTER_PATH_REQ */
+	uint32_t flags;		/* FD_FLAG_EVICTABLE */
+	uint32_t size;		/* of the payload, following the fds */
+	uint32_t nfds;
+	int fds[];
+};
+
+/* context created by this process */
+struct journal_context {
+	struct journal_context *next;
+	struct fdserver_context handle;	/* as known to the process */
+	struct fdserver_context current; /* in the current server */
+	uint32_t access;
+	char name[FDSERVER_MAX_CONTEXT_NAME]; /* empty if not named */
+	struct journal_entry *entries;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int enabled;
+	uint64_t epoch; /* of the server the contexts are in, 0 if unknown */
+	struct journal_context *contexts;
+} journal = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* timeout of every call in ms, -1 for none */
+static int call_timeout = -1;
+/* deadline of the calls of this thread, 0 for none */
+static __thread uint64_t thread_deadline;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* deadline of a call starting now, 0 for none */
+static uint64_t call_deadline(void)
+{
+	uint64_t deadline = thread_deadline;
+	uint64_t timeout;
+
+	if (call_timeout >= 0) {
+		timeout = now_ns() + (uint64_t)call_timeout * 1000000;
+		if (deadline == 0 || timeout < deadline)
+			deadline = timeout;
+	}
+
+	return deadline;
+}
+
+/*
+ * Wait for the socket to be readable, until the deadline (if any).
+ * Return -1 with errno set to ETIMEDOUT if it passed, 0 otherwise.
+ */
+static int wait_readable(int sock, uint64_t deadline)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	uint64_t now;
+	int res;
+
+	if (deadline == 0)
+		return 0;
+
+	do {
+		now = now_ns();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		res = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+	} while (res < 0 && errno == EINTR);
+
+	if (res == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return res < 0 ? -1 : 0;
+}
+
+/* bound the time a blocking connect or send may take */
+static void set_send_timeout(int sock, uint64_t deadline)
+{
+	struct timeval tv = { 0, 0 };
+	uint64_t now = now_ns();
+
+	if (deadline != 0) {
+		/* a zero timeout means none, make it as short as possible */
+		tv.tv_usec = 1;
+		if (deadline > now) {
+			tv.tv_sec = (deadline - now) / 1000000000;
+			tv.tv_usec = (deadline - now) % 1000000000 / 1000 + 1;
+		}
+	}
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void drop_connection(void)
+{
+	if (conn.sock >= 0)
+		close(conn.sock);
+	conn.sock = -1;
+}
+
+static void free_journal_entry(struct journal_entry *entry)
+{
+	for (uint32_t i = 0; i < entry->nfds; i++)
+		close(entry->fds[i]);
+	free(entry);
+}
+
+static void free_journal_context(struct journal_context *context)
+{
+	struct journal_entry *entry;
+
+	while (context->entries != NULL) {
+		entry = context->entries;
+		context->entries = entry->next;
+		free_journal_entry(entry);
+	}
+	free(context);
+}
+
+/* forget every context, journal.lock held */
+static void clear_journal(void)
+{
+	struct journal_context *context;
+
+	while (journal.contexts != NULL) {
+		context = journal.contexts;
+		journal.contexts = context->next;
+		free_journal_context(context);
+	}
+	journal.epoch = 0;
+}
+
+/* the child must not share its parent's connection, nor replay its
+ * registrations */
+static void conn_atfork_child(void)
+{
+	drop_connection();
+	pthread_mutex_init(&journal.lock, NULL);
+	clear_journal();
+}
+
+static void conn_destructor(void *arg)
+{
+	struct client_conn *c = arg;
+
+	if (c->sock >= 0)
+		close(c->sock);
+	c->sock = -1;
+}
+
+static void conn_init_once(void)
+{
+	pthread_key_create(&conn_key, conn_destructor);
+	pthread_atfork(NULL, NULL, conn_atfork_child);
+}
+
+/*
+ * opens and returns a connected socket to the server, *seqpacket telling
+ * whether it is a SOCK_SEQPACKET one
+ */
+static int get_socket(uint64_t deadline, int *seqpacket)
 {
 	int s_sock; /* server socket */
 	struct sockaddr_un remote;
+	int type = socket_type;
 	int len;
 
-	s_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+again:
+	s_sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
 	if (s_sock == -1) {
 		ODP_ERR("Cannot create socket: %s\n", strerror(errno));
 		return -1;
@@ -68,159 +277,1742 @@ static int get_socket(void)
 
 	memcpy(&remote, &fdserver_socket, sizeof(struct sockaddr_un));
 	len = strlen(remote.sun_path) + sizeof(remote.sun_family);
+	/* connect waits for room in the backlog of a busy server */
+	if (deadline != 0)
+		set_send_timeout(s_sock, deadline);
 	while (connect(s_sock, (struct sockaddr *)&remote, len) == -1) {
 		if (errno == EINTR)
 			continue;
+		if (errno == EPROTOTYPE && type == SOCK_SEQPACKET) {
+			close(s_sock);
+			type = SOCK_STREAM;
+			socket_type = type;
+			goto again;
+		}
+		if (errno == EAGAIN || errno == EINPROGRESS)
+			errno = ETIMEDOUT;
 		ODP_ERR("cannot connect to server: %s\n", strerror(errno));
 		close(s_sock);
 		return -1;
 	}
+	if (deadline != 0)
+		set_send_timeout(s_sock, 0);
+	*seqpacket = type == SOCK_SEQPACKET;
 
 	return s_sock;
 }
 
-static int send_command(int command, fdserver_context_t *context,
-			uint64_t *key, int *fd)
+/* agree on the protocol version and learn the server capabilities */
+static int say_hello(int sock, int seqpacket, uint32_t *capabilities,
+		     uint64_t *epoch, uint64_t deadline)
 {
-	int s_sock;
-	int res;
-	int retval = -1;
+	fdserver_hdr_t hdr;
+	struct fdserver_hello hello;
+	int fds[FDSERVER_MAX_FDS];
 
-	if (context == NULL)
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&hello, 0, sizeof(hello));
+	hdr.command = FD_HELLO;
+	hdr.length = sizeof(hello);
+	hello.version = FDSERVER_PROTO_VERSION;
+	hdr.deadline = deadline;
+
+	if (fdserver_internal_send_frame(sock, &hdr, NULL, &hello) ||
+	    wait_readable(sock, deadline) ||
+	    fdserver_internal_recv(sock, seqpacket, &hdr, fds, &hello,
+				   sizeof(hello)))
 		return -1;
 
-	s_sock = get_socket();
-	if (s_sock < 0)
+	while (hdr.nfds > 0)
+		close(fds[--hdr.nfds]);
+
+	/* servers older than the epoch do not send it */
+	if (hdr.command != FD_RETVAL_SUCCESS ||
+	    hdr.length < offsetof(struct fdserver_hello, epoch) ||
+	    hello.version != FDSERVER_PROTO_VERSION) {
+		ODP_ERR("fdserver protocol version mismatch\n");
+		errno = EPROTO;
 		return -1;
+	}
+	*capabilities = hello.capabilities;
+	*epoch = hdr.length >= sizeof(hello) ? hello.epoch : 0;
 
-	res = fdserver_internal_send_msg(s_sock, command, context,
-					 *key, *fd);
-	if (res < 0) {
-		ODP_ERR("Failed to send message to fdserver\n");
-		close(s_sock);
+	return 0;
+}
+
+/*
+ * send a request of the journal replay on the connection, its reply
+ * being read by journal_reply()
+ */
+static int journal_send(struct client_conn *c, fdserver_hdr_t *hdr,
+			const int *fds, const void *data, uint64_t deadline)
+{
+	hdr->seq = ++c->seq;
+	hdr->deadline = deadline;
+
+	return fdserver_internal_send_frame(c->sock, hdr, fds, data);
+}
+
+/* Return -1 on error, otherwise the status of the reply */
+static int journal_reply(struct client_conn *c, fdserver_hdr_t *hdr,
+			 uint64_t deadline)
+{
+	int fds[FDSERVER_MAX_FDS];
+
+	if (wait_readable(c->sock, deadline) != 0 ||
+	    fdserver_internal_recv(c->sock, c->seqpacket, hdr, fds,
+				   NULL, 0) != 0)
+		return -1;
+
+	while (hdr->nfds > 0)
+		close(fds[--hdr->nfds]);
+
+	return hdr->command;
+}
+
+/*
+ * create a context of the journal in the server, then register its
+ * entries, pipelining up to FDSERVER_MAX_BATCH requests at a time.
+ * Return -1 if the connection failed, 0 otherwise, the failures of the
+ * server being logged.
+ */
+static int replay_context(struct client_conn *c,
+			  struct journal_context *context, uint64_t deadline)
+{
+	struct fdserver_context_name name;
+	struct journal_entry *entry, *first;
+	fdserver_hdr_t hdr;
+	int status;
+	int n;
+
+	memset(&name, 0, sizeof(name));
+	name.access = context->access;
+	strcpy(name.name, context->name);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = FD_NEW_CONTEXT;
+	if (context->name[0] != '\0') {
+		hdr.command = FD_NEW_NAMED_CONTEXT;
+		hdr.length = sizeof(name);
+	}
+	if (journal_send(c, &hdr, NULL, &name, deadline) != 0)
 		return -1;
+	status = journal_reply(c, &hdr, deadline);
+	/* another process of the same name may have been first */
+	if (status == EEXIST && context->name[0] != '\0') {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.command = FD_OPEN_CONTEXT;
+		hdr.length = sizeof(name);
+		if (journal_send(c, &hdr, NULL, &name, deadline) != 0)
+			return -1;
+		status = journal_reply(c, &hdr, deadline);
 	}
+	if (status != FD_RETVAL_SUCCESS) {
+		if (status > 0)
+			ODP_ERR("fdserver: Cannot recreate a context: %s\n",
+				strerror(status));
+		return status < 0 ? -1 : 0;
+	}
+	context->current = hdr.context;
 
-	res = fdserver_internal_recv_msg(s_sock, &retval, context,
-					 key, fd);
-	close(s_sock);
-	if ((res < 0) || (retval != FD_RETVAL_SUCCESS)) {
-		ODP_ERR("Error receiving message from fdserver\n");
-		return retval;
+	for (first = context->entries; first != NULL; first = entry) {
+		n = 0;
+		for (entry = first; entry != NULL && n < FDSERVER_MAX_BATCH;
+		     entry = entry->next, n++) {
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.command = entry->command;
+			hdr.flags = entry->flags;
+			hdr.context = context->current;
+			hdr.key = entry->key;
+			hdr.nfds = entry->nfds;
+			hdr.length = entry->size;
+			if (journal_send(c, &hdr, entry->fds,
+					 &entry->fds[entry->nfds],
+					 deadline) != 0)
+				return -1;
+		}
+
+		while (n-- > 0) {
+			status = journal_reply(c, &hdr, deadline);
+			if (status < 0)
+				return -1;
+			if (status != FD_RETVAL_SUCCESS)
+				ODP_ERR("fdserver: Cannot register key %"
+					PRIu64 " again: %s\n", hdr.key,
+					strerror(status));
+		}
 	}
 
 	return 0;
 }
 
 /*
- * Client function:
- * Register a file descriptor to the server. Return -1 on error.
+ * replay the journal if the server is not the one its contexts were
+ * created in. Return -1 if the connection failed, 0 otherwise.
  */
-int fdserver_register_fd(fdserver_context_t *context, uint64_t key,
-			 int fd_to_send)
+static int replay_journal(struct client_conn *c, uint64_t deadline)
 {
-	int res;
+	struct journal_context *context;
+	int ret = 0;
 
-	FD_ODP_DBG("FD client register: pid=%d key=%" PRIu64 ", fd=%d\n",
-		   getpid(), key, fd_to_send);
+	if (!__atomic_load_n(&journal.enabled, __ATOMIC_ACQUIRE) ||
+	    c->epoch == 0)
+		return 0;
 
-	res = send_command(FD_REGISTER_REQ, context, &key, &fd_to_send);
-	if (res != 0)
-		ODP_ERR("fd registration failure\n");
+	pthread_mutex_lock(&journal.lock);
+	if (journal.epoch != 0 && journal.epoch != c->epoch) {
+		for (context = journal.contexts; context != NULL;
+		     context = context->next) {
+			ret = replay_context(c, context, deadline);
+			if (ret != 0)
+				break;
+		}
+	}
+	/* otherwise replayed again by the next connection */
+	if (ret == 0)
+		__atomic_store_n(&journal.epoch, c->epoch, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&journal.lock);
 
-	return res;
+	return ret;
+}
+
+/* the context standing for the handle in the current server */
+static struct fdserver_context journal_map(const struct fdserver_context
+					   *handle)
+{
+	struct journal_context *context;
+	struct fdserver_context current = *handle;
+
+	if (!__atomic_load_n(&journal.enabled, __ATOMIC_ACQUIRE))
+		return current;
+
+	pthread_mutex_lock(&journal.lock);
+	for (context = journal.contexts; context != NULL;
+	     context = context->next) {
+		if (context->handle.index == handle->index &&
+		    context->handle.token == handle->token) {
+			current = context->current;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	return current;
+}
+
+/* journal.lock held */
+static struct journal_context *find_journal_context(const struct
+						     fdserver_context *handle)
+{
+	struct journal_context *context;
+
+	for (context = journal.contexts; context != NULL;
+	     context = context->next) {
+		if (context->handle.index == handle->index &&
+		    context->handle.token == handle->token)
+			return context;
+	}
+
+	return NULL;
+}
+
+/* journal.lock held */
+static struct journal_entry *new_journal_entry(uint64_t key,
+					       uint32_t command,
+					       const int *fds, uint32_t nfds,
+					       const void *payload,
+					       uint32_t size, uint32_t flags)
+{
+	struct journal_entry *entry;
+
+	entry = malloc(sizeof(*entry) + nfds * sizeof(int) + size);
+	if (entry == NULL)
+		return NULL;
+
+	entry->key = key;
+	entry->command = command;
+	entry->flags = flags;
+	entry->size = size;
+	for (entry->nfds = 0; entry->nfds < nfds; entry->nfds++) {
+		entry->fds[entry->nfds] = fcntl(fds[entry->nfds],
+						F_DUPFD_CLOEXEC, 0);
+		if (entry->fds[entry->nfds] < 0) {
+			free_journal_entry(entry);
+			return NULL;
+		}
+	}
+	if (size > 0)
+		memcpy(&entry->fds[nfds], payload, size);
+
+	return entry;
 }
 
 /*
- * Client function:
- * Deregister a file descriptor from the server. Return -1 on error.
+ * remember a context created in the server by this thread, along with the
+ * entries of source if it is a clone
  */
-int fdserver_deregister_fd(fdserver_context_t *context, uint64_t key)
+static void journal_new_context(const struct fdserver_context *handle,
+				const struct fdserver_context *source,
+				const char *name, uint32_t access)
 {
-	int res;
-	int fd = -1;
+	struct journal_context *context, *from;
+	struct journal_entry *entry, **tail;
 
-	FD_ODP_DBG("FD client deregister: pid=%d key=%" PRIu64 "\n",
-		   getpid(), key);
+	if (!__atomic_load_n(&journal.enabled, __ATOMIC_ACQUIRE))
+		return;
 
-	res = send_command(FD_DEREGISTER_REQ, context, &key, &fd);
-	if (res != 0)
-		ODP_ERR("fd de-registration failure\n");
+	context = calloc(1, sizeof(*context));
+	if (context == NULL) {
+		ODP_ERR("fdserver: Cannot journal a context\n");
+		return;
+	}
+	context->handle = *handle;
+	context->current = *handle;
+	context->access = access;
+	if (name != NULL)
+		strcpy(context->name, name);
 
-	return res;
+	pthread_mutex_lock(&journal.lock);
+	from = source != NULL ? find_journal_context(source) : NULL;
+	tail = &context->entries;
+	for (entry = from != NULL ? from->entries : NULL; entry != NULL;
+	     entry = entry->next) {
+		*tail = new_journal_entry(entry->key, entry->command,
+					  entry->fds, entry->nfds,
+					  &entry->fds[entry->nfds],
+					  entry->size, entry->flags);
+		if (*tail == NULL)
+			break;
+		tail = &(*tail)->next;
+	}
+	*tail = NULL;
+	/* the context was created in the server of this connection */
+	if (journal.epoch == 0)
+		__atomic_store_n(&journal.epoch, conn.epoch, __ATOMIC_RELEASE);
+	context->next = journal.contexts;
+	journal.contexts = context;
+	pthread_mutex_unlock(&journal.lock);
+}
+
+static void journal_del_context(const struct fdserver_context *handle)
+{
+	struct journal_context **prev, *context;
+
+	if (!__atomic_load_n(&journal.enabled, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&journal.lock);
+	for (prev = &journal.contexts; *prev != NULL;
+	     prev = &(*prev)->next) {
+		context = *prev;
+		if (context->handle.index == handle->index &&
+		    context->handle.token == handle->token) {
+			*prev = context->next;
+			free_journal_context(context);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&journal.lock);
 }
 
 /*
- * client function:
- * lookup a file descriptor from the server. return -1 on error,
- * or the file descriptor on success (>=0).
+ * remember the request registering key in a context of the journal, with
+ * its fds and payload, or its deregistration if command is 0.
+ * A replacement keeps the flags it replaces.
  */
-int fdserver_lookup_fd(fdserver_context_t *context, uint64_t key)
+static void journal_register(const struct fdserver_context *handle,
+			     uint64_t key, uint32_t command,
+			     const int *fds, uint32_t nfds,
+			     const void *payload, uint32_t size,
+			     uint32_t flags)
 {
-	int res;
-	int fd = -1;
+	struct journal_entry **prev, *old = NULL, *entry = NULL;
+	struct journal_context *context;
 
-	FD_ODP_DBG("FD client lookup: pid=%d, key=%" PRIu64 ", fd=%d\n",
-		   getpid(), key, fd);
+	if (!__atomic_load_n(&journal.enabled, __ATOMIC_ACQUIRE))
+		return;
 
-	res = send_command(FD_LOOKUP_REQ, context, &key, &fd);
-	if (res != 0) {
-		ODP_ERR("fd lookup failure\n");
-		return -1;
+	pthread_mutex_lock(&journal.lock);
+	context = find_journal_context(handle);
+	if (context == NULL)
+		goto unlock_exit;
+
+	for (prev = &context->entries; *prev != NULL;
+	     prev = &(*prev)->next) {
+		if ((*prev)->key == key) {
+			old = *prev;
+			*prev = old->next;
+			flags |= old->flags;
+			free_journal_entry(old);
+			break;
+		}
 	}
 
-	return fd;
+	if (command != 0) {
+		entry = new_journal_entry(key, command, fds, nfds, payload,
+					  size, flags);
+		if (entry == NULL) {
+			ODP_ERR("fdserver: Cannot journal key %" PRIu64 "\n",
+				key);
+			goto unlock_exit;
+		}
+		entry->next = context->entries;
+		context->entries = entry;
+	}
+
+unlock_exit:
+	pthread_mutex_unlock(&journal.lock);
 }
 
-int fdserver_new_context(fdserver_context_t **ctx)
+/* returns this thread's connection, connecting if needed */
+static struct client_conn *get_connection(void)
 {
-	int res;
-	struct fdserver_context *context;
-	uint64_t key = 0;
-	int fd = -1;
+	uint64_t deadline;
 
-	FD_ODP_DBG("FD New context pid=%d\n", getpid());
+	pthread_once(&conn_once, conn_init_once);
+
+	if (conn.sock >= 0 && conn.generation != conn_generation)
+		drop_connection();
+
+	if (conn.sock >= 0)
+		return &conn;
+
+	deadline = call_deadline();
+	conn.sock = get_socket(deadline, &conn.seqpacket);
+	if (conn.sock < 0)
+		return NULL;
+
+	conn.generation = conn_generation;
+	conn.seq = 0;
+	if (say_hello(conn.sock, conn.seqpacket, &conn.capabilities,
+		      &conn.epoch, deadline) != 0 ||
+	    replay_journal(&conn, deadline) != 0) {
+		drop_connection();
+		return NULL;
+	}
+	pthread_setspecific(conn_key, &conn);
+
+	return &conn;
+}
+
+/*
+ * Send a request to the server and wait for its reply.
+ * hdr holds the request on input (the caller fills in the command, context,
+ * key, nfds and length), and the header of the reply on output. The reply
+ * file descriptors are stored in reply_fds, which must have room for
+ * FDSERVER_MAX_FDS of them, and its payload in reply_data.
+ * The server is given deadline, and its reply waited for until wait.
+ * Return 0 on success, or -1 with errno set to the reason of the failure.
+ */
+static int send_command_until(fdserver_hdr_t *hdr, const int *fds,
+			      const void *data, int *reply_fds,
+			      void *reply_data, uint32_t reply_size,
+			      uint64_t deadline, uint64_t wait)
+{
+	struct fdserver_context handle = hdr->context;
+	struct client_conn *c;
+	int retry = 1;
+	uint32_t seq;
 
-	if (ctx == NULL)
+again:
+	c = get_connection();
+	if (c == NULL)
 		return -1;
 
-	context = malloc(sizeof(fdserver_context_t));
-	if (context == NULL)
+	/* the server may have been restarted by now, see replay_journal() */
+	hdr->context = journal_map(&handle);
+	hdr->seq = seq = ++c->seq;
+	hdr->deadline = deadline;
+	if (fdserver_internal_send_frame(c->sock, hdr, fds, data) != 0) {
+		drop_connection();
+		/* the server went away since our last request (e.g. it was
+		 * restarted), which has therefore not been handled: retry */
+		if (retry-- && (errno == EPIPE || errno == ECONNRESET))
+			goto again;
+		ODP_ERR("Failed to send message to fdserver\n");
 		return -1;
+	}
 
-	context->index = 0;
-	context->token = 0;
-	res = send_command(FD_NEW_CONTEXT, context, &key, &fd);
-	if (res != 0) {
-		ODP_ERR("FD Failed to create context\n");
-		free(context);
+	/* the reply may still come after the deadline: drop the connection
+	 * so that it is not mistaken for the reply of a later request */
+	if (wait_readable(c->sock, wait) != 0 ||
+	    fdserver_internal_recv(c->sock, c->seqpacket, hdr, reply_fds,
+				   reply_data, reply_size) != 0) {
+		ODP_ERR("Error receiving message from fdserver\n");
+		drop_connection();
 		return -1;
 	}
 
-	*ctx = context;
+	if (hdr->seq != seq) {
+		while (hdr->nfds > 0)
+			close(reply_fds[--hdr->nfds]);
+		drop_connection();
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (hdr->command != FD_RETVAL_SUCCESS) {
+		while (hdr->nfds > 0)
+			close(reply_fds[--hdr->nfds]);
+		errno = hdr->command;
+		return -1;
+	}
 
 	return 0;
 }
 
-int fdserver_del_context(fdserver_context_t **ctx)
+static int send_command(fdserver_hdr_t *hdr, const int *fds, const void *data,
+			int *reply_fds, void *reply_data, uint32_t reply_size)
+{
+	uint64_t deadline = call_deadline();
+
+	return send_command_until(hdr, fds, data, reply_fds, reply_data,
+				  reply_size, deadline, deadline);
+}
+
+static void init_request(fdserver_hdr_t *hdr, int command,
+			 fdserver_context_t *context, uint64_t key)
+{
+	memset(hdr, 0, sizeof(fdserver_hdr_t));
+	hdr->command = command;
+	if (context != NULL)
+		hdr->context = *context;
+	hdr->key = key;
+}
+
+/*
+ * Return the only file descriptor a reply is expected to carry, closing any
+ * other, or -1 if there is none.
+ */
+static int reply_fd(fdserver_hdr_t *hdr, int *fds)
+{
+	while (hdr->nfds > 1)
+		close(fds[--hdr->nfds]);
+
+	if (hdr->nfds == 0) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return fds[0];
+}
+
+/*
+ * Client function:
+ * Register a file descriptor to the server. Return -1 on error.
+ */
+int fdserver_register_fd(fdserver_context_t *context, uint64_t key,
+			 int fd_to_send)
+{
+	return fdserver_register_fd_meta(context, key, fd_to_send, NULL, 0);
+}
+
+/*
+ * register the n file descriptors of fds_to_send, with their metadata
+ * and FDSERVER_REGISTER_* flags
+ */
+static int register_fds(fdserver_context_t *context, uint64_t key,
+			const int *fds_to_send, int n,
+			const void *meta, size_t size, int flags)
 {
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	struct client_conn *c;
 	int res;
-	uint64_t key = 0;
-	int retval = -1;
 
-	FD_ODP_DBG("FD Delete context pid=%d\n", getpid());
+	FD_ODP_DBG("FD client register: pid=%d key=%" PRIu64 ", fd=%d, "
+		   "n=%d, size=%zu\n", getpid(), key, fds_to_send[0], n, size);
 
-	if (ctx == NULL || *ctx == NULL)
+	if (context == NULL || n <= 0 || n > FDSERVER_MAX_GROUP ||
+	    size > FDSERVER_MAX_METADATA || (meta == NULL && size != 0) ||
+	    (flags & ~FDSERVER_REGISTER_EVICTABLE)) {
+		errno = EINVAL;
 		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (fds_to_send[i] < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
 
-	res = send_command(FD_DEL_CONTEXT, *ctx, &key, &retval);
-	if (res != 0) {
-		ODP_ERR("FD Failed to remove context\n");
+	if (n > 1 || flags != 0) {
+		c = get_connection();
+		if (c == NULL)
+			return -1;
+		if ((n > 1 && !(c->capabilities & FD_CAP_GROUP)) ||
+		    (flags != 0 && !(c->capabilities & FD_CAP_EVICT))) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+	}
+
+	init_request(&hdr, FD_REGISTER_REQ, context, key);
+	if (flags & FDSERVER_REGISTER_EVICTABLE)
+		hdr.flags |= FD_FLAG_EVICTABLE;
+	hdr.nfds = n;
+	hdr.length = size;
+	res = send_command(&hdr, fds_to_send, meta, fds, NULL, 0);
+	if (res != 0)
+		ODP_ERR("fd registration failure\n");
+	else
+		journal_register(context, key, FD_REGISTER_REQ, fds_to_send, n,
+				 meta, size,
+				 flags & FDSERVER_REGISTER_EVICTABLE ?
+				 FD_FLAG_EVICTABLE : 0);
+
+	return res;
+}
+
+/*
+ * Client function:
+ * Register a file descriptor along with its metadata. Return -1 on error.
+ */
+int fdserver_register_fd_meta(fdserver_context_t *context, uint64_t key,
+			      int fd_to_send, const void *meta, size_t size)
+{
+	return register_fds(context, key, &fd_to_send, 1, meta, size, 0);
+}
+
+/*
+ * Client function:
+ * Register a file descriptor along with its metadata and flags.
+ */
+int fdserver_register_fd_flags(fdserver_context_t *context, uint64_t key,
+			       int fd_to_send, const void *meta, size_t size,
+			       int flags)
+{
+	return register_fds(context, key, &fd_to_send, 1, meta, size, flags);
+}
+
+/*
+ * Client function:
+ * Register an ordered group of file descriptors under a single key.
+ */
+int fdserver_register_fds(fdserver_context_t *context, uint64_t key,
+			  const int *fds, int n)
+{
+	if (fds == NULL) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	free(*ctx);
-	*ctx = NULL;
+	return register_fds(context, key, fds, n, NULL, 0, 0);
+}
+
+/*
+ * Client function:
+ * Register a path for the server to open on the first lookup of key.
+ */
+int fdserver_register_path(fdserver_context_t *context, uint64_t key,
+			   int dirfd, const char *path, int flags,
+			   int idle_ms)
+{
+	char payload[sizeof(struct fdserver_lazy_path) + PATH_MAX];
+	struct fdserver_lazy_path lazy;
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	struct client_conn *c;
+	size_t len;
+	int cwd = -1;
+	int res;
+
+	FD_ODP_DBG("FD client register path: pid=%d key=%" PRIu64 ", %s\n",
+		   getpid(), key, path);
+
+	if (context == NULL || path == NULL || path[0] == '\0' ||
+	    idle_ms < 0 || (path[0] != '/' && dirfd < 0 &&
+			    dirfd != AT_FDCWD)) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = strlen(path) + 1;
+	if (len > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_LAZY)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	init_request(&hdr, FD_REGISTER_PATH_REQ, context, key);
+	/* the server resolves relative paths from a directory of ours */
+	if (path[0] != '/') {
+		if (dirfd == AT_FDCWD) {
+			cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (cwd < 0)
+				return -1;
+			dirfd = cwd;
+		}
+		hdr.nfds = 1;
+	}
+
+	lazy.flags = flags;
+	lazy.idle_ms = idle_ms;
+	memcpy(payload, &lazy, sizeof(lazy));
+	memcpy(payload + sizeof(lazy), path, len);
+	hdr.length = sizeof(lazy) + len;
+	res = send_command(&hdr, &dirfd, payload, fds, NULL, 0);
+	if (res == 0)
+		journal_register(context, key, FD_REGISTER_PATH_REQ, &dirfd,
+				 path[0] != '/', payload,
+				 sizeof(lazy) + len, 0);
+
+	if (cwd >= 0)
+		close(cwd);
+
+	return res;
+}
+
+static int replace_fd(fdserver_context_t *context, uint64_t key,
+		      int fd_to_send, const void *meta, size_t size,
+		      uint32_t flags, uint64_t expected, uint64_t *generation)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	char payload[sizeof(struct fdserver_replace) + FDSERVER_MAX_METADATA];
+	struct fdserver_replace replace;
+	uint64_t current = 0;
+	struct client_conn *c;
+	int res;
+
+	FD_ODP_DBG("FD client replace: pid=%d key=%" PRIu64 ", fd=%d\n",
+		   getpid(), key, fd_to_send);
+
+	if (context == NULL || fd_to_send < 0 ||
+	    size > FDSERVER_MAX_METADATA || (meta == NULL && size != 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_REPLACE)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	memset(&replace, 0, sizeof(replace));
+	replace.expected = expected;
+	replace.flags = flags;
+	memcpy(payload, &replace, sizeof(replace));
+	if (size > 0)
+		memcpy(payload + sizeof(replace), meta, size);
+
+	init_request(&hdr, FD_REPLACE_REQ, context, key);
+	hdr.nfds = 1;
+	hdr.length = sizeof(replace) + size;
+	res = send_command(&hdr, &fd_to_send, payload, fds,
+			   &current, sizeof(current));
+	/* on ESTALE, the reply has the current generation */
+	if ((res == 0 || errno == ESTALE) && generation != NULL &&
+	    hdr.length == sizeof(current))
+		*generation = current;
+	if (res == 0)
+		journal_register(context, key, FD_REGISTER_REQ, &fd_to_send, 1,
+				 meta, size, 0);
+
+	return res;
+}
+
+/*
+ * Client function:
+ * Register a file descriptor in place of the current one, atomically.
+ */
+int fdserver_replace_fd(fdserver_context_t *context, uint64_t key,
+			int fd_to_send, uint64_t *generation)
+{
+	return replace_fd(context, key, fd_to_send, NULL, 0, 0, 0,
+			  generation);
+}
+
+int fdserver_replace_fd_meta(fdserver_context_t *context, uint64_t key,
+			     int fd_to_send, const void *meta, size_t size,
+			     uint64_t *generation)
+{
+	return replace_fd(context, key, fd_to_send, meta, size, 0, 0,
+			  generation);
+}
+
+/*
+ * Client function:
+ * Replace a file descriptor only if the current one is of the expected
+ * generation.
+ */
+int fdserver_compare_replace_fd(fdserver_context_t *context, uint64_t key,
+				int fd_to_send, uint64_t expected,
+				uint64_t *generation)
+{
+	return replace_fd(context, key, fd_to_send, NULL, 0, FD_REPLACE_CAS,
+			  expected, generation);
+}
+
+/*
+ * Client function:
+ * Deregister a file descriptor from the server. Return -1 on error.
+ */
+int fdserver_deregister_fd(fdserver_context_t *context, uint64_t key)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	int res;
+
+	FD_ODP_DBG("FD client deregister: pid=%d key=%" PRIu64 "\n",
+		   getpid(), key);
+
+	if (context == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	init_request(&hdr, FD_DEREGISTER_REQ, context, key);
+	res = send_command(&hdr, NULL, NULL, fds, NULL, 0);
+	if (res != 0)
+		ODP_ERR("fd de-registration failure\n");
+	else
+		journal_register(context, key, 0, NULL, 0, NULL, 0, 0);
+
+	return res;
+}
+
+/*
+ * Serve a lookup from the server embedded in this process, if that is the
+ * server in use: up to *nfds file descriptors of the value are returned in
+ * fds, *nfds being set to the size of the group, or to 0 on error (with
+ * errno set). Return 1 if served, 0 if the lookup is to be sent to the
+ * server.
+ */
+static int lookup_group_locally(fdserver_context_t *context, uint64_t key,
+				int *fds, uint32_t *nfds, void *meta,
+				uint32_t *size, uint64_t *generation)
+{
+	struct fdserver_context current = journal_map(context);
+	uint64_t epoch = 0;
+	int status;
+
+	/* a restarted server is left to the socket, to replay the journal */
+	if (__atomic_load_n(&journal.enabled, __ATOMIC_ACQUIRE))
+		epoch = __atomic_load_n(&journal.epoch, __ATOMIC_ACQUIRE);
+	status = fdserver_internal_local_lookup(fdserver_socket.sun_path,
+						epoch, &current, key, fds,
+						nfds, meta, size, generation);
+	if (status < 0)
+		return 0;
+
+	if (status != FD_RETVAL_SUCCESS) {
+		*nfds = 0;
+		errno = status;
+	}
+
+	return 1;
+}
+
+/* same as lookup_group_locally() for a single fd, -1 on error */
+static int lookup_locally(fdserver_context_t *context, uint64_t key, int *fd,
+			  void *meta, uint32_t *size, uint64_t *generation)
+{
+	uint32_t nfds = 1;
+
+	if (!lookup_group_locally(context, key, fd, &nfds,
+				  meta, size, generation))
+		return 0;
+	if (nfds == 0)
+		*fd = -1;
+
+	return 1;
+}
+
+/*
+ * client function:
+ * lookup a file descriptor from the server. return -1 on error,
+ * or the file descriptor on success (>=0).
+ */
+int fdserver_lookup_fd(fdserver_context_t *context, uint64_t key)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	int fd;
+
+	FD_ODP_DBG("FD client lookup: pid=%d, key=%" PRIu64 "\n",
+		   getpid(), key);
+
+	if (context == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (lookup_locally(context, key, &fd, NULL, NULL, NULL))
+		return fd;
+
+	init_request(&hdr, FD_LOOKUP_REQ, context, key);
+	if (send_command(&hdr, NULL, NULL, fds, NULL, 0) != 0) {
+		ODP_ERR("fd lookup failure\n");
+		return -1;
+	}
+
+	return reply_fd(&hdr, fds);
+}
+
+/*
+ * Client function:
+ * Lookup a file descriptor and the generation of its registration.
+ */
+int fdserver_lookup_fd_generation(fdserver_context_t *context, uint64_t key,
+				  uint64_t *generation)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	uint64_t current;
+	struct client_conn *c;
+	int fd;
+
+	if (context == NULL || generation == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (lookup_locally(context, key, &fd, NULL, NULL, generation))
+		return fd;
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_REPLACE)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	init_request(&hdr, FD_LOOKUP_REQ, context, key);
+	hdr.flags = FD_FLAG_GENERATION;
+	if (send_command(&hdr, NULL, NULL, fds,
+			 &current, sizeof(current)) != 0)
+		return -1;
+
+	if (hdr.length != sizeof(current)) {
+		while (hdr.nfds > 0)
+			close(fds[--hdr.nfds]);
+		errno = EPROTO;
+		return -1;
+	}
+	*generation = current;
+
+	return reply_fd(&hdr, fds);
+}
+
+/*
+ * Client function:
+ * Lookup a file descriptor and its metadata. Return -1 on error, or the file
+ * descriptor on success (>=0).
+ */
+int fdserver_lookup_fd_meta(fdserver_context_t *context, uint64_t key,
+			    void *meta, size_t *size)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	char buffer[FDSERVER_MAX_METADATA];
+	uint32_t length;
+	int fd;
+
+	FD_ODP_DBG("FD client lookup meta: pid=%d, key=%" PRIu64 "\n",
+		   getpid(), key);
+
+	if (context == NULL || size == NULL || (meta == NULL && *size != 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	length = *size < sizeof(buffer) ? *size : sizeof(buffer);
+	if (lookup_locally(context, key, &fd, meta, &length, NULL)) {
+		if (fd >= 0)
+			*size = length;
+		return fd;
+	}
+
+	init_request(&hdr, FD_LOOKUP_META_REQ, context, key);
+	if (send_command(&hdr, NULL, NULL, fds, buffer, sizeof(buffer)) != 0) {
+		ODP_ERR("fd lookup failure\n");
+		return -1;
+	}
+
+	if (*size > hdr.length)
+		*size = hdr.length;
+	if (*size > 0)
+		memcpy(meta, buffer, *size);
+	*size = hdr.length;
+
+	return reply_fd(&hdr, fds);
+}
+
+/*
+ * Client function:
+ * Lookup the group of file descriptors registered under key.
+ */
+int fdserver_lookup_fds(fdserver_context_t *context, uint64_t key,
+			int *fds, int max)
+{
+	fdserver_hdr_t hdr;
+	int reply_fds[FDSERVER_MAX_FDS];
+	uint32_t nfds;
+
+	FD_ODP_DBG("FD client lookup group: pid=%d, key=%" PRIu64 "\n",
+		   getpid(), key);
+
+	if (context == NULL || fds == NULL || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nfds = max;
+	if (lookup_group_locally(context, key, fds, &nfds, NULL, NULL, NULL)) {
+		if (nfds == 0)
+			return -1;
+		if (nfds <= (uint32_t)max)
+			return nfds;
+		for (int i = 0; i < max; i++)
+			close(fds[i]);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	init_request(&hdr, FD_LOOKUP_REQ, context, key);
+	if (send_command(&hdr, NULL, NULL, reply_fds, NULL, 0) != 0) {
+		ODP_ERR("fd lookup failure\n");
+		return -1;
+	}
+
+	if (hdr.nfds == 0) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (hdr.nfds > (uint32_t)max) {
+		while (hdr.nfds > 0)
+			close(reply_fds[--hdr.nfds]);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(fds, reply_fds, hdr.nfds * sizeof(int));
+
+	return hdr.nfds;
+}
+
+/*
+ * Client function:
+ * Lookup n keys in a single request.
+ */
+int fdserver_lookup_batch(fdserver_context_t *context, const uint64_t *keys,
+			  int n, int *fds)
+{
+	fdserver_hdr_t hdr;
+	int reply_fds[FDSERVER_MAX_FDS];
+	int32_t status[FDSERVER_MAX_BATCH];
+	struct client_conn *c;
+	uint32_t found = 0;
+	int i;
+
+	FD_ODP_DBG("FD client lookup batch: pid=%d, n=%d\n", getpid(), n);
+
+	if (context == NULL || keys == NULL || fds == NULL ||
+	    n <= 0 || n > FDSERVER_MAX_BATCH) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!lookup_locally(context, keys[i], &fds[i],
+				    NULL, NULL, NULL))
+			break;
+		if (fds[i] >= 0)
+			found++;
+		else if (errno != ENOENT)
+			goto close_exit;
+	}
+	if (i == n)
+		return found;
+	/* the embedded server stopped half way through */
+	while (i > 0)
+		if (fds[--i] >= 0)
+			close(fds[i]);
+	found = 0;
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_BATCH)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	init_request(&hdr, FD_LOOKUP_BATCH_REQ, context, 0);
+	hdr.length = n * sizeof(uint64_t);
+	if (send_command(&hdr, NULL, keys, reply_fds,
+			 status, sizeof(status)) != 0) {
+		ODP_ERR("fd batch lookup failure\n");
+		return -1;
+	}
+
+	if (hdr.length != n * sizeof(int32_t)) {
+		while (hdr.nfds > 0)
+			close(reply_fds[--hdr.nfds]);
+		errno = EPROTO;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (status[i] == FD_RETVAL_SUCCESS && found < hdr.nfds)
+			fds[i] = reply_fds[found++];
+		else
+			fds[i] = -1;
+	}
+	while (hdr.nfds > found)
+		close(reply_fds[--hdr.nfds]);
+
+	return found;
+
+close_exit:
+	while (i > 0)
+		if (fds[--i] >= 0)
+			close(fds[i]);
+	return -1;
+}
+
+/*
+ * Client function:
+ * Find the keys registered to the open file of fd.
+ */
+int fdserver_reverse_lookup(fdserver_context_t *context, int fd,
+			    uint64_t *keys, int max)
+{
+	fdserver_hdr_t hdr;
+	int reply_fds[FDSERVER_MAX_FDS];
+	uint64_t found[FDSERVER_MAX_BATCH];
+	struct client_conn *c;
+	uint32_t n;
+
+	FD_ODP_DBG("FD client reverse lookup: pid=%d, fd=%d\n", getpid(), fd);
+
+	if (context == NULL || fd < 0 || keys == NULL || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_REVERSE)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	init_request(&hdr, FD_REVERSE_LOOKUP, context, 0);
+	hdr.nfds = 1;
+	if (send_command(&hdr, &fd, NULL, reply_fds,
+			 found, sizeof(found)) != 0)
+		return -1;
+
+	while (hdr.nfds > 0)
+		close(reply_fds[--hdr.nfds]);
+	n = hdr.length / sizeof(uint64_t);
+	if (n == 0 || hdr.length % sizeof(uint64_t)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (n > (uint32_t)max)
+		n = max;
+	memcpy(keys, found, n * sizeof(uint64_t));
+
+	return n;
+}
+
+/*
+ * Client function:
+ * Push a file descriptor to a work queue of the context.
+ */
+int fdserver_queue_push(fdserver_context_t *context, uint64_t key, int fd)
+{
+	fdserver_hdr_t hdr;
+	int reply_fds[FDSERVER_MAX_FDS];
+	struct client_conn *c;
+
+	FD_ODP_DBG("FD client queue push: pid=%d, key=%" PRIu64 ", fd=%d\n",
+		   getpid(), key, fd);
+
+	if (context == NULL || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_QUEUE)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	init_request(&hdr, FD_QUEUE_PUSH, context, key);
+	hdr.nfds = 1;
+	if (send_command(&hdr, &fd, NULL, reply_fds, NULL, 0) != 0)
+		return -1;
+
+	while (hdr.nfds > 0)
+		close(reply_fds[--hdr.nfds]);
+
+	return 0;
+}
+
+/* time given to the server to answer a pop once its deadline passed */
+#define FDSERVER_POP_GRACE_NS 100000000
+
+/*
+ * Client function:
+ * Pop a file descriptor from a work queue of the context, waiting for one
+ * to be pushed for up to timeout_ms.
+ */
+int fdserver_queue_pop(fdserver_context_t *context, uint64_t key,
+		       int timeout_ms)
+{
+	fdserver_hdr_t hdr;
+	int reply_fds[FDSERVER_MAX_FDS];
+	struct client_conn *c;
+	uint64_t deadline;
+	uint64_t timeout;
+
+	FD_ODP_DBG("FD client queue pop: pid=%d, key=%" PRIu64 "\n",
+		   getpid(), key);
+
+	if (context == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_QUEUE)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	deadline = call_deadline();
+	if (timeout_ms >= 0) {
+		timeout = now_ns() + (uint64_t)timeout_ms * 1000000;
+		if (deadline == 0 || timeout < deadline)
+			deadline = timeout;
+	}
+
+	/* whether an fd was popped is up to the server, whose reply is
+	 * waited for a bit longer than the deadline: giving up first would
+	 * lose the fd it may be sending */
+	init_request(&hdr, FD_QUEUE_POP, context, key);
+	if (send_command_until(&hdr, NULL, NULL, reply_fds, NULL, 0, deadline,
+			       deadline == 0 ? 0 :
+			       deadline + FDSERVER_POP_GRACE_NS) != 0)
+		return -1;
+
+	return reply_fd(&hdr, reply_fds);
+}
+
+_Static_assert(FDSERVER_MAX_GROUP <= FDSERVER_MAX_FDS,
+	       "a group must fit in a single frame");
+
+_Static_assert(sizeof(struct fdserver_context) <=
+	       sizeof(fdserver_context_storage_t),
+	       "fdserver_context_storage_t too small");
+
+/*
+ * create a named context in the server, or open it for FD_OPEN_CONTEXT,
+ * the handle being stored in context
+ */
+static int name_context(int command, const char *name, int access,
+			struct fdserver_context *context)
+{
+	struct fdserver_context_name payload;
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	struct client_conn *c;
+
+	FD_ODP_DBG("FD Named context %s pid=%d\n", name, getpid());
+
+	if (name == NULL || name[0] == '\0' ||
+	    strlen(name) >= sizeof(payload.name) ||
+	    (access & ~(FDSERVER_CONTEXT_GROUP | FDSERVER_CONTEXT_ANYONE))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_NAMED)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	memset(&payload, 0, sizeof(payload));
+	payload.access = access;
+	strcpy(payload.name, name);
+	init_request(&hdr, command, NULL, 0);
+	hdr.length = sizeof(payload);
+	if (send_command(&hdr, NULL, &payload, fds, NULL, 0) != 0)
+		return -1;
+
+	*context = hdr.context;
+	/* opened contexts are left to their creator */
+	if (command == FD_NEW_NAMED_CONTEXT)
+		journal_new_context(context, NULL, name, access);
+
+	return 0;
+}
+
+/*
+ * create a new context in the server, or a clone of source if not NULL,
+ * the handle being stored in context
+ */
+static int new_context(struct fdserver_context *source,
+		       struct fdserver_context *context)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+	struct client_conn *c;
+
+	FD_ODP_DBG("FD New context pid=%d\n", getpid());
+
+	if (source == NULL) {
+		init_request(&hdr, FD_NEW_CONTEXT, NULL, 0);
+	} else {
+		c = get_connection();
+		if (c == NULL)
+			return -1;
+		if (!(c->capabilities & FD_CAP_CLONE)) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+		init_request(&hdr, FD_CLONE_CONTEXT, source, 0);
+	}
+	if (send_command(&hdr, NULL, NULL, fds, NULL, 0) != 0) {
+		ODP_ERR("FD Failed to create context\n");
+		return -1;
+	}
+
+	*context = hdr.context;
+	journal_new_context(context, source, NULL, 0);
+
+	return 0;
+}
+
+static int del_context(struct fdserver_context *context)
+{
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS];
+
+	FD_ODP_DBG("FD Delete context pid=%d\n", getpid());
+
+	init_request(&hdr, FD_DEL_CONTEXT, context, 0);
+	if (send_command(&hdr, NULL, NULL, fds, NULL, 0) != 0) {
+		ODP_ERR("FD Failed to remove context\n");
+		return -1;
+	}
+	journal_del_context(context);
+
+	return 0;
+}
+
+static int alloc_context(fdserver_context_t *source, fdserver_context_t **ctx)
+{
+	struct fdserver_context *context;
+
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	context = malloc(sizeof(fdserver_context_t));
+	if (context == NULL)
+		return -1;
+
+	if (new_context(source, context) != 0) {
+		free(context);
+		return -1;
+	}
+
+	*ctx = context;
+
+	return 0;
+}
+
+int fdserver_new_context(fdserver_context_t **ctx)
+{
+	return alloc_context(NULL, ctx);
+}
+
+int fdserver_clone_context(fdserver_context_t *source,
+			   fdserver_context_t **ctx)
+{
+	if (source == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return alloc_context(source, ctx);
+}
+
+static int alloc_named_context(int command, const char *name, int access,
+			       fdserver_context_t **ctx)
+{
+	struct fdserver_context *context;
+
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	context = malloc(sizeof(fdserver_context_t));
+	if (context == NULL)
+		return -1;
+
+	if (name_context(command, name, access, context) != 0) {
+		free(context);
+		return -1;
+	}
+
+	*ctx = context;
+
+	return 0;
+}
+
+int fdserver_new_named_context(const char *name, int access,
+			       fdserver_context_t **ctx)
+{
+	return alloc_named_context(FD_NEW_NAMED_CONTEXT, name, access, ctx);
+}
+
+int fdserver_open_context(const char *name, fdserver_context_t **ctx)
+{
+	return alloc_named_context(FD_OPEN_CONTEXT, name, 0, ctx);
+}
+
+int fdserver_close_context(fdserver_context_t **ctx)
+{
+	if (ctx == NULL || *ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	free(*ctx);
+	*ctx = NULL;
+
+	return 0;
+}
+
+int fdserver_del_context(fdserver_context_t **ctx)
+{
+	if (ctx == NULL || *ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (del_context(*ctx) != 0)
+		return -1;
+
+	free(*ctx);
+	*ctx = NULL;
+
+	return 0;
+}
+
+static int storage_context(fdserver_context_t *source,
+			   fdserver_context_storage_t *storage,
+			   fdserver_context_t **ctx)
+{
+	struct fdserver_context *context;
+
+	if (storage == NULL || ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	context = (struct fdserver_context *)(void *)storage;
+	if (new_context(source, context) != 0)
+		return -1;
+
+	*ctx = context;
+
+	return 0;
+}
+
+int fdserver_new_context_at(fdserver_context_storage_t *storage,
+			    fdserver_context_t **ctx)
+{
+	return storage_context(NULL, storage, ctx);
+}
+
+int fdserver_clone_context_at(fdserver_context_t *source,
+			      fdserver_context_storage_t *storage,
+			      fdserver_context_t **ctx)
+{
+	if (source == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return storage_context(source, storage, ctx);
+}
+
+int fdserver_del_context_at(fdserver_context_t *ctx)
+{
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return del_context(ctx);
+}
+
+/* a connection streaming the events of some contexts */
+struct fdserver_subscription {
+	int sock;
+	int seqpacket;
+	int n;
+	/* contexts given by the caller, which may free them before us */
+	fdserver_context_t *contexts[FDSERVER_MAX_SUBSCRIBE];
+	struct fdserver_context ids[FDSERVER_MAX_SUBSCRIBE];
+};
+
+fdserver_subscription_t *fdserver_subscribe(fdserver_context_t **contexts,
+					    int n, int flags)
+{
+	struct fdserver_context payload[FDSERVER_MAX_SUBSCRIBE];
+	struct fdserver_subscription *subscription;
+	int fds[FDSERVER_MAX_FDS];
+	uint32_t capabilities;
+	uint64_t deadline;
+	uint64_t epoch;
+	fdserver_hdr_t hdr;
+
+	if (contexts == NULL || n <= 0 || n > FDSERVER_MAX_SUBSCRIBE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (contexts[i] == NULL) {
+			errno = EINVAL;
+			return NULL;
+		}
+		payload[i] = journal_map(contexts[i]);
+	}
+
+	subscription = malloc(sizeof(struct fdserver_subscription));
+	if (subscription == NULL)
+		return NULL;
+	subscription->n = n;
+	memcpy(subscription->contexts, contexts, n * sizeof(*contexts));
+	memcpy(subscription->ids, payload, n * sizeof(*payload));
+
+	/* the subscription has a connection of its own */
+	deadline = call_deadline();
+	subscription->sock = get_socket(deadline, &subscription->seqpacket);
+	if (subscription->sock < 0)
+		goto free_exit;
+
+	if (say_hello(subscription->sock, subscription->seqpacket,
+		      &capabilities, &epoch, deadline) != 0)
+		goto close_exit;
+	if (!(capabilities & FD_CAP_SUBSCRIBE)) {
+		errno = EOPNOTSUPP;
+		goto close_exit;
+	}
+
+	init_request(&hdr, FD_SUBSCRIBE, NULL, 0);
+	hdr.length = n * sizeof(struct fdserver_context);
+	hdr.deadline = deadline;
+	if (flags & FDSERVER_SUBSCRIBE_FDS)
+		hdr.flags = FD_FLAG_EVENT_FDS;
+	if (fdserver_internal_send_frame(subscription->sock, &hdr, NULL,
+					 payload) != 0 ||
+	    wait_readable(subscription->sock, deadline) != 0 ||
+	    fdserver_internal_recv(subscription->sock, subscription->seqpacket,
+				   &hdr, fds, NULL, 0) != 0)
+		goto close_exit;
+
+	while (hdr.nfds > 0)
+		close(fds[--hdr.nfds]);
+	if (hdr.command != FD_RETVAL_SUCCESS) {
+		errno = hdr.command;
+		goto close_exit;
+	}
+
+	return subscription;
+
+close_exit:
+	close(subscription->sock);
+free_exit:
+	free(subscription);
+	return NULL;
+}
+
+int fdserver_subscription_fd(fdserver_subscription_t *subscription)
+{
+	if (subscription == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return subscription->sock;
+}
+
+/*
+ * Client function:
+ * Wait for the next event of a subscription. Return -1 on error, e.g.
+ * ECONNRESET once the server is gone.
+ */
+int fdserver_next_event(fdserver_subscription_t *subscription,
+			fdserver_event_t *event)
+{
+	int fds[FDSERVER_MAX_FDS];
+	uint64_t generation;
+	fdserver_hdr_t hdr;
+
+	if (subscription == NULL || event == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fdserver_internal_recv(subscription->sock, subscription->seqpacket,
+				   &hdr, fds, &generation,
+				   sizeof(generation)) != 0)
+		return -1;
+
+	if (!(hdr.flags & FD_FLAG_EVENT) ||
+	    hdr.length != sizeof(generation)) {
+		while (hdr.nfds > 0)
+			close(fds[--hdr.nfds]);
+		errno = EPROTO;
+		return -1;
+	}
+
+	event->type = hdr.command;
+	event->context = NULL;
+	for (int i = 0; i < subscription->n; i++) {
+		if (subscription->ids[i].index == hdr.context.index &&
+		    subscription->ids[i].token == hdr.context.token)
+			event->context = subscription->contexts[i];
+	}
+	event->key = hdr.key;
+	event->generation = generation;
+	event->fd = hdr.nfds > 0 ? fds[0] : -1;
+	/* as many as FDSERVER_MAX_GROUP, the server sending no more */
+	event->nfds = hdr.nfds;
+	memcpy(event->fds, fds, hdr.nfds * sizeof(int));
+
+	return 0;
+}
+
+void fdserver_unsubscribe(fdserver_subscription_t *subscription)
+{
+	if (subscription == NULL)
+		return;
+
+	close(subscription->sock);
+	free(subscription);
+}
+
+/*
+ * Client function:
+ * Send file descriptors to every subscriber of the context.
+ */
+int fdserver_publish(fdserver_context_t *context, uint64_t key,
+		     const int *fds, int n, int *skipped)
+{
+	struct fdserver_publish publish;
+	int reply_fds[FDSERVER_MAX_FDS];
+	fdserver_hdr_t hdr;
+	struct client_conn *c;
+
+	FD_ODP_DBG("FD client publish: pid=%d, key=%" PRIu64 ", %d fds\n",
+		   getpid(), key, n);
+
+	if (context == NULL || fds == NULL || n <= 0 ||
+	    n > FDSERVER_MAX_GROUP) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	c = get_connection();
+	if (c == NULL)
+		return -1;
+	if (!(c->capabilities & FD_CAP_PUBLISH)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	init_request(&hdr, FD_PUBLISH, context, key);
+	hdr.nfds = n;
+	if (send_command(&hdr, fds, NULL, reply_fds, &publish,
+			 sizeof(publish)) != 0)
+		return -1;
+
+	while (hdr.nfds > 0)
+		close(reply_fds[--hdr.nfds]);
+
+	if (hdr.length != sizeof(publish)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (skipped != NULL)
+		*skipped = publish.skipped;
+
+	return publish.subscribers;
+}
+
+int fdserver_set_timeout(int timeout_ms)
+{
+	if (timeout_ms < -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	call_timeout = timeout_ms;
+
+	return 0;
+}
+
+int fdserver_set_deadline(const struct timespec *deadline)
+{
+	if (deadline == NULL) {
+		thread_deadline = 0;
+		return 0;
+	}
+
+	if (deadline->tv_sec < 0 || deadline->tv_nsec < 0 ||
+	    deadline->tv_nsec >= 1000000000) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* 0 meaning no deadline, the earliest one possible is 1ns */
+	thread_deadline = (uint64_t)deadline->tv_sec * 1000000000 +
+		deadline->tv_nsec;
+	if (thread_deadline == 0)
+		thread_deadline = 1;
+
+	return 0;
+}
+
+int fdserver_set_journal(int enable)
+{
+	pthread_mutex_lock(&journal.lock);
+	if (!enable)
+		clear_journal();
+	__atomic_store_n(&journal.enabled, enable != 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&journal.lock);
 
 	return 0;
 }
@@ -231,6 +2023,8 @@ int fdserver_init(const char *path)
 		if (strlen(path) >= sizeof(fdserver_socket.sun_path))
 			return -1;
 		strcpy(fdserver_socket.sun_path, path);
+		socket_type = SOCK_SEQPACKET;
+		conn_generation++;
 	}
 
 	return 0;
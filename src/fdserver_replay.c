@@ -0,0 +1,445 @@
+/* Copyright (c) 2018, Linaro Limited
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier:     BSD-3-Clause
+ */
+
+/*
+ * fdserver-replay re-drives a trace of requests, as recorded by
+ * fdserver --record, against a running server and reports the throughput
+ * and latencies observed.
+ *
+ * The requests are spread over several worker processes, all the requests
+ * of a given client of the trace going to the same worker so that their
+ * order is kept. They are sent at the pace they were recorded at, sped up
+ * by the given factor, or as fast as possible with a speed of 0.
+ * The contexts used by the trace are created before the replay starts and
+ * deleted once it is over, registrations use a pipe end as file descriptor
+ * and metadata of the recorded size. Path registrations are replayed as
+ * registrations of the pipe end, the recorded path being unknown.
+ * Work queue pushes push that pipe end too, and pops do not wait, taking
+ * whatever the pushes replayed so far left.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <fdserver.h>
+#include <fdserver_internal.h>
+
+#define REPLAY_DEFAULT_JOBS 4
+/* time given to the workers to start before the replay begins */
+#define REPLAY_START_DELAY_NS 100000000
+
+struct replay_context {
+	struct fdserver_context recorded;
+	fdserver_context_t *context;
+};
+
+struct replay_result {
+	uint64_t latency; /* ns, 0 if the request was not replayed */
+	int32_t status;
+};
+
+static fdserver_trace_record_t *records;
+static size_t num_records;
+static struct replay_context *contexts;
+static size_t num_contexts;
+/* shared with the workers */
+static struct replay_result *results;
+static uint64_t *end_times;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int load_trace(const char *trace_path)
+{
+	fdserver_trace_header_t header;
+	long size;
+	FILE *file;
+
+	file = fopen(trace_path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "%s: %s\n", trace_path, strerror(errno));
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    header.magic != FDSERVER_TRACE_MAGIC ||
+	    header.version != FDSERVER_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a fdserver trace\n", trace_path);
+		goto close_exit;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file) - sizeof(header);
+	fseek(file, sizeof(header), SEEK_SET);
+
+	num_records = size / sizeof(fdserver_trace_record_t);
+	records = malloc(num_records * sizeof(fdserver_trace_record_t) + 1);
+	if (records == NULL ||
+	    fread(records, sizeof(fdserver_trace_record_t), num_records,
+		  file) != num_records) {
+		fprintf(stderr, "%s: cannot read trace\n", trace_path);
+		goto close_exit;
+	}
+
+	fclose(file);
+	return 0;
+
+close_exit:
+	fclose(file);
+	return -1;
+}
+
+static int is_keyed_request(int command)
+{
+	return command == FD_REGISTER_REQ || command == FD_REGISTER_META_REQ ||
+		command == FD_LOOKUP_REQ || command == FD_LOOKUP_META_REQ ||
+		command == FD_LOOKUP_BATCH_REQ || command == FD_DEREGISTER_REQ ||
+		command == FD_REPLACE_REQ || command == FD_REVERSE_LOOKUP ||
+		command == FD_QUEUE_PUSH || command == FD_QUEUE_POP ||
+		command == FD_REGISTER_PATH_REQ;
+}
+
+/* context standing for a recorded one, NULL if it never existed */
+static fdserver_context_t *find_context(struct fdserver_context *recorded)
+{
+	for (size_t i = 0; i < num_contexts; i++) {
+		if (contexts[i].recorded.index == recorded->index &&
+		    contexts[i].recorded.token == recorded->token)
+			return contexts[i].context;
+	}
+
+	return NULL;
+}
+
+/* create a context for every context the trace successfully used */
+static int create_contexts(void)
+{
+	fdserver_trace_record_t *record;
+
+	contexts = calloc(num_records + 1, sizeof(struct replay_context));
+	if (contexts == NULL)
+		return -1;
+
+	for (size_t i = 0; i < num_records; i++) {
+		record = &records[i];
+		if (record->status != FD_RETVAL_SUCCESS ||
+		    (!is_keyed_request(record->command) &&
+		     record->command != FD_NEW_CONTEXT &&
+		     record->command != FD_CLONE_CONTEXT &&
+		     record->command != FD_NEW_NAMED_CONTEXT &&
+		     record->command != FD_OPEN_CONTEXT) ||
+		    find_context(&record->context) != NULL)
+			continue;
+
+		contexts[num_contexts].recorded = record->context;
+		if (fdserver_new_context(&contexts[num_contexts].context)) {
+			fprintf(stderr, "Cannot create context: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		num_contexts++;
+	}
+
+	return 0;
+}
+
+static void delete_contexts(void)
+{
+	for (size_t i = 0; i < num_contexts; i++)
+		fdserver_del_context(&contexts[i].context);
+}
+
+static int replay_request(fdserver_trace_record_t *record, int fd)
+{
+	struct fdserver_context invalid = { .index = UINT32_MAX };
+	fdserver_context_t *context;
+	char meta[FDSERVER_MAX_METADATA];
+	uint64_t keys[FDSERVER_MAX_BATCH];
+	int fds[FDSERVER_MAX_BATCH];
+	size_t size = sizeof(meta);
+	uint32_t count;
+	int res;
+
+	context = find_context(&record->context);
+	if (context == NULL)
+		context = &invalid;
+
+	switch (record->command) {
+	case FD_REGISTER_REQ:
+	case FD_REGISTER_META_REQ:
+		memset(meta, 0, sizeof(meta));
+		return fdserver_register_fd_meta(context, record->key, fd, meta,
+						 record->size <= sizeof(meta) ?
+						 record->size : sizeof(meta));
+
+	case FD_REGISTER_PATH_REQ:
+		/* the payload is the path, not metadata */
+		return fdserver_register_fd(context, record->key, fd);
+
+	case FD_REPLACE_REQ:
+		/* the generations differ from the recorded ones: no CAS */
+		memset(meta, 0, sizeof(meta));
+		size = record->size - sizeof(struct fdserver_replace);
+		if (record->size < sizeof(struct fdserver_replace))
+			size = 0;
+		return fdserver_replace_fd_meta(context, record->key, fd, meta,
+						size <= sizeof(meta) ?
+						size : sizeof(meta), NULL);
+
+	case FD_LOOKUP_REQ:
+		res = fdserver_lookup_fd(context, record->key);
+		break;
+
+	case FD_LOOKUP_META_REQ:
+		res = fdserver_lookup_fd_meta(context, record->key, meta, &size);
+		break;
+
+	case FD_LOOKUP_BATCH_REQ:
+		/* only the first key is recorded, look it up repeatedly */
+		count = record->count;
+		if (count == 0 || count > FDSERVER_MAX_BATCH)
+			count = 1;
+		for (uint32_t i = 0; i < count; i++)
+			keys[i] = record->key;
+		res = fdserver_lookup_batch(context, keys, count, fds);
+		for (int i = 0; i < res; i++)
+			close(fds[i]);
+		return res < 0 ? -1 : 0;
+
+	case FD_DEREGISTER_REQ:
+		return fdserver_deregister_fd(context, record->key);
+
+	case FD_REVERSE_LOOKUP:
+		/* the recorded fd is unknown, any will do */
+		res = fdserver_reverse_lookup(context, fd, keys,
+					      FDSERVER_MAX_BATCH);
+		return res < 0 && errno != ENOENT ? -1 : 0;
+
+	case FD_QUEUE_PUSH:
+		return fdserver_queue_push(context, record->key, fd);
+
+	case FD_QUEUE_POP:
+		res = fdserver_queue_pop(context, record->key, 0);
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (res >= 0) {
+		close(res);
+		res = 0;
+	}
+
+	return res;
+}
+
+static void run_worker(int worker, int jobs, double speed, uint64_t start)
+{
+	fdserver_trace_record_t *record;
+	struct timespec ts;
+	uint64_t target;
+	uint64_t before;
+	int fd[2];
+
+	if (pipe(fd) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < num_records; i++) {
+		record = &records[i];
+		if (!is_keyed_request(record->command) ||
+		    record->pid % jobs != (uint32_t)worker)
+			continue;
+
+		target = start;
+		if (speed > 0 && record->timestamp > records[0].timestamp)
+			target += (record->timestamp - records[0].timestamp) /
+				speed;
+		ts.tv_sec = target / 1000000000;
+		ts.tv_nsec = target % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &ts, NULL) == EINTR)
+			;
+
+		before = now_ns();
+		results[i].status = replay_request(record, fd[0]) == 0 ?
+			FD_RETVAL_SUCCESS : errno;
+		results[i].latency = now_ns() - before;
+	}
+
+	end_times[worker] = now_ns();
+	exit(EXIT_SUCCESS);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(int jobs, uint64_t start)
+{
+	uint64_t *latencies;
+	uint64_t end = start;
+	uint64_t total = 0;
+	size_t count = 0;
+	size_t mismatches = 0;
+	double elapsed;
+
+	latencies = malloc((num_records + 1) * sizeof(uint64_t));
+	if (latencies == NULL)
+		return;
+
+	for (size_t i = 0; i < num_records; i++) {
+		if (results[i].latency == 0)
+			continue;
+		latencies[count++] = results[i].latency;
+		total += results[i].latency;
+		if ((results[i].status == FD_RETVAL_SUCCESS) !=
+		    (records[i].status == FD_RETVAL_SUCCESS))
+			mismatches++;
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		if (end_times[i] > end)
+			end = end_times[i];
+	}
+
+	printf("requests:   %zu (%zu recorded, %zu contexts)\n",
+	       count, num_records, num_contexts);
+	printf("mismatches: %zu (outcome differs from the trace)\n",
+	       mismatches);
+	if (count == 0) {
+		free(latencies);
+		return;
+	}
+
+	qsort(latencies, count, sizeof(uint64_t), compare_latency);
+	elapsed = (end - start) / 1e9;
+	printf("elapsed:    %.3f s\n", elapsed);
+	printf("throughput: %.0f requests/s\n",
+	       elapsed > 0 ? count / elapsed : 0);
+	printf("latency:    min %.1f avg %.1f p50 %.1f p90 %.1f "
+	       "p99 %.1f max %.1f us\n",
+	       latencies[0] / 1e3, (double)total / count / 1e3,
+	       latencies[count / 2] / 1e3,
+	       latencies[count * 90 / 100] / 1e3,
+	       latencies[count * 99 / 100] / 1e3,
+	       latencies[count - 1] / 1e3);
+
+	free(latencies);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-p path] [-j jobs] [-s speed] trace\n"
+		"  -p, --path   socket path of the server\n"
+		"  -j, --jobs   number of worker processes (default %d)\n"
+		"  -s, --speed  speed up factor, 0 for as fast as possible "
+		"(default 1)\n", name, REPLAY_DEFAULT_JOBS);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"path", required_argument, NULL, 'p'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"speed", required_argument, NULL, 's'},
+		{0, 0, 0, 0}
+	};
+	int opt;
+	int option_index = 0;
+	const char *path = NULL;
+	int jobs = REPLAY_DEFAULT_JOBS;
+	double speed = 1;
+	uint64_t start;
+	int status;
+	int ret = EXIT_SUCCESS;
+
+	while ((opt = getopt_long(argc, argv, ":p:j:s:",
+				  long_options, &option_index)) != -1) {
+		switch (opt) {
+		case 'p':
+			path = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1 || jobs <= 0 || speed < 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fdserver_init(path) != 0 || load_trace(argv[optind]) != 0)
+		exit(EXIT_FAILURE);
+
+	results = mmap(NULL, (num_records + 1) * sizeof(struct replay_result) +
+		       jobs * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	end_times = (uint64_t *)(results + num_records + 1);
+
+	if (create_contexts() != 0) {
+		delete_contexts();
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns() + REPLAY_START_DELAY_NS;
+	for (int i = 0; i < jobs; i++) {
+		pid_t pid = fork();
+
+		if (pid == -1) {
+			perror("fork");
+			jobs = i;
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (pid == 0)
+			run_worker(i, jobs, speed, start);
+	}
+
+	while (wait(&status) != -1) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+	}
+
+	report(jobs, start);
+	delete_contexts();
+
+	exit(ret);
+}
@@ -0,0 +1,4016 @@
+/* Copyright (c) 2016-2018, Linaro Limited
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier:     BSD-3-Clause
+ */
+
+/*
+ * Server core: the fdserver program runs it in its main thread, and
+ * applications may embed it in a thread of their own with
+ * fdserver_server_start(), in which case the lookups made by the
+ * application itself are served straight from the tables, without a round
+ * trip on the socket (see fdserver_internal_local_lookup()).
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef HAS_SYS_RANDOM
+#include <sys/random.h>
+#endif
+#include <sys/time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <linux/kcmp.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fdserver.h>
+#include <fdserver_internal.h>
+#include <fdserver_common.h>
+#include <fdserver_server.h>
+
+#define FDSERVER_BACKLOG 5
+#define FDSERVER_MAX_EVENTS 64
+#define FDSERVER_MAX_TENANT_NAME 64
+/* time a client may take to complete a request, or read its reply */
+#define FDSERVER_CONN_TIMEOUT_MS 1000
+/* requests received at once from a SOCK_SEQPACKET connection */
+#define FDSERVER_RECV_BATCH 16
+/* entries sent per dump frame, frames being sent one per loop iteration */
+#define FDSERVER_DUMP_CHUNK 512
+/* publications pending for a subscriber before it is skipped */
+#define FDSERVER_PUBLISH_QUEUE 16
+/* hash buckets of the reverse index, a power of 2 */
+#define FDSERVER_INODE_BUCKETS 1024
+/* hash buckets of the context names of a tenant, a power of 2 */
+#define FDSERVER_NAME_BUCKETS 64
+
+struct fdinode;
+
+/*
+ * What a key is registered to: a file descriptor, or an ordered group of
+ * them. Values are never modified once created, so that cloned contexts can
+ * share them: the file descriptors are only closed when the last context
+ * referring to them drops them.
+ */
+struct fdvalue;
+
+/*
+ * What a lazy registration opens on its first lookup, see open_lazy().
+ * Its fd is -1 until then, or once closed for being idle.
+ */
+struct fdlazy {
+	struct fdlazy *prev, *next; /* open ones with an idle timeout */
+	struct fdvalue *value;
+	int dirfd; /* -1 for an absolute path */
+	int flags; /* O_* */
+	uid_t uid; /* of the client which registered it */
+	gid_t gid;
+	uint64_t idle_ns; /* 0 to keep it open */
+	uint64_t last_used;
+	char path[];
+};
+static struct fdlazy *idle_lazy;
+/* none of the idle_lazy fds are closed before that time */
+static uint64_t lazy_expiry;
+
+struct fdvalue {
+	unsigned int refcount;
+	uint64_t generation;
+	pid_t owner; /* process which registered it */
+	uint32_t meta_size;
+	void *meta; /* FDSERVER_MAX_METADATA bytes at most, NULL if no meta */
+	struct fdinode *inodes; /* one per fd, in the reverse index */
+	int evictable; /* may be dropped to make room, see make_room() */
+	struct fdlazy *lazy; /* NULL if registered open */
+	uint32_t nfds;
+	int fds[]; /* FDSERVER_MAX_GROUP at most */
+};
+
+/*
+ * Reverse index of the registered file descriptors, hashed on the device
+ * and inode of their file. Open files may share an inode, e.g. both ends
+ * of a pipe, which kcmp() tells apart.
+ */
+struct fdinode {
+	struct fdinode *next;
+	struct fdvalue *value;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+};
+static struct fdinode *inode_table[FDSERVER_INODE_BUCKETS];
+
+struct fdentry {
+	uint64_t key;
+	struct fdvalue *value;
+	/* evictable entries only, see lru_link() */
+	int lru_prev;
+	int lru_next;
+	uint64_t last_used;
+};
+
+/*
+ * Work queue of a context: file descriptors pushed by producers, each
+ * popped by a single consumer, in order, from a ring growing as needed.
+ * Consumers popping an empty queue wait in the waiters list. Queued fds
+ * count in the fds of the context and the server, and a queue is freed
+ * once empty.
+ */
+struct fdqueue {
+	struct fdqueue *next;
+	uint64_t key;
+	int *fds;
+	uint32_t head;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct fdserver_conn;
+
+/* a pop waiting for a push, answered in the order they came */
+struct fdwaiter {
+	struct fdwaiter *prev, *next;
+	struct fdserver_conn *conn;
+	uint32_t seq; /* of the request */
+	struct fdcontext_entry *context;
+	uint64_t key;
+	uint64_t deadline; /* CLOCK_MONOTONIC ns, 0 for none */
+};
+static struct fdwaiter *waiters, *last_waiter;
+
+struct fdcontext_entry {
+	uint32_t index;
+	uint32_t token;
+	struct fdwatch *watchers; /* subscriptions to this context */
+	pid_t owner; /* process which created it */
+	/* named contexts only, who may open them */
+	struct fdcontext_entry *next_named;
+	uid_t uid;
+	gid_t gid;
+	uint32_t access; /* FDSERVER_CONTEXT_* */
+	char name[FDSERVER_MAX_CONTEXT_NAME]; /* empty if not named */
+	/*
+	 * the evictable entries, as indexes in fd_table, from the most
+	 * recently looked up to the least, -1 if none
+	 */
+	int lru_head;
+	int lru_tail;
+	uint32_t num_fds; /* of the entries and the queues */
+	uint64_t bytes; /* allocated for the values of the entries */
+	struct fdqueue *queues;
+	int max_entries;
+	int num_entries;
+	struct fdentry fd_table[0];
+};
+
+/*
+ * A tenant is an isolated namespace of contexts, with its own limits.
+ * Clients only see the contexts of the tenant of the listener they
+ * connected to. Tenants live as long as the server.
+ */
+struct fdserver_tenant {
+	struct fdserver_tenant *next;
+	char name[FDSERVER_MAX_TENANT_NAME];
+	uint32_t max_contexts;
+	uint32_t max_entries;
+	uint32_t max_fds; /* per context, 0 for no limit */
+	uint64_t max_bytes; /* per context, 0 for no limit */
+	struct fdcontext_entry **context_table;
+	/* named contexts, hashed on their name */
+	struct fdcontext_entry *names[FDSERVER_NAME_BUCKETS];
+};
+static struct fdserver_tenant *tenants;
+/* generation of the next registration */
+static uint64_t next_generation = 1;
+/* held by all the values of the server, see make_room() */
+static uint64_t total_fds;
+static uint64_t total_bytes;
+/* ticks with every lookup, dating the last use of the entries */
+static uint64_t lru_clock;
+
+/* limits of the tenants, 0 for no limit */
+struct fdserver_limits {
+	uint32_t max_contexts;
+	uint32_t max_entries;	/* per context */
+	uint32_t max_fds;	/* per context */
+	uint64_t max_bytes;	/* per context */
+};
+
+/* what the server polls: listening sockets and client connections */
+#define POLL_LISTENER	1
+#define POLL_CONN	2
+#define POLL_WAKEUP	3
+struct fdserver_pollable {
+	int type;
+};
+
+struct fdserver_listener {
+	struct fdserver_pollable poll;
+	int sock;
+	struct fdserver_listener *next;
+	struct fdserver_tenant *tenant;
+	int seqpacket; /* SOCK_SEQPACKET rather than SOCK_STREAM */
+	int from_config; /* removed when no longer in the configuration */
+	int stale; /* not found in the configuration while reloading it */
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+};
+static struct fdserver_listener *listeners;
+
+/* an event waiting to be sent to a subscriber */
+struct fdserver_event_slot {
+	int type;
+	struct fdserver_context context;
+	uint64_t key;
+	uint64_t generation;
+	int fd; /* owned by the slot, -1 if none */
+	struct fdvalue *value; /* fds of a publication, a reference held */
+};
+
+/* a subscription of a connection to a context */
+struct fdwatch {
+	struct fdwatch *next_in_context;
+	struct fdwatch *next_in_conn;
+	struct fdcontext_entry *context;
+	struct fdserver_conn *conn;
+};
+
+/* a dump in progress on a connection, see FD_DUMP */
+struct fdserver_dump {
+	int keys; /* list the entries of the contexts */
+	int done; /* once the last frame is built */
+	uint32_t index; /* of the context being dumped */
+	uint32_t token;
+	int entry; /* next entry to dump, -1 for the next context */
+	struct fdserver_dump_end end;
+	size_t len, off; /* of the frame being sent */
+	char frame[sizeof(fdserver_hdr_t) +
+		   FDSERVER_DUMP_CHUNK * sizeof(struct fdserver_dump_entry)];
+};
+
+/*
+ * a frame of a SOCK_STREAM connection received in part: the socket being
+ * non-blocking, the rest is received as it comes, see recv_frame()
+ */
+struct fdserver_partial {
+	size_t len; /* bytes of the frame received */
+	fdserver_hdr_t hdr;
+	uint32_t nfds;
+	int fds[FDSERVER_MAX_FDS];
+	char payload[]; /* once the header is received */
+};
+
+/* a client connection */
+struct fdserver_conn {
+	struct fdserver_pollable poll;
+	struct fdserver_conn *prev, *next;
+	struct fdserver_tenant *tenant; /* of the listener it came from */
+	int sock;
+	int seqpacket; /* a frame per message, see handle_packets() */
+	int version; /* protocol version, 0 until the first request */
+	struct ucred cred; /* of the client process */
+	int dead; /* to be deleted once the current events are handled */
+	/* subscribers only: */
+	int subscribed;
+	int event_fds; /* events carry the registered fds */
+	struct fdwatch *watches;
+	/*
+	 * events waiting to be sent: pending events of a key being coalesced,
+	 * there is room for one per entry of the watched contexts, and for
+	 * the publications, see handle_subscribe()
+	 */
+	struct fdserver_event_slot *events;
+	int max_events;
+	int num_events;
+	int num_published; /* publications among the events */
+	int want_out; /* waiting for the socket to be writable */
+	/* rest of an event frame the socket only took part of */
+	char out[sizeof(fdserver_hdr_t) + sizeof(uint64_t)];
+	size_t out_off, out_len;
+	struct fdserver_dump *dump; /* in progress, if any */
+	struct fdserver_partial *partial; /* frame being received, if any */
+};
+static struct fdserver_conn *conns;
+static int dead_conns;
+static int epoll_fd = -1;
+
+/* a client request, whatever the protocol version it was received with */
+struct fdserver_request {
+	struct fdserver_conn *conn;
+	fdserver_hdr_t hdr;
+	int fds[FDSERVER_MAX_FDS]; /* set to -1 once owned by the server */
+	char payload[FDSERVER_MAX_PAYLOAD];
+	int status; /* of the reply sent */
+	struct fdserver_context reply_context;
+};
+static struct fdserver_request requests[FDSERVER_RECV_BATCH];
+
+/*
+ * replies to the requests of a SOCK_SEQPACKET connection, sent together
+ * once the requests received at once are handled, see flush_replies().
+ * Only lookups are queued: the file descriptors they return must not be
+ * closed before the replies are sent.
+ */
+struct fdserver_reply {
+	fdserver_hdr_t hdr;
+	char data[FDSERVER_MAX_METADATA];
+	struct iovec iov[2];
+	char control[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_FDS)];
+};
+static struct fdserver_conn *replies_conn; /* NULL if not queuing */
+static struct fdserver_reply replies[FDSERVER_RECV_BATCH];
+static struct mmsghdr reply_msgs[FDSERVER_RECV_BATCH];
+static int num_replies;
+
+/* settings of the server running */
+static struct fdserver_server_config config;
+
+/*
+ * embedded server: the tables are also read by the lookups of the other
+ * threads of the process, which the server thread excludes while handling
+ * requests. serving is only set while the tables may be looked up.
+ */
+static int embedded;
+static int serving;
+/* instance of the server, told to clients in the FD_HELLO reply */
+static uint64_t server_epoch;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t server_thread;
+static pid_t server_pid;
+/* wakes the server thread up to have it stop */
+static struct fdserver_pollable wakeup = { .type = POLL_WAKEUP };
+static int wakeup_fd = -1;
+
+/* trace of the requests handled, if recording */
+static FILE *trace_file;
+static int trace_dirty;
+
+/*
+ * Closing a file descriptor may take long, e.g. the last reference to a
+ * large memfd or a lingering socket: the server leaves it to the reaper
+ * thread rather than holding up every client meanwhile. The server queues
+ * the file descriptors to close in reap_fds, which the reaper swaps with a
+ * buffer of its own before closing them.
+ */
+static pthread_t reaper_thread;
+static int reaper_running;
+static int reaper_quit;
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static int *reap_fds;
+static size_t num_reap_fds;
+static size_t max_reap_fds;
+
+/*
+ * set by the signal handler, and by fdserver_server_stop() from an
+ * application thread while the server thread reads it
+ */
+static volatile sig_atomic_t do_quit = 0;
+static void hangup_handler(int signo __attribute__((unused)))
+{
+	do_quit = 1;
+}
+
+static volatile sig_atomic_t do_reload = 0;
+static void reload_handler(int signo __attribute__((unused)))
+{
+	do_reload = 1;
+}
+
+/* exclude the local lookups of an embedded server while updating tables */
+static void lock_tables(void)
+{
+	if (embedded)
+		pthread_mutex_lock(&table_lock);
+}
+
+static void unlock_tables(void)
+{
+	if (embedded)
+		pthread_mutex_unlock(&table_lock);
+}
+
+/*
+ * server function
+ * mark a connection as to be deleted, which it can't be right away as it
+ * may be among the events being handled.
+ */
+static void kill_conn(struct fdserver_conn *conn)
+{
+	if (conn->dead)
+		return;
+
+	conn->dead = 1;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+	dead_conns++;
+}
+
+/* server function: send the replies queued, see handle_packets() */
+static void flush_replies(void)
+{
+	int sent = 0;
+	int res;
+
+	while (sent < num_replies) {
+		res = sendmmsg(replies_conn->sock, &reply_msgs[sent],
+			       num_replies - sent, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			ODP_ERR("fdserver: Failed to send replies: %s\n",
+				strerror(errno));
+			kill_conn(replies_conn);
+			break;
+		}
+		sent += res;
+	}
+	num_replies = 0;
+}
+
+static void queue_reply(struct fdserver_request *req, int status,
+			struct fdserver_context *ctx, uint64_t key,
+			const int *fds, uint32_t nfds,
+			const void *data, uint32_t size)
+{
+	struct fdserver_reply *reply;
+	struct msghdr *msg;
+	struct cmsghdr *cmsg;
+
+	if (num_replies == FDSERVER_RECV_BATCH)
+		flush_replies();
+
+	reply = &replies[num_replies];
+	msg = &reply_msgs[num_replies].msg_hdr;
+	num_replies++;
+
+	memset(&reply->hdr, 0, sizeof(reply->hdr));
+	reply->hdr.magic = FDSERVER_MAGIC;
+	reply->hdr.version = FDSERVER_PROTO_VERSION;
+	reply->hdr.command = status;
+	reply->hdr.seq = req->hdr.seq;
+	reply->hdr.context = *ctx;
+	reply->hdr.key = key;
+	reply->hdr.nfds = nfds;
+	reply->hdr.length = size;
+	if (size > 0)
+		memcpy(reply->data, data, size);
+
+	memset(msg, 0, sizeof(*msg));
+	reply->iov[0].iov_base = &reply->hdr;
+	reply->iov[0].iov_len = sizeof(reply->hdr);
+	reply->iov[1].iov_base = reply->data;
+	reply->iov[1].iov_len = size;
+	msg->msg_iov = reply->iov;
+	msg->msg_iovlen = 2;
+	if (nfds > 0) {
+		msg->msg_control = reply->control;
+		msg->msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		memset(reply->control, 0, msg->msg_controllen);
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+}
+
+/*
+ * server function
+ * send the reply to a request: status is either FD_RETVAL_SUCCESS or an
+ * errno value, which v1 clients only see as FD_RETVAL_FAILURE.
+ */
+static void send_reply(struct fdserver_request *req, int status,
+		       struct fdserver_context *ctx, uint64_t key,
+		       const int *fds, uint32_t nfds,
+		       const void *data, uint32_t size)
+{
+	fdserver_hdr_t hdr;
+
+	req->status = status;
+	req->reply_context = *ctx;
+
+	if (req->conn->version == 1) {
+		int command = FD_RETVAL_FAILURE;
+
+		if (status == FD_RETVAL_SUCCESS)
+			command = FD_RETVAL_SUCCESS;
+		if (status != FD_RETVAL_SUCCESS ||
+		    req->hdr.command != FD_LOOKUP_META_REQ)
+			data = NULL;
+		else if (data == NULL)
+			data = "";
+		fdserver_internal_send_msg(req->conn->sock, command, ctx, key,
+					   nfds > 0 ? fds[0] : -1, data, size);
+		return;
+	}
+
+	if (req->conn == replies_conn) {
+		if (size <= FDSERVER_MAX_METADATA) {
+			queue_reply(req, status, ctx, key, fds, nfds, data,
+				    size);
+			return;
+		}
+		/* too large to be queued: sent after those which are */
+		flush_replies();
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = status;
+	hdr.seq = req->hdr.seq;
+	hdr.context = *ctx;
+	hdr.key = key;
+	hdr.nfds = nfds;
+	hdr.length = size;
+	/* the socket is non-blocking: a client not reading its replies
+	 * until the socket buffer is full is dropped */
+	if (fdserver_internal_send_frame(req->conn->sock, &hdr, fds, data)) {
+		ODP_ERR("fdserver: Failed to send reply: %s\n",
+			strerror(errno));
+		kill_conn(req->conn);
+	}
+}
+
+static void send_status(struct fdserver_request *req, int status)
+{
+	send_reply(req, status, &req->hdr.context, req->hdr.key,
+		   NULL, 0, NULL, 0);
+}
+
+static struct fdcontext_entry *find_context(struct fdserver_tenant *tenant,
+					    struct fdserver_context *context)
+{
+	struct fdcontext_entry *entry;
+
+	FD_ODP_DBG("Find context for %u -> 0x%08x\n",
+		   context->index, context->token);
+
+	if (context->index >= tenant->max_contexts)
+		return NULL;
+
+	entry = tenant->context_table[context->index];
+
+	if (entry == NULL || entry->token != context->token)
+		return NULL;
+
+	return entry;
+}
+
+static struct fdcontext_entry **name_bucket(struct fdserver_tenant *tenant,
+					    const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a */
+	while (*name != '\0')
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+
+	return &tenant->names[hash & (FDSERVER_NAME_BUCKETS - 1)];
+}
+
+static struct fdcontext_entry *find_named_context(struct fdserver_tenant
+						  *tenant, const char *name)
+{
+	struct fdcontext_entry *entry;
+
+	for (entry = *name_bucket(tenant, name); entry != NULL;
+	     entry = entry->next_named) {
+		if (strcmp(entry->name, name) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void unname_context(struct fdserver_tenant *tenant,
+			   struct fdcontext_entry *entry)
+{
+	struct fdcontext_entry **prev;
+
+	if (entry->name[0] == '\0')
+		return;
+
+	prev = name_bucket(tenant, entry->name);
+	while (*prev != NULL && *prev != entry)
+		prev = &(*prev)->next_named;
+	if (*prev != NULL)
+		*prev = entry->next_named;
+}
+
+/* whether the client may open or delete a named context */
+static int may_access(struct fdserver_conn *conn,
+		      struct fdcontext_entry *entry, int open)
+{
+	if (conn->cred.uid == 0 || conn->cred.uid == entry->uid)
+		return 1;
+	if (!open)
+		return 0;
+
+	return (entry->access & FDSERVER_CONTEXT_ANYONE) ||
+		((entry->access & FDSERVER_CONTEXT_GROUP) &&
+		 conn->cred.gid == entry->gid);
+}
+
+/*
+ * server function
+ * get the name of a FD_NEW_NAMED_CONTEXT or FD_OPEN_CONTEXT request.
+ * Return FD_RETVAL_SUCCESS or an errno value.
+ */
+static int request_name(struct fdserver_request *req,
+			struct fdserver_context_name *name)
+{
+	if (req->hdr.length != sizeof(*name))
+		return EINVAL;
+
+	memcpy(name, req->payload, sizeof(*name));
+	if (name->name[0] == '\0' ||
+	    memchr(name->name, '\0', sizeof(name->name)) == NULL)
+		return EINVAL;
+
+	return FD_RETVAL_SUCCESS;
+}
+
+static void update_conn_events(struct fdserver_conn *conn, int want_out)
+{
+	struct epoll_event event;
+
+	if (conn->want_out == want_out)
+		return;
+
+	conn->want_out = want_out;
+	event.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+	event.data.ptr = &conn->poll;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
+}
+
+static void put_fdvalue(struct fdvalue *value);
+
+static void pop_event(struct fdserver_conn *conn, int i)
+{
+	if (conn->events[i].fd >= 0)
+		close(conn->events[i].fd);
+	if (conn->events[i].value != NULL) {
+		put_fdvalue(conn->events[i].value);
+		conn->num_published--;
+	}
+	conn->num_events--;
+	memmove(&conn->events[i], &conn->events[i + 1],
+		(conn->num_events - i) * sizeof(struct fdserver_event_slot));
+}
+
+/*
+ * server function
+ * send the pending events of a subscriber, as long as its socket takes them
+ * without blocking.
+ */
+static void flush_events(struct fdserver_conn *conn)
+{
+	char ancillary_data[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_GROUP)];
+	struct fdserver_event_slot *slot;
+	struct cmsghdr *control_message;
+	struct msghdr socket_message;
+	struct iovec io_vector[2];
+	fdserver_hdr_t hdr;
+	const int *fds;
+	ssize_t res;
+
+	while (!conn->dead) {
+		if (conn->out_off < conn->out_len) {
+			res = send(conn->sock, conn->out + conn->out_off,
+				   conn->out_len - conn->out_off,
+				   MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (res < 0)
+				break;
+			conn->out_off += res;
+			continue;
+		}
+
+		if (conn->num_events == 0)
+			break;
+
+		slot = &conn->events[0];
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = FDSERVER_MAGIC;
+		hdr.version = FDSERVER_PROTO_VERSION;
+		hdr.flags = FD_FLAG_EVENT;
+		hdr.command = slot->type;
+		hdr.context = slot->context;
+		hdr.key = slot->key;
+		hdr.length = sizeof(slot->generation);
+		if (slot->value != NULL) {
+			fds = slot->value->fds;
+			hdr.nfds = slot->value->nfds;
+		} else {
+			fds = &slot->fd;
+			hdr.nfds = slot->fd >= 0 ? 1 : 0;
+		}
+
+		io_vector[0].iov_base = &hdr;
+		io_vector[0].iov_len = sizeof(hdr);
+		io_vector[1].iov_base = &slot->generation;
+		io_vector[1].iov_len = sizeof(slot->generation);
+		memset(&socket_message, 0, sizeof(socket_message));
+		socket_message.msg_iov = io_vector;
+		socket_message.msg_iovlen = 2;
+		if (hdr.nfds > 0) {
+			socket_message.msg_control = ancillary_data;
+			socket_message.msg_controllen =
+				CMSG_SPACE(sizeof(int) * hdr.nfds);
+			control_message = CMSG_FIRSTHDR(&socket_message);
+			control_message->cmsg_level = SOL_SOCKET;
+			control_message->cmsg_type = SCM_RIGHTS;
+			control_message->cmsg_len =
+				CMSG_LEN(sizeof(int) * hdr.nfds);
+			memcpy(CMSG_DATA(control_message), fds,
+			       sizeof(int) * hdr.nfds);
+		}
+
+		res = sendmsg(conn->sock, &socket_message,
+			      MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (res < 0)
+			break;
+
+		/* the fds went with the first byte, keep the rest for later */
+		if ((size_t)res < sizeof(conn->out)) {
+			memcpy(conn->out, &hdr, sizeof(hdr));
+			memcpy(conn->out + sizeof(hdr), &slot->generation,
+			       sizeof(slot->generation));
+			conn->out_off = res;
+			conn->out_len = sizeof(conn->out);
+		}
+		pop_event(conn, 0);
+	}
+
+	if (conn->dead)
+		return;
+
+	if (conn->out_off < conn->out_len || conn->num_events > 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			kill_conn(conn);
+			return;
+		}
+		update_conn_events(conn, 1);
+	} else {
+		update_conn_events(conn, 0);
+	}
+}
+
+/*
+ * server function
+ * queue an event for a subscriber. A pending event of the same key is
+ * replaced, publications aside, pending events of a deleted context are
+ * dropped, and when the queue is full it is replaced by a single overflow
+ * event. Publications hold a reference to their value until sent.
+ */
+static void queue_event(struct fdserver_conn *conn, int type,
+			struct fdcontext_entry *context, uint64_t key,
+			struct fdvalue *value)
+{
+	struct fdserver_event_slot *slot = NULL;
+	int fd = -1;
+
+	if (conn->dead)
+		return;
+
+	for (int i = 0; i < conn->num_events; i++) {
+		if (conn->events[i].context.index != context->index ||
+		    conn->events[i].context.token != context->token ||
+		    conn->events[i].type == FDSERVER_EVENT_OVERFLOW)
+			continue;
+		if (type == FDSERVER_EVENT_CONTEXT_DELETED) {
+			pop_event(conn, i--);
+		} else if (conn->events[i].key == key &&
+			   type != FDSERVER_EVENT_PUBLISH &&
+			   conn->events[i].type != FDSERVER_EVENT_PUBLISH) {
+			slot = &conn->events[i];
+			if (slot->fd >= 0)
+				close(slot->fd);
+			break;
+		}
+	}
+
+	if (slot == NULL) {
+		if (conn->num_events >= conn->max_events) {
+			while (conn->num_events > 0)
+				pop_event(conn, 0);
+			slot = &conn->events[conn->num_events++];
+			memset(slot, 0, sizeof(*slot));
+			slot->type = FDSERVER_EVENT_OVERFLOW;
+			slot->fd = -1;
+			slot->value = NULL;
+		}
+		slot = &conn->events[conn->num_events++];
+	}
+
+	if (conn->event_fds && type == FDSERVER_EVENT_REGISTER)
+		fd = dup(value->fds[0]);
+
+	slot->type = type;
+	slot->context.index = context->index;
+	slot->context.token = context->token;
+	slot->key = key;
+	slot->generation = value != NULL ? value->generation : 0;
+	slot->fd = fd;
+	slot->value = NULL;
+	if (type == FDSERVER_EVENT_PUBLISH) {
+		value->refcount++;
+		slot->value = value;
+		conn->num_published++;
+	}
+}
+
+/* server function: tell the subscribers of a context about a change */
+static void notify(struct fdcontext_entry *context, int type, uint64_t key,
+		   struct fdvalue *value)
+{
+	struct fdwatch *watch;
+
+	for (watch = context->watchers; watch != NULL;
+	     watch = watch->next_in_context) {
+		queue_event(watch->conn, type, context, key, value);
+		flush_events(watch->conn);
+	}
+}
+
+static void free_watch(struct fdwatch *watch)
+{
+	struct fdwatch **prev;
+
+	for (prev = &watch->context->watchers; *prev != watch;
+	     prev = &(*prev)->next_in_context)
+		;
+	*prev = watch->next_in_context;
+
+	for (prev = &watch->conn->watches; *prev != watch;
+	     prev = &(*prev)->next_in_conn)
+		;
+	*prev = watch->next_in_conn;
+
+	free(watch);
+}
+
+/*
+ * server function
+ * turn the connection into a stream of the events of the given contexts
+ */
+static void handle_subscribe(struct fdserver_request *req)
+{
+	struct fdserver_conn *conn = req->conn;
+	struct fdserver_context contexts[FDSERVER_MAX_SUBSCRIBE];
+	struct fdcontext_entry *context;
+	struct fdwatch *watch;
+	size_t max_events;
+	uint32_t n;
+
+	n = req->hdr.length / sizeof(struct fdserver_context);
+	if (conn->version != 2 || conn->subscribed || n == 0 ||
+	    n > FDSERVER_MAX_SUBSCRIBE ||
+	    req->hdr.length % sizeof(struct fdserver_context)) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	memcpy(contexts, req->payload, req->hdr.length);
+	for (uint32_t i = 0; i < n; i++) {
+		if (find_context(conn->tenant, &contexts[i]) == NULL) {
+			send_status(req, ESRCH);
+			return;
+		}
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		context = find_context(conn->tenant, &contexts[i]);
+		for (watch = conn->watches; watch != NULL;
+		     watch = watch->next_in_conn) {
+			if (watch->context == context)
+				break;
+		}
+		if (watch != NULL)
+			continue;
+
+		watch = malloc(sizeof(struct fdwatch));
+		if (watch == NULL)
+			goto nomem;
+		watch->context = context;
+		watch->conn = conn;
+		watch->next_in_context = context->watchers;
+		context->watchers = watch;
+		watch->next_in_conn = conn->watches;
+		conn->watches = watch;
+	}
+
+	/*
+	 * a queue holding an event per entry of the watched contexts only
+	 * overflows when keys come and go faster than the client reads
+	 */
+	max_events = FDSERVER_PUBLISH_QUEUE;
+	for (watch = conn->watches; watch != NULL; watch = watch->next_in_conn)
+		max_events += watch->context->max_entries;
+	conn->events = calloc(max_events, sizeof(struct fdserver_event_slot));
+	if (conn->events == NULL)
+		goto nomem;
+	conn->max_events = max_events;
+
+	send_status(req, FD_RETVAL_SUCCESS);
+	conn->subscribed = 1;
+	conn->event_fds = !!(req->hdr.flags & FD_FLAG_EVENT_FDS);
+	return;
+
+nomem:
+	while (conn->watches != NULL)
+		free_watch(conn->watches);
+	send_status(req, ENOMEM);
+}
+
+/*
+ * server function
+ * create a new context, or a clone of an existing one for FD_CLONE_CONTEXT:
+ * the clone starts with the same entries as its source, sharing their
+ * values, and both contexts evolve independently from then on.
+ * FD_NEW_NAMED_CONTEXT creates a context which the processes it lets in
+ * can open by its name, unique in the tenant.
+ */
+static void handle_new_context(struct fdserver_request *req)
+{
+	struct fdserver_tenant *tenant = req->conn->tenant;
+	struct fdcontext_entry *source = NULL;
+	struct fdserver_context_name name;
+	struct fdcontext_entry **bucket;
+	size_t size;
+	struct fdserver_context context;
+	struct fdcontext_entry *entry;
+	struct fdqueue *queue;
+	uint32_t index;
+	int status = ENOMEM;
+
+	if (req->hdr.command == FD_CLONE_CONTEXT) {
+		source = find_context(tenant, &req->hdr.context);
+		if (source == NULL) {
+			status = ESRCH;
+			goto send_error;
+		}
+	}
+
+	name.name[0] = '\0';
+	if (req->hdr.command == FD_NEW_NAMED_CONTEXT) {
+		status = request_name(req, &name);
+		if (status != FD_RETVAL_SUCCESS)
+			goto send_error;
+		if (find_named_context(tenant, name.name) != NULL) {
+			status = EEXIST;
+			goto send_error;
+		}
+		status = ENOMEM;
+	}
+
+	for (index = 0; index < tenant->max_contexts; index++) {
+		if (tenant->context_table[index] == NULL)
+			break;
+	}
+	if (index >= tenant->max_contexts) {
+		FD_ODP_DBG("Too many contexts\n");
+		status = ENOSPC;
+		goto send_error;
+	}
+
+	size = sizeof(struct fdcontext_entry) +
+		tenant->max_entries * sizeof(struct fdentry);
+
+	entry = malloc(size);
+	if (entry != NULL) {
+		memset(entry, 0, size);
+		entry->index = index;
+		entry->token = (uint32_t)rand();
+		entry->owner = req->conn->cred.pid;
+		entry->max_entries = tenant->max_entries;
+		entry->num_entries = 0;
+		entry->lru_head = -1;
+		entry->lru_tail = -1;
+		if (name.name[0] != '\0') {
+			strcpy(entry->name, name.name);
+			entry->uid = req->conn->cred.uid;
+			entry->gid = req->conn->cred.gid;
+			entry->access = name.access;
+			bucket = name_bucket(tenant, entry->name);
+			entry->next_named = *bucket;
+			*bucket = entry;
+		}
+		if (source != NULL) {
+			/* the tenant limits are the same for both contexts,
+			 * and the LRU list indexes stay valid */
+			entry->num_entries = source->num_entries;
+			entry->lru_head = source->lru_head;
+			entry->lru_tail = source->lru_tail;
+			/* the queues are not cloned */
+			entry->num_fds = source->num_fds;
+			for (queue = source->queues; queue != NULL;
+			     queue = queue->next)
+				entry->num_fds -= queue->count;
+			entry->bytes = source->bytes;
+			memcpy(entry->fd_table, source->fd_table,
+			       source->num_entries * sizeof(struct fdentry));
+			for (int i = 0; i < entry->num_entries; i++)
+				entry->fd_table[i].value->refcount++;
+		}
+		context.index = index;
+		context.token = entry->token;
+		tenant->context_table[index] = entry;
+		send_reply(req, FD_RETVAL_SUCCESS, &context, 0, NULL, 0,
+			   NULL, 0);
+		FD_ODP_DBG("New context %u created in %s\n", index,
+			   tenant->name);
+		return;
+	}
+
+send_error:
+	FD_ODP_DBG("Failed to create new context\n");
+	context.index = 0;
+	context.token = 0;
+	send_reply(req, status, &context, 0, NULL, 0, NULL, 0);
+}
+
+/* what the server allocates for a value */
+static uint64_t fdvalue_size(uint32_t nfds, uint32_t meta_size)
+{
+	return sizeof(struct fdvalue) +
+		nfds * (sizeof(int) + sizeof(struct fdinode)) + meta_size;
+}
+
+static struct fdinode **inode_bucket(dev_t dev, ino_t ino)
+{
+	uint64_t hash = (dev * 0x9e3779b97f4a7c15ull) ^ ino;
+
+	return &inode_table[hash & (FDSERVER_INODE_BUCKETS - 1)];
+}
+
+static void index_fdvalue(struct fdvalue *value)
+{
+	struct fdinode **bucket;
+	struct fdinode *node;
+	struct stat st;
+
+	for (uint32_t i = 0; i < value->nfds; i++) {
+		node = &value->inodes[i];
+		node->value = value;
+		node->fd = value->fds[i];
+		node->next = NULL;
+		/* left out of the index, never to be found */
+		if (fstat(node->fd, &st) == -1)
+			continue;
+		node->dev = st.st_dev;
+		node->ino = st.st_ino;
+		bucket = inode_bucket(node->dev, node->ino);
+		node->next = *bucket;
+		*bucket = node;
+	}
+}
+
+static void unindex_fdvalue(struct fdvalue *value)
+{
+	struct fdinode **prev;
+	struct fdinode *node;
+
+	for (uint32_t i = 0; i < value->nfds; i++) {
+		node = &value->inodes[i];
+		prev = inode_bucket(node->dev, node->ino);
+		while (*prev != NULL && *prev != node)
+			prev = &(*prev)->next;
+		if (*prev != NULL)
+			*prev = node->next;
+	}
+}
+
+static void unlink_lazy(struct fdlazy *lazy)
+{
+	if (lazy->prev != NULL)
+		lazy->prev->next = lazy->next;
+	else
+		idle_lazy = lazy->next;
+	if (lazy->next != NULL)
+		lazy->next->prev = lazy->prev;
+}
+
+/* the file descriptors are left to the caller */
+static void free_fdvalue(struct fdvalue *value)
+{
+	total_fds -= value->nfds;
+	total_bytes -= fdvalue_size(value->nfds, value->meta_size);
+	unindex_fdvalue(value);
+	if (value->lazy != NULL) {
+		if (value->lazy->idle_ns > 0 && value->fds[0] >= 0)
+			unlink_lazy(value->lazy);
+		free(value->lazy);
+	}
+	free(value->inodes);
+	free(value->meta);
+	free(value);
+}
+
+/* close the file descriptors in the background, see reaper_main() */
+static void defer_close(const int *fds, uint32_t nfds)
+{
+	size_t size;
+	int *grown;
+
+	if (reaper_running) {
+		pthread_mutex_lock(&reap_lock);
+		if (num_reap_fds + nfds > max_reap_fds) {
+			size = 2 * (num_reap_fds + nfds);
+			grown = realloc(reap_fds, size * sizeof(int));
+			if (grown != NULL) {
+				reap_fds = grown;
+				max_reap_fds = size;
+			}
+		}
+		if (num_reap_fds + nfds <= max_reap_fds) {
+			/* the reaper takes the whole queue once woken up */
+			if (num_reap_fds == 0)
+				pthread_cond_signal(&reap_cond);
+			memcpy(reap_fds + num_reap_fds, fds, nfds * sizeof(int));
+			num_reap_fds += nfds;
+			pthread_mutex_unlock(&reap_lock);
+			return;
+		}
+		pthread_mutex_unlock(&reap_lock);
+	}
+
+	/* no reaper, or no memory to queue them */
+	for (uint32_t i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
+static void put_fdvalue(struct fdvalue *value)
+{
+	if (--value->refcount > 0)
+		return;
+
+	if (value->lazy == NULL) {
+		defer_close(value->fds, value->nfds);
+	} else {
+		if (value->fds[0] >= 0)
+			defer_close(value->fds, 1);
+		if (value->lazy->dirfd >= 0)
+			defer_close(&value->lazy->dirfd, 1);
+	}
+	free_fdvalue(value);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * server function, or library function for the local lookups
+ * open the fd of a lazy registration unless it is, with the file system
+ * credentials of the client which registered it, and date its last use.
+ * The open never blocks, e.g. on a FIFO without a writer: O_NONBLOCK is
+ * only left set if registered.
+ * Return FD_RETVAL_SUCCESS or the errno of the failure.
+ */
+static int open_lazy(struct fdvalue *value)
+{
+	struct fdlazy *lazy = value->lazy;
+	uint64_t expiry;
+	int uid, gid;
+	int err = 0;
+	int fd = -1;
+
+	lazy->last_used = now_ns();
+	if (value->fds[0] >= 0)
+		return FD_RETVAL_SUCCESS;
+
+	/* per thread: the other threads of the process are not affected */
+	gid = setfsgid(lazy->gid);
+	uid = setfsuid(lazy->uid);
+	if ((uid_t)setfsuid(-1) != lazy->uid ||
+	    (gid_t)setfsgid(-1) != lazy->gid)
+		err = EPERM;
+	else
+		fd = openat(lazy->dirfd >= 0 ? lazy->dirfd : AT_FDCWD,
+			    lazy->path, lazy->flags | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0 && err == 0)
+		err = errno;
+	setfsuid(uid);
+	setfsgid(gid);
+	if (fd < 0)
+		return err;
+
+	if (!(lazy->flags & O_NONBLOCK) &&
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+		err = errno;
+		close(fd);
+		return err;
+	}
+
+	value->fds[0] = fd;
+	index_fdvalue(value);
+	if (lazy->idle_ns > 0) {
+		lazy->prev = NULL;
+		lazy->next = idle_lazy;
+		if (idle_lazy != NULL)
+			idle_lazy->prev = lazy;
+		idle_lazy = lazy;
+		expiry = lazy->last_used + lazy->idle_ns;
+		if (lazy_expiry == 0 || expiry < lazy_expiry)
+			lazy_expiry = expiry;
+	}
+
+	return FD_RETVAL_SUCCESS;
+}
+
+/*
+ * server function
+ * close the fds of the lazy registrations idle for long enough, and
+ * return how long until the next may be in ms, -1 if none is open
+ */
+static int expire_lazy(void)
+{
+	struct fdlazy *lazy, *next;
+	uint64_t now = now_ns();
+	uint64_t expiry;
+	uint64_t first = 0;
+
+	if (idle_lazy == NULL)
+		return -1;
+
+	if (now < lazy_expiry)
+		return (lazy_expiry - now + 999999) / 1000000;
+
+	for (lazy = idle_lazy; lazy != NULL; lazy = next) {
+		next = lazy->next;
+		expiry = lazy->last_used + lazy->idle_ns;
+		if (expiry > now) {
+			if (first == 0 || expiry < first)
+				first = expiry;
+			continue;
+		}
+		FD_ODP_DBG("closing idle %s\n", lazy->path);
+		unlink_lazy(lazy);
+		unindex_fdvalue(lazy->value);
+		defer_close(lazy->value->fds, 1);
+		lazy->value->fds[0] = -1;
+	}
+	lazy_expiry = first;
+
+	return first == 0 ? -1 : (int)((first - now + 999999) / 1000000);
+}
+
+static void del_waiter(struct fdwaiter *waiter)
+{
+	if (waiter->prev != NULL)
+		waiter->prev->next = waiter->next;
+	else
+		waiters = waiter->next;
+	if (waiter->next != NULL)
+		waiter->next->prev = waiter->prev;
+	else
+		last_waiter = waiter->prev;
+	free(waiter);
+}
+
+/*
+ * answer a waiting pop, with the fd popped if fd >= 0.
+ * Return -1 if the fd could not be passed to the consumer.
+ */
+static int answer_waiter(struct fdwaiter *waiter, int status, int fd)
+{
+	fdserver_hdr_t hdr;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = status;
+	hdr.seq = waiter->seq;
+	hdr.context.index = waiter->context->index;
+	hdr.context.token = waiter->context->token;
+	hdr.key = waiter->key;
+	hdr.nfds = fd >= 0 ? 1 : 0;
+	if (fdserver_internal_send_frame(waiter->conn->sock, &hdr, &fd,
+					 NULL)) {
+		ODP_ERR("fdserver: Failed to answer a pop: %s\n",
+			strerror(errno));
+		kill_conn(waiter->conn);
+		ret = -1;
+	}
+	del_waiter(waiter);
+
+	return ret;
+}
+
+/*
+ * server function
+ * drop the waiting pops of a connection, or fail those of a context being
+ * deleted
+ */
+static void cancel_waiters(struct fdserver_conn *conn,
+			   struct fdcontext_entry *context)
+{
+	struct fdwaiter *waiter, *next;
+
+	for (waiter = waiters; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		if (conn != NULL && waiter->conn == conn)
+			del_waiter(waiter);
+		else if (context != NULL && waiter->context == context)
+			answer_waiter(waiter, ESRCH, -1);
+	}
+}
+
+/*
+ * server function
+ * time out the waiting pops past their deadline, and return how long
+ * until the next deadline in ms, -1 if there is none
+ */
+static int expire_waiters(void)
+{
+	struct fdwaiter *waiter, *next;
+	uint64_t now = now_ns();
+	uint64_t first = 0;
+
+	for (waiter = waiters; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		if (waiter->deadline == 0)
+			continue;
+		if (waiter->deadline <= now)
+			answer_waiter(waiter, ETIMEDOUT, -1);
+		else if (first == 0 || waiter->deadline < first)
+			first = waiter->deadline;
+	}
+
+	if (first == 0)
+		return -1;
+
+	return (first - now + 999999) / 1000000;
+}
+
+static void free_queue(struct fdqueue *queue)
+{
+	for (uint32_t i = 0; i < queue->count; i++)
+		defer_close(&queue->fds[(queue->head + i) % queue->size], 1);
+	total_fds -= queue->count;
+	free(queue->fds);
+	free(queue);
+}
+
+/* unlink an empty queue from its context and free it */
+static void drop_queue(struct fdcontext_entry *context, struct fdqueue *queue)
+{
+	struct fdqueue **prev;
+
+	for (prev = &context->queues; *prev != queue; prev = &(*prev)->next)
+		;
+	*prev = queue->next;
+	free_queue(queue);
+}
+
+static void free_context(struct fdcontext_entry *entry)
+{
+	struct fdqueue *queue;
+
+	while (entry->watchers != NULL)
+		free_watch(entry->watchers);
+
+	for (int i = 0; i < entry->num_entries; i++)
+		put_fdvalue(entry->fd_table[i].value);
+
+	while (entry->queues != NULL) {
+		queue = entry->queues;
+		entry->queues = queue->next;
+		free_queue(queue);
+	}
+
+	free(entry);
+}
+
+static void handle_del_context(struct fdserver_request *req)
+{
+	struct fdserver_tenant *tenant = req->conn->tenant;
+	struct fdcontext_entry *entry;
+
+	entry = find_context(tenant, &req->hdr.context);
+	if (entry == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	/* named contexts are only deleted by the users who may create them */
+	if (entry->name[0] != '\0' && !may_access(req->conn, entry, 0)) {
+		send_status(req, EPERM);
+		return;
+	}
+
+	unname_context(tenant, entry);
+	cancel_waiters(NULL, entry);
+	tenant->context_table[entry->index] = NULL;
+	notify(entry, FDSERVER_EVENT_CONTEXT_DELETED, 0, NULL);
+	free_context(entry);
+	send_status(req, FD_RETVAL_SUCCESS);
+}
+
+/*
+ * server function
+ * get the context of the given name, if the client may open it
+ */
+static void handle_open_context(struct fdserver_request *req)
+{
+	struct fdserver_context_name name;
+	struct fdserver_context context;
+	struct fdcontext_entry *entry;
+	int status;
+
+	context.index = 0;
+	context.token = 0;
+	status = request_name(req, &name);
+	if (status == FD_RETVAL_SUCCESS) {
+		entry = find_named_context(req->conn->tenant, name.name);
+		if (entry == NULL) {
+			status = ENOENT;
+		} else if (!may_access(req->conn, entry, 1)) {
+			status = EACCES;
+		} else {
+			context.index = entry->index;
+			context.token = entry->token;
+		}
+	}
+
+	send_reply(req, status, &context, 0, NULL, 0, NULL, 0);
+}
+
+/* the file descriptors are only owned by the value once it is stored */
+static struct fdvalue *new_fdvalue(const int *fds, uint32_t nfds,
+				   const void *meta, uint32_t size,
+				   pid_t owner)
+{
+	struct fdvalue *value;
+
+	value = malloc(sizeof(struct fdvalue) + nfds * sizeof(int));
+	if (value == NULL)
+		return NULL;
+
+	value->inodes = calloc(nfds, sizeof(struct fdinode));
+	if (value->inodes == NULL) {
+		free(value);
+		return NULL;
+	}
+
+	value->meta = NULL;
+	value->meta_size = 0;
+	if (size > 0) {
+		value->meta = malloc(size);
+		if (value->meta == NULL) {
+			free(value->inodes);
+			free(value);
+			return NULL;
+		}
+		memcpy(value->meta, meta, size);
+		value->meta_size = size;
+	}
+	value->refcount = 1;
+	value->generation = next_generation++;
+	value->owner = owner;
+	value->evictable = 0;
+	value->lazy = NULL;
+	value->nfds = nfds;
+	memcpy(value->fds, fds, nfds * sizeof(int));
+	index_fdvalue(value);
+	total_fds += nfds;
+	total_bytes += fdvalue_size(nfds, size);
+
+	return value;
+}
+
+/* put the entry at index i first in the LRU list of the context */
+static void lru_link(struct fdcontext_entry *context, int i)
+{
+	struct fdentry *fdentry = &context->fd_table[i];
+
+	fdentry->lru_prev = -1;
+	fdentry->lru_next = context->lru_head;
+	if (context->lru_head >= 0)
+		context->fd_table[context->lru_head].lru_prev = i;
+	else
+		context->lru_tail = i;
+	context->lru_head = i;
+}
+
+static void lru_unlink(struct fdcontext_entry *context, int i)
+{
+	struct fdentry *fdentry = &context->fd_table[i];
+
+	if (fdentry->lru_prev >= 0)
+		context->fd_table[fdentry->lru_prev].lru_next =
+			fdentry->lru_next;
+	else
+		context->lru_head = fdentry->lru_next;
+	if (fdentry->lru_next >= 0)
+		context->fd_table[fdentry->lru_next].lru_prev =
+			fdentry->lru_prev;
+	else
+		context->lru_tail = fdentry->lru_prev;
+}
+
+/* the entry was looked up */
+static void lru_touch(struct fdcontext_entry *context,
+		      struct fdentry *fdentry)
+{
+	int i = fdentry - context->fd_table;
+
+	fdentry->last_used = ++lru_clock;
+	if (fdentry->value->evictable && context->lru_head != i) {
+		lru_unlink(context, i);
+		lru_link(context, i);
+	}
+}
+
+/* return FD_RETVAL_SUCCESS or an errno value */
+static int add_fdentry(struct fdcontext_entry *context,
+		       uint64_t key, struct fdvalue *value)
+{
+	struct fdentry *fdentry;
+
+	if (context->num_entries >= context->max_entries)
+		return ENOSPC;
+
+	fdentry = &context->fd_table[context->num_entries];
+	fdentry->key = key;
+	fdentry->value = value;
+	fdentry->last_used = ++lru_clock;
+	if (value->evictable)
+		lru_link(context, context->num_entries);
+	context->num_fds += value->nfds;
+	context->bytes += fdvalue_size(value->nfds, value->meta_size);
+	context->num_entries++;
+
+	return FD_RETVAL_SUCCESS;
+}
+
+/* replace the value of an entry, dropping the former one */
+static void set_fdentry(struct fdcontext_entry *context,
+			struct fdentry *fdentry, struct fdvalue *value)
+{
+	struct fdvalue *old = fdentry->value;
+	int i = fdentry - context->fd_table;
+
+	if (old->evictable)
+		lru_unlink(context, i);
+	context->num_fds += value->nfds - old->nfds;
+	context->bytes += fdvalue_size(value->nfds, value->meta_size) -
+		fdvalue_size(old->nfds, old->meta_size);
+	/* other contexts sharing the old value keep it */
+	put_fdvalue(old);
+	fdentry->value = value;
+	fdentry->last_used = ++lru_clock;
+	if (value->evictable)
+		lru_link(context, i);
+}
+
+static struct fdentry *find_fdentry_from_key(struct fdcontext_entry *context,
+					     uint64_t key)
+{
+	struct fdentry *fd_table;
+
+	fd_table = &(context->fd_table[0]);
+	for (int i = 0; i < context->num_entries; i++) {
+		if (fd_table[i].key == key)
+			return &fd_table[i];
+	}
+
+	return NULL;
+}
+
+/* drop the entry at index i, the last entry taking its place */
+static void remove_fdentry(struct fdcontext_entry *context, int i)
+{
+	struct fdentry *fd_table = &context->fd_table[0];
+	struct fdvalue *value = fd_table[i].value;
+	int last;
+
+	notify(context, FDSERVER_EVENT_DEREGISTER, fd_table[i].key, value);
+	if (value->evictable)
+		lru_unlink(context, i);
+	context->num_fds -= value->nfds;
+	context->bytes -= fdvalue_size(value->nfds, value->meta_size);
+	put_fdvalue(value);
+
+	last = --context->num_entries;
+	if (i == last)
+		return;
+
+	fd_table[i] = fd_table[last];
+	if (!fd_table[i].value->evictable)
+		return;
+	/* the links to the moved entry follow it */
+	if (fd_table[i].lru_prev >= 0)
+		fd_table[fd_table[i].lru_prev].lru_next = i;
+	else
+		context->lru_head = i;
+	if (fd_table[i].lru_next >= 0)
+		fd_table[fd_table[i].lru_next].lru_prev = i;
+	else
+		context->lru_tail = i;
+}
+
+static int del_fdentry(struct fdcontext_entry *context, uint64_t key)
+{
+	struct fdentry *fdentry;
+
+	fdentry = find_fdentry_from_key(context, key);
+	if (fdentry == NULL)
+		return -1;
+
+	remove_fdentry(context, fdentry - context->fd_table);
+
+	return 0;
+}
+
+/*
+ * the least recently looked up evictable entry of context, but for the
+ * entry of key in keep_context, -1 if none. With freeing, only entries
+ * whose value is not shared, so that evicting them frees it.
+ */
+static int lru_victim(struct fdcontext_entry *context,
+		      struct fdcontext_entry *keep_context, uint64_t key,
+		      int freeing)
+{
+	int i;
+
+	for (i = context->lru_tail; i >= 0;
+	     i = context->fd_table[i].lru_prev) {
+		if (context == keep_context && context->fd_table[i].key == key)
+			continue;
+		if (freeing && context->fd_table[i].value->refcount > 1)
+			continue;
+		break;
+	}
+
+	return i;
+}
+
+/*
+ * whether a registration of nfds file descriptors and size bytes, in place
+ * of old if not NULL, exceeds the quotas of context
+ */
+static int context_over(struct fdserver_tenant *tenant,
+			struct fdcontext_entry *context, struct fdentry *old,
+			uint32_t nfds, uint64_t size)
+{
+	uint64_t fds = context->num_fds + nfds;
+	uint64_t bytes = context->bytes + size;
+
+	if (old != NULL) {
+		fds -= old->value->nfds;
+		bytes -= fdvalue_size(old->value->nfds, old->value->meta_size);
+	} else if (context->num_entries >= context->max_entries) {
+		return 1;
+	}
+
+	return (tenant->max_fds != 0 && fds > tenant->max_fds) ||
+		(tenant->max_bytes != 0 && bytes > tenant->max_bytes);
+}
+
+/* same for the quotas of the server, old being freed if not shared */
+static int server_over(struct fdentry *old, uint32_t nfds, uint64_t size)
+{
+	uint64_t fds = total_fds + nfds;
+	uint64_t bytes = total_bytes + size;
+
+	if (old != NULL && old->value->refcount == 1) {
+		fds -= old->value->nfds;
+		bytes -= fdvalue_size(old->value->nfds, old->value->meta_size);
+	}
+
+	return (config.max_fds != 0 && fds > config.max_fds) ||
+		(config.max_bytes != 0 && bytes > config.max_bytes);
+}
+
+/*
+ * server function
+ * make room in context for a registration of key with nfds file
+ * descriptors and size bytes, evicting the least recently looked up
+ * evictable entries as needed: those of the context for its own quotas,
+ * those of any context of the tenant for the server quotas, values shared
+ * with a clone aside as evicting them frees nothing. Tenants never evict
+ * each other's entries. The entry of key, if replaced, is not evicted.
+ * Return FD_RETVAL_SUCCESS or ENOSPC.
+ */
+static int make_room(struct fdserver_tenant *tenant,
+		     struct fdcontext_entry *context, uint64_t key,
+		     uint32_t nfds, uint64_t size)
+{
+	struct fdcontext_entry *victim_context;
+	struct fdcontext_entry *candidate;
+	struct fdentry *old;
+	int victim;
+	int i;
+
+	for (;;) {
+		old = find_fdentry_from_key(context, key);
+		if (context_over(tenant, context, old, nfds, size)) {
+			victim_context = context;
+			victim = lru_victim(context, context, key, 0);
+		} else if (server_over(old, nfds, size)) {
+			victim_context = NULL;
+			victim = -1;
+			for (uint32_t c = 0; c < tenant->max_contexts; c++) {
+				candidate = tenant->context_table[c];
+				if (candidate == NULL)
+					continue;
+				i = lru_victim(candidate, context, key, 1);
+				if (i < 0 || (victim >= 0 &&
+					      candidate->fd_table[i].last_used >=
+					      victim_context->fd_table[victim].
+					      last_used))
+					continue;
+				victim_context = candidate;
+				victim = i;
+			}
+		} else {
+			return FD_RETVAL_SUCCESS;
+		}
+
+		if (victim < 0)
+			return ENOSPC;
+
+		FD_ODP_DBG("evicting {ctx=%u, key=%" PRIu64 "}\n",
+			   victim_context->index,
+			   victim_context->fd_table[victim].key);
+		remove_fdentry(victim_context, victim);
+	}
+}
+
+static void handle_register(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	struct fdvalue *value;
+	uint64_t key = req->hdr.key;
+	int status;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL || req->hdr.nfds == 0 ||
+	    req->hdr.nfds > FDSERVER_MAX_GROUP) {
+		ODP_ERR("Invalid register fd or context\n");
+		send_status(req, context == NULL ? ESRCH : EINVAL);
+		return;
+	}
+
+	if (req->hdr.length > FDSERVER_MAX_METADATA) {
+		ODP_ERR("Invalid register metadata\n");
+		send_status(req, EMSGSIZE);
+		return;
+	}
+
+	if (find_fdentry_from_key(context, key) != NULL) {
+		send_status(req, EEXIST);
+		return;
+	}
+
+	status = make_room(req->conn->tenant, context, key, req->hdr.nfds,
+			   fdvalue_size(req->hdr.nfds, req->hdr.length));
+	if (status != FD_RETVAL_SUCCESS) {
+		ODP_ERR("FD table full\n");
+		send_status(req, status);
+		return;
+	}
+
+	value = new_fdvalue(req->fds, req->hdr.nfds, req->payload,
+			    req->hdr.length, req->conn->cred.pid);
+	if (value == NULL) {
+		send_status(req, ENOMEM);
+		return;
+	}
+	value->evictable = !!(req->hdr.flags & FD_FLAG_EVICTABLE);
+
+	status = add_fdentry(context, key, value);
+	if (status == FD_RETVAL_SUCCESS) {
+		FD_ODP_DBG("storing {ctx=%u, key=%" PRIu64 "}->fd=%d\n",
+			   context->index, key, req->fds[0]);
+		for (uint32_t i = 0; i < req->hdr.nfds; i++)
+			req->fds[i] = -1;
+		notify(context, FDSERVER_EVENT_REGISTER, key, value);
+	} else {
+		ODP_ERR("FD table full\n");
+		free_fdvalue(value);
+	}
+
+	send_status(req, status);
+}
+
+/*
+ * server function
+ * register a path to open on the first lookup of the key, see open_lazy()
+ */
+static void handle_register_path(struct fdserver_request *req)
+{
+	struct fdserver_lazy_path lazy_path;
+	struct fdcontext_entry *context;
+	struct fdvalue *value;
+	struct fdlazy *lazy;
+	uint64_t key = req->hdr.key;
+	const char *path;
+	uint32_t len;
+	int fd = -1;
+	int status;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	if (req->hdr.nfds > 1 || req->hdr.length <= sizeof(lazy_path)) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	memcpy(&lazy_path, req->payload, sizeof(lazy_path));
+	path = req->payload + sizeof(lazy_path);
+	len = req->hdr.length - sizeof(lazy_path);
+	/* opening is not to change anything */
+	if (path[len - 1] != '\0' || path[0] == '\0' ||
+	    (path[0] != '/' && req->hdr.nfds == 0) ||
+	    (lazy_path.flags & (O_CREAT | O_TRUNC)) ||
+	    (lazy_path.flags & O_TMPFILE) == O_TMPFILE) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	if (find_fdentry_from_key(context, key) != NULL) {
+		send_status(req, EEXIST);
+		return;
+	}
+
+	/* accounted as the fd it opens */
+	status = make_room(req->conn->tenant, context, key, 1,
+			   fdvalue_size(1, 0));
+	if (status != FD_RETVAL_SUCCESS) {
+		send_status(req, status);
+		return;
+	}
+
+	lazy = calloc(1, sizeof(struct fdlazy) + len);
+	value = lazy != NULL ? new_fdvalue(&fd, 1, NULL, 0,
+					   req->conn->cred.pid) : NULL;
+	if (value == NULL) {
+		free(lazy);
+		send_status(req, ENOMEM);
+		return;
+	}
+	lazy->value = value;
+	lazy->dirfd = req->hdr.nfds > 0 ? req->fds[0] : -1;
+	lazy->flags = lazy_path.flags;
+	lazy->uid = req->conn->cred.uid;
+	lazy->gid = req->conn->cred.gid;
+	lazy->idle_ns = (uint64_t)lazy_path.idle_ms * 1000000;
+	memcpy(lazy->path, path, len);
+	value->lazy = lazy;
+
+	status = add_fdentry(context, key, value);
+	if (status == FD_RETVAL_SUCCESS) {
+		FD_ODP_DBG("storing {ctx=%u, key=%" PRIu64 "}->%s\n",
+			   context->index, key, lazy->path);
+		if (req->hdr.nfds > 0)
+			req->fds[0] = -1;
+		notify(context, FDSERVER_EVENT_REGISTER, key, value);
+	} else {
+		free_fdvalue(value);
+	}
+
+	send_status(req, status);
+}
+
+/*
+ * server function
+ * register a file descriptor in place of the current registration of the
+ * key, if any, so that lookups never miss the key. With FD_REPLACE_CAS,
+ * only if the current registration is of the expected generation.
+ */
+static void handle_replace(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	struct fdserver_replace replace;
+	struct fdentry *fdentry;
+	struct fdvalue *value;
+	uint64_t generation;
+	uint32_t size;
+	int status;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	if (req->hdr.nfds == 0 || req->hdr.nfds > FDSERVER_MAX_GROUP ||
+	    req->hdr.length < sizeof(replace)) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	size = req->hdr.length - sizeof(replace);
+	if (size > FDSERVER_MAX_METADATA) {
+		send_status(req, EMSGSIZE);
+		return;
+	}
+
+	memcpy(&replace, req->payload, sizeof(replace));
+	fdentry = find_fdentry_from_key(context, req->hdr.key);
+	generation = fdentry != NULL ? fdentry->value->generation : 0;
+	if ((replace.flags & FD_REPLACE_CAS) &&
+	    generation != replace.expected) {
+		send_reply(req, ESTALE, &req->hdr.context, req->hdr.key,
+			   NULL, 0, &generation, sizeof(generation));
+		return;
+	}
+
+	status = make_room(req->conn->tenant, context, req->hdr.key,
+			   req->hdr.nfds, fdvalue_size(req->hdr.nfds, size));
+	if (status != FD_RETVAL_SUCCESS) {
+		send_status(req, status);
+		return;
+	}
+	/* evictions moved the entries around */
+	fdentry = find_fdentry_from_key(context, req->hdr.key);
+
+	value = new_fdvalue(req->fds, req->hdr.nfds,
+			    req->payload + sizeof(replace), size,
+			    req->conn->cred.pid);
+	if (value == NULL) {
+		send_status(req, ENOMEM);
+		return;
+	}
+	/* an evictable registration stays so once replaced */
+	value->evictable = (req->hdr.flags & FD_FLAG_EVICTABLE) ||
+		(fdentry != NULL && fdentry->value->evictable);
+
+	if (fdentry != NULL) {
+		set_fdentry(context, fdentry, value);
+		status = FD_RETVAL_SUCCESS;
+	} else {
+		status = add_fdentry(context, req->hdr.key, value);
+	}
+
+	if (status != FD_RETVAL_SUCCESS) {
+		free_fdvalue(value);
+		send_status(req, status);
+		return;
+	}
+
+	for (uint32_t i = 0; i < req->hdr.nfds; i++)
+		req->fds[i] = -1;
+	send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, req->hdr.key,
+		   NULL, 0, &value->generation, sizeof(value->generation));
+	notify(context, FDSERVER_EVENT_REGISTER, req->hdr.key, value);
+}
+
+static void handle_lookup(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	struct fdentry *fdentry;
+	struct fdvalue *value;
+	uint64_t key = req->hdr.key;
+	int status;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		ODP_ERR("invalid lookup context\n");
+		send_status(req, ESRCH);
+		return;
+	}
+
+	fdentry = find_fdentry_from_key(context, key);
+	if (fdentry == NULL) {
+		send_status(req, ENOENT);
+		return;
+	}
+
+	lru_touch(context, fdentry);
+	value = fdentry->value;
+	status = value->lazy != NULL ? open_lazy(value) : FD_RETVAL_SUCCESS;
+	if (status != FD_RETVAL_SUCCESS) {
+		send_status(req, status);
+		return;
+	}
+
+	if (req->hdr.command == FD_LOOKUP_META_REQ)
+		send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, key,
+			   value->fds, value->nfds, value->meta,
+			   value->meta_size);
+	else if (req->hdr.flags & FD_FLAG_GENERATION)
+		send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, key,
+			   value->fds, value->nfds, &value->generation,
+			   sizeof(value->generation));
+	else
+		send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, key,
+			   value->fds, value->nfds, NULL, 0);
+
+	FD_ODP_DBG("lookup {ctx=%u, key=%" PRIu64 "}->fd=%d\n",
+		   context->index, key, value->fds[0]);
+}
+
+static void handle_lookup_batch(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	struct fdentry *fdentry;
+	uint64_t keys[FDSERVER_MAX_FDS];
+	int32_t status[FDSERVER_MAX_FDS];
+	int fds[FDSERVER_MAX_FDS];
+	uint32_t nfds = 0;
+	uint32_t n;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	n = req->hdr.length / sizeof(uint64_t);
+	if (n == 0 || n > FDSERVER_MAX_FDS ||
+	    req->hdr.length % sizeof(uint64_t)) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	memcpy(keys, req->payload, req->hdr.length);
+	for (uint32_t i = 0; i < n; i++) {
+		fdentry = find_fdentry_from_key(context, keys[i]);
+		if (fdentry == NULL) {
+			status[i] = ENOENT;
+			continue;
+		}
+		lru_touch(context, fdentry);
+		status[i] = fdentry->value->lazy != NULL ?
+			open_lazy(fdentry->value) : FD_RETVAL_SUCCESS;
+		if (status[i] != FD_RETVAL_SUCCESS)
+			continue;
+		/* the first file descriptor of a group */
+		fds[nfds++] = fdentry->value->fds[0];
+	}
+
+	send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, 0,
+		   fds, nfds, status, n * sizeof(int32_t));
+}
+
+static struct fdqueue *find_queue(struct fdcontext_entry *context,
+				  uint64_t key)
+{
+	struct fdqueue *queue;
+
+	for (queue = context->queues; queue != NULL; queue = queue->next) {
+		if (queue->key == key)
+			return queue;
+	}
+
+	return NULL;
+}
+
+/*
+ * server function
+ * hand the fd pushed to the first consumer waiting, or queue it
+ */
+static void handle_queue_push(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	struct fdwaiter *waiter, *next;
+	struct fdqueue *queue;
+	uint32_t size;
+	int *fds;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	if (req->hdr.nfds != 1) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	for (waiter = waiters; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		if (waiter->context != context || waiter->key != req->hdr.key ||
+		    waiter->conn->dead)
+			continue;
+		/* the fd goes to the next consumer if this one is gone */
+		if (answer_waiter(waiter, FD_RETVAL_SUCCESS,
+				  req->fds[0]) == 0) {
+			send_status(req, FD_RETVAL_SUCCESS);
+			return;
+		}
+	}
+
+	/* queued fds are held by the server as registered ones are */
+	if ((req->conn->tenant->max_fds != 0 &&
+	     context->num_fds >= req->conn->tenant->max_fds) ||
+	    server_over(NULL, 1, 0)) {
+		send_status(req, ENOSPC);
+		return;
+	}
+
+	queue = find_queue(context, req->hdr.key);
+	if (queue == NULL) {
+		queue = calloc(1, sizeof(struct fdqueue));
+		if (queue == NULL) {
+			send_status(req, ENOMEM);
+			return;
+		}
+		queue->key = req->hdr.key;
+		queue->next = context->queues;
+		context->queues = queue;
+	}
+
+	if (queue->count >= FDSERVER_MAX_QUEUE) {
+		send_status(req, ENOSPC);
+		return;
+	}
+
+	if (queue->count == queue->size) {
+		size = queue->size == 0 ? 16 : 2 * queue->size;
+		fds = malloc(size * sizeof(int));
+		if (fds == NULL) {
+			if (queue->count == 0)
+				drop_queue(context, queue);
+			send_status(req, ENOMEM);
+			return;
+		}
+		for (uint32_t i = 0; i < queue->count; i++)
+			fds[i] = queue->fds[(queue->head + i) % queue->size];
+		free(queue->fds);
+		queue->fds = fds;
+		queue->head = 0;
+		queue->size = size;
+	}
+
+	queue->fds[(queue->head + queue->count) % queue->size] = req->fds[0];
+	queue->count++;
+	context->num_fds++;
+	total_fds++;
+	req->fds[0] = -1;
+	send_status(req, FD_RETVAL_SUCCESS);
+}
+
+/*
+ * server function
+ * pop the first fd of the queue, or wait for one to be pushed until the
+ * deadline of the request
+ */
+static void handle_queue_pop(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	struct fdwaiter *waiter;
+	struct fdqueue *queue;
+	int fd;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	queue = find_queue(context, req->hdr.key);
+	if (queue != NULL && queue->count > 0) {
+		fd = queue->fds[queue->head];
+		queue->head = (queue->head + 1) % queue->size;
+		queue->count--;
+		context->num_fds--;
+		total_fds--;
+		if (queue->count == 0)
+			drop_queue(context, queue);
+		send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context,
+			   req->hdr.key, &fd, 1, NULL, 0);
+		close(fd);
+		return;
+	}
+
+	if (req->hdr.deadline != 0 && now_ns() >= req->hdr.deadline) {
+		send_status(req, ETIMEDOUT);
+		return;
+	}
+
+	waiter = malloc(sizeof(struct fdwaiter));
+	if (waiter == NULL) {
+		send_status(req, ENOMEM);
+		return;
+	}
+
+	/* answered by a push, a timeout, or the deletion of the context */
+	waiter->conn = req->conn;
+	waiter->seq = req->hdr.seq;
+	waiter->context = context;
+	waiter->key = req->hdr.key;
+	waiter->deadline = req->hdr.deadline;
+	waiter->next = NULL;
+	waiter->prev = last_waiter;
+	if (last_waiter != NULL)
+		last_waiter->next = waiter;
+	else
+		waiters = waiter;
+	last_waiter = waiter;
+}
+
+/*
+ * server function
+ * send the fds of the request to every subscriber of the context, all of
+ * them sharing a single value, released once sent to the last one
+ */
+static void handle_publish(struct fdserver_request *req)
+{
+	struct fdserver_publish publish = { 0, 0 };
+	struct fdcontext_entry *context;
+	struct fdserver_conn *conn;
+	struct fdwatch *watch;
+	struct fdvalue *value;
+	uint32_t nfds = req->hdr.nfds;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	if (nfds == 0 || nfds > FDSERVER_MAX_GROUP) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	if (server_over(NULL, nfds, fdvalue_size(nfds, 0))) {
+		send_status(req, ENOSPC);
+		return;
+	}
+
+	value = new_fdvalue(req->fds, nfds, NULL, 0, req->conn->cred.pid);
+	if (value == NULL) {
+		send_status(req, ENOMEM);
+		return;
+	}
+	for (uint32_t i = 0; i < nfds; i++)
+		req->fds[i] = -1;
+
+	for (watch = context->watchers; watch != NULL;
+	     watch = watch->next_in_context) {
+		conn = watch->conn;
+		if (conn->dead ||
+		    conn->num_published >= FDSERVER_PUBLISH_QUEUE) {
+			publish.skipped++;
+			continue;
+		}
+		queue_event(conn, FDSERVER_EVENT_PUBLISH, context,
+			    req->hdr.key, value);
+		flush_events(conn);
+		publish.subscribers++;
+	}
+	put_fdvalue(value);
+
+	send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, req->hdr.key,
+		   NULL, 0, &publish, sizeof(publish));
+}
+
+/*
+ * whether two file descriptors of the server refer to the same open file,
+ * being known to refer to the same inode
+ */
+static int same_file(int fd1, int fd2)
+{
+	pid_t pid = getpid();
+	long ret;
+
+	ret = syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd1, fd2);
+	/* without kcmp(), the inode has to do */
+	if (ret == -1)
+		return errno == ENOSYS || errno == EPERM;
+
+	return ret == 0;
+}
+
+/*
+ * server function
+ * find the keys of the context registered to the open file of the fd
+ * passed, that of a lookup of the key or of one of its group
+ */
+static void handle_reverse_lookup(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	uint64_t keys[FDSERVER_MAX_BATCH];
+	struct fdinode *node;
+	struct stat st;
+	uint32_t n = 0;
+	uint32_t j;
+
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context == NULL) {
+		send_status(req, ESRCH);
+		return;
+	}
+
+	if (req->hdr.nfds != 1) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	if (fstat(req->fds[0], &st) == -1) {
+		send_status(req, errno);
+		return;
+	}
+
+	for (node = *inode_bucket(st.st_dev, st.st_ino); node != NULL;
+	     node = node->next) {
+		if (node->dev != st.st_dev || node->ino != st.st_ino ||
+		    !same_file(node->fd, req->fds[0]))
+			continue;
+		for (int i = 0; i < context->num_entries; i++) {
+			if (context->fd_table[i].value != node->value)
+				continue;
+			/* a group may hold the file more than once */
+			for (j = 0; j < n; j++)
+				if (keys[j] == context->fd_table[i].key)
+					break;
+			if (j == n && n < FDSERVER_MAX_BATCH)
+				keys[n++] = context->fd_table[i].key;
+		}
+	}
+
+	if (n == 0) {
+		send_status(req, ENOENT);
+		return;
+	}
+
+	send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, keys[0],
+		   NULL, 0, keys, n * sizeof(uint64_t));
+}
+
+static void handle_deregister(struct fdserver_request *req)
+{
+	struct fdcontext_entry *context;
+	uint64_t key = req->hdr.key;
+	int status = ESRCH;
+
+	FD_ODP_DBG("Delete {ctx: %u, key: %" PRIu64 "}\n",
+		   req->hdr.context.index, key);
+	context = find_context(req->conn->tenant, &req->hdr.context);
+	if (context != NULL) {
+		if (del_fdentry(context, key) == 0) {
+			FD_ODP_DBG("deleted {ctx=%u, key=%" PRIu64 "}\n",
+				   context->index, key);
+			status = FD_RETVAL_SUCCESS;
+		} else {
+			FD_ODP_DBG("Failed to delete deleted {ctx=%u, "
+				   "key=%" PRIu64 "}\n",
+				   context->index, key);
+			status = ENOENT;
+		}
+	}
+	send_status(req, status);
+}
+
+static void dump_entry(struct fdentry *fdentry,
+		       struct fdserver_dump_entry *record)
+{
+	struct fdvalue *value = fdentry->value;
+	char link[32];
+	struct stat st;
+	ssize_t len;
+
+	memset(record, 0, sizeof(*record));
+	record->key = fdentry->key;
+	record->generation = value->generation;
+	record->meta_size = value->meta_size;
+	record->refcount = value->refcount;
+	record->owner_pid = value->owner;
+	record->fd = value->fds[0];
+	record->nfds = value->nfds;
+
+	if (value->fds[0] < 0 && value->lazy != NULL) {
+		snprintf(record->type, sizeof(record->type), "lazy:%s",
+			 value->lazy->path);
+		return;
+	}
+
+	if (fstat(value->fds[0], &st) == 0 && S_ISREG(st.st_mode))
+		record->size = st.st_size;
+
+	/* e.g. socket:[1234], anon_inode:[eventfd] or /memfd:name */
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", value->fds[0]);
+	len = readlink(link, record->type, sizeof(record->type) - 1);
+	if (len < 0)
+		strcpy(record->type, "?");
+}
+
+static void dump_context(struct fdcontext_entry *context,
+			 struct fdserver_dump_context *record)
+{
+	struct fdwatch *watch;
+
+	memset(record, 0, sizeof(*record));
+	record->num_entries = context->num_entries;
+	record->max_entries = context->max_entries;
+	record->owner_pid = context->owner;
+	strcpy(record->name, context->name);
+	record->memory = sizeof(struct fdcontext_entry) +
+		context->max_entries * sizeof(struct fdentry) + context->bytes;
+	for (watch = context->watchers; watch != NULL;
+	     watch = watch->next_in_context)
+		record->subscribers++;
+}
+
+/*
+ * server function
+ * build the next frame of a dump: the entries of the current context, or
+ * the record of the next context, or the end of the dump.
+ */
+static void build_dump_frame(struct fdserver_conn *conn)
+{
+	struct fdserver_tenant *tenant = conn->tenant;
+	struct fdserver_dump *dump = conn->dump;
+	fdserver_hdr_t *hdr = (fdserver_hdr_t *)(void *)dump->frame;
+	char *payload = dump->frame + sizeof(fdserver_hdr_t);
+	struct fdserver_dump_context record;
+	struct fdserver_dump_entry entry;
+	struct fdcontext_entry *context;
+	int n;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = FDSERVER_MAGIC;
+	hdr->version = FDSERVER_PROTO_VERSION;
+	hdr->flags = FD_FLAG_DUMP;
+
+	if (dump->entry >= 0) {
+		context = tenant->context_table[dump->index];
+		if (context != NULL && context->token == dump->token &&
+		    dump->entry < context->num_entries) {
+			n = context->num_entries - dump->entry;
+			if (n > FDSERVER_DUMP_CHUNK)
+				n = FDSERVER_DUMP_CHUNK;
+			for (int i = 0; i < n; i++) {
+				dump_entry(&context->fd_table[dump->entry++],
+					   &entry);
+				memcpy(payload + i * sizeof(entry), &entry,
+				       sizeof(entry));
+			}
+			hdr->command = FD_DUMP_ENTRIES;
+			hdr->context.index = context->index;
+			hdr->context.token = context->token;
+			hdr->length = n * sizeof(entry);
+			goto frame_built;
+		}
+		/* done with the context, or it went away meanwhile */
+		dump->entry = -1;
+		dump->index++;
+	}
+
+	while (dump->index < tenant->max_contexts &&
+	       tenant->context_table[dump->index] == NULL)
+		dump->index++;
+
+	if (dump->index >= tenant->max_contexts) {
+		hdr->command = FD_DUMP_END;
+		hdr->length = sizeof(dump->end);
+		memcpy(payload, &dump->end, sizeof(dump->end));
+		dump->done = 1;
+		goto frame_built;
+	}
+
+	context = tenant->context_table[dump->index];
+	dump_context(context, &record);
+	dump->end.contexts++;
+	dump->end.entries += record.num_entries;
+	dump->end.memory += record.memory;
+
+	hdr->command = FD_DUMP_CONTEXT;
+	hdr->context.index = context->index;
+	hdr->context.token = context->token;
+	hdr->length = sizeof(record);
+	memcpy(payload, &record, sizeof(record));
+
+	if (dump->keys && context->num_entries > 0) {
+		dump->token = context->token;
+		dump->entry = 0;
+	} else {
+		dump->index++;
+	}
+
+frame_built:
+	dump->off = 0;
+	dump->len = sizeof(fdserver_hdr_t) + hdr->length;
+}
+
+/*
+ * server function
+ * send the dump in progress on a connection, a frame at a time so that the
+ * other connections are served in between.
+ */
+static void continue_dump(struct fdserver_conn *conn)
+{
+	struct fdserver_dump *dump = conn->dump;
+	int built = 0;
+	ssize_t res;
+
+	for (;;) {
+		if (dump->off < dump->len) {
+			res = send(conn->sock, dump->frame + dump->off,
+				   dump->len - dump->off,
+				   MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (res < 0 && (errno == EAGAIN ||
+					errno == EWOULDBLOCK ||
+					errno == EINTR))
+				break;
+			if (res < 0) {
+				kill_conn(conn);
+				return;
+			}
+			dump->off += res;
+			continue;
+		}
+
+		if (dump->done) {
+			free(dump);
+			conn->dump = NULL;
+			update_conn_events(conn, 0);
+			return;
+		}
+
+		if (built++)
+			break;
+		build_dump_frame(conn);
+	}
+
+	update_conn_events(conn, 1);
+}
+
+/*
+ * server function
+ * stream the inventory of the tenant contexts on the connection
+ */
+static void handle_dump(struct fdserver_request *req)
+{
+	struct fdserver_conn *conn = req->conn;
+	struct fdserver_dump *dump;
+
+	if (conn->version != 2 || conn->subscribed) {
+		send_status(req, EINVAL);
+		return;
+	}
+
+	dump = calloc(1, sizeof(struct fdserver_dump));
+	if (dump == NULL) {
+		send_status(req, ENOMEM);
+		return;
+	}
+	dump->keys = !!(req->hdr.flags & FD_FLAG_DUMP_KEYS);
+	dump->entry = -1;
+
+	send_status(req, FD_RETVAL_SUCCESS);
+	conn->dump = dump;
+	continue_dump(conn);
+}
+
+static void handle_hello(struct fdserver_request *req)
+{
+	struct fdserver_hello hello;
+
+	/* the epoch was added later, clients need not send it */
+	if (req->hdr.length < offsetof(struct fdserver_hello, epoch)) {
+		send_status(req, EPROTO);
+		return;
+	}
+
+	memset(&hello, 0, sizeof(hello));
+	memcpy(&hello, req->payload, offsetof(struct fdserver_hello, epoch));
+	if (hello.version < FDSERVER_PROTO_VERSION) {
+		send_status(req, EPROTONOSUPPORT);
+		return;
+	}
+
+	hello.version = FDSERVER_PROTO_VERSION;
+	hello.capabilities = FD_CAP_META | FD_CAP_BATCH | FD_CAP_CLONE |
+		FD_CAP_REPLACE | FD_CAP_SUBSCRIBE | FD_CAP_DUMP | FD_CAP_GROUP |
+		FD_CAP_REVERSE | FD_CAP_NAMED | FD_CAP_EVICT | FD_CAP_QUEUE |
+		FD_CAP_LAZY | FD_CAP_PUBLISH;
+	hello.epoch = server_epoch;
+	send_reply(req, FD_RETVAL_SUCCESS, &req->hdr.context, 0, NULL, 0,
+		   &hello, sizeof(hello));
+}
+
+static int open_trace(const char *trace_path)
+{
+	fdserver_trace_header_t header = {
+		.magic = FDSERVER_TRACE_MAGIC,
+		.version = FDSERVER_TRACE_VERSION,
+	};
+
+	trace_file = fopen(trace_path, "ab");
+	if (trace_file == NULL) {
+		ODP_ERR("Cannot open trace %s: %s\n", trace_path,
+			strerror(errno));
+		return -1;
+	}
+
+	/* a new trace starts with its header, others are appended to */
+	if (ftell(trace_file) == 0 &&
+	    fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+		ODP_ERR("Cannot write trace: %s\n", strerror(errno));
+		fclose(trace_file);
+		trace_file = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void trace_request(struct fdserver_request *req, uint64_t start)
+{
+	fdserver_trace_record_t record;
+
+	record.timestamp = start;
+	record.duration = now_ns() - start;
+	record.command = req->hdr.command;
+	record.status = req->status;
+	record.pid = req->conn->cred.pid;
+	record.context = req->reply_context;
+	record.key = req->hdr.key;
+	record.count = 1;
+	record.size = req->hdr.length;
+	if (req->hdr.command == FD_LOOKUP_BATCH_REQ) {
+		record.count = req->hdr.length / sizeof(uint64_t);
+		if (record.count > 0)
+			memcpy(&record.key, req->payload, sizeof(uint64_t));
+	}
+
+	/* buffered, flushed whenever the server goes idle */
+	fwrite(&record, sizeof(record), 1, trace_file);
+	trace_dirty = 1;
+}
+
+/*
+ * server function
+ * receive a v1 request, which is turned into its v2 equivalent.
+ * Return -1 on error, 0 on success.
+ */
+static int recv_request_v1(struct fdserver_request *req)
+{
+	int command;
+	uint32_t size = FDSERVER_MAX_METADATA;
+
+	memset(&req->hdr, 0, sizeof(req->hdr));
+	if (fdserver_internal_recv_msg(req->conn->sock, &command,
+				       &req->hdr.context, &req->hdr.key,
+				       &req->fds[0]) != 0)
+		return -1;
+
+	req->hdr.command = command;
+	req->hdr.nfds = req->fds[0] >= 0 ? 1 : 0;
+
+	if (command == FD_REGISTER_META_REQ) {
+		req->hdr.command = FD_REGISTER_REQ;
+		if (fdserver_internal_recv_data(req->conn->sock, req->payload,
+						&size) != 0)
+			return -1;
+		req->hdr.length = size;
+	}
+
+	return 0;
+}
+
+/* close whatever file descriptor the request did not keep */
+static void close_request_fds(struct fdserver_request *req)
+{
+	for (int i = 0; i < FDSERVER_MAX_FDS; i++) {
+		if (req->fds[i] >= 0)
+			close(req->fds[i]);
+		req->fds[i] = -1;
+	}
+}
+
+static void init_request(struct fdserver_request *req,
+			 struct fdserver_conn *conn)
+{
+	req->conn = conn;
+	req->status = FD_RETVAL_SUCCESS;
+	for (int i = 0; i < FDSERVER_MAX_FDS; i++)
+		req->fds[i] = -1;
+}
+
+/* lookups only read the tables, see struct fdserver_reply */
+static int is_lookup(int command)
+{
+	return command == FD_LOOKUP_REQ || command == FD_LOOKUP_META_REQ ||
+		command == FD_LOOKUP_BATCH_REQ || command == FD_REVERSE_LOOKUP ||
+		command == FD_HELLO;
+}
+
+/*
+ * server function
+ * handle a request received
+ */
+static void process_request(struct fdserver_request *req)
+{
+	uint64_t start = 0;
+
+	if (trace_file != NULL)
+		start = now_ns();
+
+	/* the client stopped waiting for the reply: spare the work. Pops
+	 * take what is queued until their deadline, see handle_queue_pop() */
+	if (req->hdr.deadline != 0 && req->hdr.command != FD_QUEUE_POP &&
+	    now_ns() >= req->hdr.deadline) {
+		FD_ODP_DBG("Request %d past its deadline\n",
+			   req->hdr.command);
+		send_status(req, ETIMEDOUT);
+		goto trace;
+	}
+
+	lock_tables();
+	switch (req->hdr.command) {
+	case FD_REGISTER_REQ:
+	case FD_REGISTER_META_REQ:
+		handle_register(req);
+		break;
+
+	case FD_LOOKUP_REQ:
+	case FD_LOOKUP_META_REQ:
+		handle_lookup(req);
+		break;
+
+	case FD_LOOKUP_BATCH_REQ:
+		handle_lookup_batch(req);
+		break;
+
+	case FD_REPLACE_REQ:
+		handle_replace(req);
+		break;
+
+	case FD_SUBSCRIBE:
+		handle_subscribe(req);
+		break;
+
+	case FD_DUMP:
+		handle_dump(req);
+		break;
+
+	case FD_DEREGISTER_REQ:
+		handle_deregister(req);
+		break;
+
+	case FD_NEW_CONTEXT:
+	case FD_CLONE_CONTEXT:
+	case FD_NEW_NAMED_CONTEXT:
+		handle_new_context(req);
+		break;
+
+	case FD_OPEN_CONTEXT:
+		handle_open_context(req);
+		break;
+
+	case FD_DEL_CONTEXT:
+		FD_ODP_DBG("Delete context %u\n", req->hdr.context.index);
+		handle_del_context(req);
+		break;
+
+	case FD_REVERSE_LOOKUP:
+		handle_reverse_lookup(req);
+		break;
+
+	case FD_QUEUE_PUSH:
+		handle_queue_push(req);
+		break;
+
+	case FD_QUEUE_POP:
+		handle_queue_pop(req);
+		break;
+
+	case FD_REGISTER_PATH_REQ:
+		handle_register_path(req);
+		break;
+
+	case FD_PUBLISH:
+		handle_publish(req);
+		break;
+
+	case FD_HELLO:
+		handle_hello(req);
+		break;
+
+	default:
+		ODP_ERR("Unexpected request: %d\n", req->hdr.command);
+		send_status(req, EOPNOTSUPP);
+		break;
+	}
+	unlock_tables();
+
+trace:
+	/* connection setup is not part of the traffic worth replaying */
+	if (trace_file != NULL && req->hdr.command != FD_HELLO)
+		trace_request(req, start);
+
+	close_request_fds(req);
+}
+
+/*
+ * server function
+ * receive the requests queued on a SOCK_SEQPACKET connection with a single
+ * recvmmsg() and handle them, the replies to lookups being sent together
+ * by a single sendmmsg().
+ * Return -1 if the connection is to be closed, 0 otherwise.
+ */
+static int handle_packets(struct fdserver_conn *conn)
+{
+	static char control[FDSERVER_RECV_BATCH]
+		[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_FDS)];
+	struct mmsghdr msgs[FDSERVER_RECV_BATCH];
+	struct iovec iov[FDSERVER_RECV_BATCH][2];
+	struct fdserver_request *req;
+	struct msghdr *msg;
+	int num_msgs;
+	int ret = 0;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < FDSERVER_RECV_BATCH; i++) {
+		iov[i][0].iov_base = &requests[i].hdr;
+		iov[i][0].iov_len = sizeof(fdserver_hdr_t);
+		iov[i][1].iov_base = requests[i].payload;
+		iov[i][1].iov_len = FDSERVER_MAX_PAYLOAD;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+		msgs[i].msg_hdr.msg_control = control[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+
+	do {
+		num_msgs = recvmmsg(conn->sock, msgs, FDSERVER_RECV_BATCH,
+				    MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+	} while (num_msgs < 0 && errno == EINTR);
+	if (num_msgs < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	replies_conn = conn;
+	for (i = 0; i < num_msgs; i++) {
+		req = &requests[i];
+		msg = &msgs[i].msg_hdr;
+		init_request(req, conn);
+		req->hdr.nfds = fdserver_internal_msg_fds(msg, req->fds);
+
+		/* see handle_request() */
+		if (conn->subscribed || conn->dump != NULL) {
+			ret = -1;
+			break;
+		}
+
+		/* the client closing its connection is no error */
+		if (fdserver_internal_check_packet(msg, &req->hdr,
+						   msgs[i].msg_len) != 0) {
+			if (errno != ECONNRESET)
+				ODP_ERR("fdserver: Invalid frame: %s\n",
+					strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		/* the replies queued go before anything else is sent, and
+		 * before anything closes the fds they carry */
+		if (!is_lookup(req->hdr.command)) {
+			flush_replies();
+			replies_conn = NULL;
+		}
+		process_request(req);
+		replies_conn = conn;
+	}
+	flush_replies();
+	replies_conn = NULL;
+
+	/* the requests left after an error */
+	for (; i < num_msgs; i++) {
+		requests[i].hdr.nfds =
+			fdserver_internal_msg_fds(&msgs[i].msg_hdr,
+						  requests[i].fds);
+		close_request_fds(&requests[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * server function
+ * receive the frame of a request from a SOCK_STREAM connection, as much of
+ * it as the socket holds: the rest of a frame received in part is kept in
+ * conn->partial until the next call, so that a client stalling half way
+ * through a frame does not hold up the server.
+ * Return 1 once the frame is complete, 0 if it is not yet, -1 on error.
+ */
+static int recv_frame(struct fdserver_request *req)
+{
+	char ancillary_data[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_FDS)];
+	struct fdserver_conn *conn = req->conn;
+	struct fdserver_partial *partial = conn->partial;
+	int fds[FDSERVER_MAX_FDS];
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t nfds = 0;
+	uint32_t n;
+	size_t len = 0;
+	ssize_t res;
+
+	if (partial != NULL) {
+		len = partial->len;
+		nfds = partial->nfds;
+		req->hdr = partial->hdr;
+		memcpy(req->fds, partial->fds, nfds * sizeof(int));
+		if (len > sizeof(fdserver_hdr_t))
+			memcpy(req->payload, partial->payload,
+			       len - sizeof(fdserver_hdr_t));
+		free(partial);
+		conn->partial = NULL;
+	}
+
+	for (;;) {
+		if (len < sizeof(fdserver_hdr_t)) {
+			iov.iov_base = (char *)&req->hdr + len;
+			iov.iov_len = sizeof(fdserver_hdr_t) - len;
+		} else if (req->hdr.magic != FDSERVER_MAGIC ||
+			   req->hdr.version != FDSERVER_PROTO_VERSION ||
+			   req->hdr.length > sizeof(req->payload)) {
+			errno = EPROTO;
+			goto error;
+		} else if (len == sizeof(fdserver_hdr_t) + req->hdr.length) {
+			break;
+		} else {
+			iov.iov_base = req->payload + len -
+				sizeof(fdserver_hdr_t);
+			iov.iov_len = sizeof(fdserver_hdr_t) +
+				req->hdr.length - len;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ancillary_data;
+		msg.msg_controllen = sizeof(ancillary_data);
+		res = recvmsg(conn->sock, &msg,
+			      MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			goto keep;
+		if (res <= 0) {
+			if (res == 0)
+				errno = ECONNRESET;
+			goto error;
+		}
+
+		/* the fds of a frame come with its first byte */
+		n = fdserver_internal_msg_fds(&msg, fds);
+		if (n > 0 && nfds > 0) {
+			while (n > 0)
+				close(fds[--n]);
+			errno = EPROTO;
+			goto error;
+		}
+		memcpy(req->fds, fds, n * sizeof(int));
+		nfds += n;
+		len += res;
+	}
+
+	req->hdr.nfds = nfds;
+	return 1;
+
+keep:
+	partial = malloc(sizeof(struct fdserver_partial) +
+			 (len > sizeof(fdserver_hdr_t) ?
+			  len - sizeof(fdserver_hdr_t) : 0));
+	if (partial == NULL) {
+		errno = ENOMEM;
+		goto error;
+	}
+	partial->len = len;
+	partial->nfds = nfds;
+	partial->hdr = req->hdr;
+	memcpy(partial->fds, req->fds, nfds * sizeof(int));
+	if (len > sizeof(fdserver_hdr_t))
+		memcpy(partial->payload, req->payload,
+		       len - sizeof(fdserver_hdr_t));
+	for (uint32_t i = 0; i < nfds; i++)
+		req->fds[i] = -1;
+	conn->partial = partial;
+	return 0;
+
+error:
+	close_request_fds(req);
+	return -1;
+}
+
+/*
+ * server function
+ * receive a client request and handle it.
+ * Return -1 if the connection is to be closed, 0 otherwise.
+ */
+static int handle_request(struct fdserver_conn *conn)
+{
+	struct fdserver_request *req = &requests[0];
+	uint32_t magic;
+	ssize_t res;
+	int ret = 0;
+
+	/* subscribers only ever close their connection, and so do clients
+	 * before the end of their dump */
+	if (conn->subscribed || conn->dump != NULL)
+		return -1;
+
+	if (conn->seqpacket)
+		return handle_packets(conn);
+
+	/* v2 clients start with a frame, which v1 messages can't look like */
+	if (conn->version == 0) {
+		do {
+			res = recv(conn->sock, &magic, sizeof(magic),
+				   MSG_PEEK);
+		} while (res < 0 && errno == EINTR);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (res <= 0)
+			return -1;
+		if (res < (ssize_t)sizeof(magic))
+			return 0;
+		conn->version = magic == FDSERVER_MAGIC ? 2 : 1;
+		/* a v1 connection carries a single request, received
+		 * within the timeouts of the socket */
+		if (conn->version == 1)
+			fcntl(conn->sock, F_SETFL,
+			      fcntl(conn->sock, F_GETFL) & ~O_NONBLOCK);
+	}
+
+	init_request(req, conn);
+
+	if (conn->version == 1) {
+		if (recv_request_v1(req) != 0) {
+			ODP_ERR("fdserver: Failed to receive message\n");
+			close_request_fds(req);
+			return -1;
+		}
+		/* a v1 connection carries a single request */
+		ret = -1;
+	} else {
+		res = recv_frame(req);
+		if (res == 0)
+			return 0;
+		if (res < 0) {
+			/* the client closing its connection is no error */
+			if (errno != ECONNRESET)
+				ODP_ERR("fdserver: Failed to receive frame: "
+					"%s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	process_request(req);
+
+	return ret;
+}
+
+/* the limits of the tenants not given any */
+static void default_limits(struct fdserver_limits *limits)
+{
+	limits->max_contexts = config.max_contexts;
+	limits->max_entries = config.max_entries;
+	limits->max_fds = config.context_fds;
+	limits->max_bytes = config.context_bytes;
+}
+
+/*
+ * server function
+ * return the tenant of the given name, creating it with the given limits
+ * if it does not exist yet. The limits of an existing tenant are kept,
+ * with a warning if explicitly given ones differ.
+ */
+static struct fdserver_tenant *get_tenant(const char *name,
+					  const struct fdserver_limits *limits,
+					  int explicit_limits)
+{
+	struct fdserver_tenant *tenant;
+
+	for (tenant = tenants; tenant != NULL; tenant = tenant->next) {
+		if (strcmp(tenant->name, name) != 0)
+			continue;
+		if (explicit_limits &&
+		    (tenant->max_contexts != limits->max_contexts ||
+		     tenant->max_entries != limits->max_entries ||
+		     tenant->max_fds != limits->max_fds ||
+		     tenant->max_bytes != limits->max_bytes))
+			ODP_ERR("Tenant %s keeps its limits (%u contexts, "
+				"%u entries)\n", name, tenant->max_contexts,
+				tenant->max_entries);
+		return tenant;
+	}
+
+	if (strlen(name) >= FDSERVER_MAX_TENANT_NAME) {
+		ODP_ERR("Tenant name too long: %s\n", name);
+		return NULL;
+	}
+
+	tenant = calloc(1, sizeof(struct fdserver_tenant));
+	if (tenant == NULL)
+		return NULL;
+
+	tenant->context_table = calloc(limits->max_contexts,
+				       sizeof(struct fdcontext_entry *));
+	if (tenant->context_table == NULL) {
+		free(tenant);
+		return NULL;
+	}
+
+	strcpy(tenant->name, name);
+	tenant->max_contexts = limits->max_contexts;
+	tenant->max_entries = limits->max_entries;
+	tenant->max_fds = limits->max_fds;
+	tenant->max_bytes = limits->max_bytes;
+	tenant->next = tenants;
+	tenants = tenant;
+
+	return tenant;
+}
+
+static void free_tenants(void)
+{
+	struct fdserver_tenant *tenant;
+
+	while (tenants != NULL) {
+		tenant = tenants;
+		tenants = tenant->next;
+		for (uint32_t i = 0; i < tenant->max_contexts; i++) {
+			if (tenant->context_table[i] != NULL)
+				free_context(tenant->context_table[i]);
+		}
+		free(tenant->context_table);
+		free(tenant);
+	}
+}
+
+static struct fdserver_listener *find_listener(const char *path)
+{
+	struct fdserver_listener *listener;
+
+	for (listener = listeners; listener != NULL;
+	     listener = listener->next) {
+		if (strcmp(listener->path, path) == 0)
+			return listener;
+	}
+
+	return NULL;
+}
+
+/*
+ * server function
+ * start listening on a new named socket, for the given tenant.
+ * Return -1 on error, 0 on success.
+ */
+static int add_listener(const char *path, struct fdserver_tenant *tenant,
+			int seqpacket, int from_config)
+{
+	struct fdserver_listener *listener;
+	struct sockaddr_un local;
+	struct epoll_event event;
+
+	if (strlen(path) >= sizeof(local.sun_path)) {
+		ODP_ERR("Path too long: %s\n", path);
+		return -1;
+	}
+
+	listener = calloc(1, sizeof(struct fdserver_listener));
+	if (listener == NULL)
+		return -1;
+
+	/* create UNIX domain socket: */
+	listener->sock = socket(AF_UNIX, (seqpacket ? SOCK_SEQPACKET :
+					  SOCK_STREAM) |
+				SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener->sock == -1) {
+		ODP_ERR("add_listener: %s\n", strerror(errno));
+		free(listener);
+		return -1;
+	}
+	/* remove previous named socket if it already exists: */
+	unlink(path);
+
+	/* bind to new named socket: */
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	strcpy(local.sun_path, path);
+	if (bind(listener->sock, (struct sockaddr *)&local,
+		 sizeof(struct sockaddr_un)) == -1 ||
+	    listen(listener->sock, FDSERVER_BACKLOG) == -1) {
+		ODP_ERR("add_listener %s: %s\n", path, strerror(errno));
+		goto close_exit;
+	}
+
+	listener->poll.type = POLL_LISTENER;
+	event.events = EPOLLIN;
+	event.data.ptr = &listener->poll;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener->sock, &event) != 0) {
+		ODP_ERR("add_listener: %s\n", strerror(errno));
+		unlink(path);
+		goto close_exit;
+	}
+
+	strcpy(listener->path, path);
+	listener->tenant = tenant;
+	listener->seqpacket = seqpacket;
+	listener->from_config = from_config;
+	listener->next = listeners;
+	listeners = listener;
+	FD_ODP_DBG("Listening on %s for %s\n", path, tenant->name);
+
+	return 0;
+
+close_exit:
+	close(listener->sock);
+	free(listener);
+	return -1;
+}
+
+/*
+ * server function
+ * stop listening on a socket. Connections already accepted from it are
+ * kept, along with the contexts of its tenant.
+ */
+static void del_listener(struct fdserver_listener *listener)
+{
+	struct fdserver_listener **prev;
+
+	for (prev = &listeners; *prev != listener; prev = &(*prev)->next)
+		;
+	*prev = listener->next;
+
+	close(listener->sock);
+	unlink(listener->path);
+	FD_ODP_DBG("Stopped listening on %s\n", listener->path);
+	free(listener);
+}
+
+/*
+ * server function
+ * (re)load the configuration file, which has one listener per line:
+ *   listen <path> [tenant <name>] [contexts <n>] [entries <n>]
+ *                 [fds <n>] [bytes <n>] [transport stream|seqpacket]
+ * A listener has a tenant of its own (named after its path) unless a
+ * tenant name is given, listeners naming the same tenant sharing its
+ * contexts. The limits of a tenant are those given where it first appears;
+ * entries, fds and bytes are quotas of each of its contexts.
+ * Empty lines and lines starting with # are ignored.
+ * Listeners no longer in the file are closed, new ones are opened.
+ */
+static int load_config(const char *config_path,
+		       const struct fdserver_limits *defaults)
+{
+	struct fdserver_listener *listener, *next;
+	struct fdserver_tenant *tenant;
+	char line[512];
+	int line_num = 0;
+	int ret = 0;
+	FILE *file;
+
+	file = fopen(config_path, "r");
+	if (file == NULL) {
+		ODP_ERR("Cannot open %s: %s\n", config_path, strerror(errno));
+		return -1;
+	}
+
+	for (listener = listeners; listener != NULL; listener = listener->next)
+		listener->stale = listener->from_config;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		struct fdserver_limits limits = *defaults;
+		char *path, *name = NULL;
+		int explicit_limits = 0;
+		int seqpacket = 0;
+		char *token, *value;
+		char *saveptr;
+
+		line_num++;
+		token = strtok_r(line, " \t\n", &saveptr);
+		if (token == NULL || token[0] == '#')
+			continue;
+
+		path = strtok_r(NULL, " \t\n", &saveptr);
+		if (strcmp(token, "listen") != 0 || path == NULL)
+			goto parse_error;
+
+		while ((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+			value = strtok_r(NULL, " \t\n", &saveptr);
+			if (value == NULL)
+				goto parse_error;
+			if (strcmp(token, "tenant") == 0) {
+				name = value;
+			} else if (strcmp(token, "contexts") == 0) {
+				limits.max_contexts = strtoul(value, NULL, 0);
+				explicit_limits = 1;
+			} else if (strcmp(token, "entries") == 0) {
+				limits.max_entries = strtoul(value, NULL, 0);
+				explicit_limits = 1;
+			} else if (strcmp(token, "fds") == 0) {
+				limits.max_fds = strtoul(value, NULL, 0);
+				explicit_limits = 1;
+			} else if (strcmp(token, "bytes") == 0) {
+				limits.max_bytes = strtoull(value, NULL, 0);
+				explicit_limits = 1;
+			} else if (strcmp(token, "transport") == 0 &&
+				   (strcmp(value, "stream") == 0 ||
+				    strcmp(value, "seqpacket") == 0)) {
+				seqpacket = strcmp(value, "seqpacket") == 0;
+			} else {
+				goto parse_error;
+			}
+		}
+
+		listener = find_listener(path);
+		if (listener != NULL && listener->seqpacket == seqpacket) {
+			listener->stale = 0;
+			continue;
+		}
+		/* the socket is replaced by one of the other type */
+		if (listener != NULL)
+			del_listener(listener);
+
+		tenant = get_tenant(name != NULL ? name : path, &limits,
+				    explicit_limits);
+		if (tenant == NULL ||
+		    add_listener(path, tenant, seqpacket, 1) != 0)
+			ret = -1;
+		continue;
+
+parse_error:
+		ODP_ERR("%s:%d: syntax error\n", config_path, line_num);
+		ret = -1;
+	}
+	fclose(file);
+
+	for (listener = listeners; listener != NULL; listener = next) {
+		next = listener->next;
+		if (listener->stale)
+			del_listener(listener);
+	}
+
+	return ret;
+}
+
+static void add_conn(struct fdserver_listener *listener, int sock)
+{
+	struct timeval timeout = {
+		.tv_sec = FDSERVER_CONN_TIMEOUT_MS / 1000,
+		.tv_usec = FDSERVER_CONN_TIMEOUT_MS % 1000 * 1000,
+	};
+	socklen_t len = sizeof(struct ucred);
+	struct fdserver_conn *conn;
+	struct epoll_event event;
+
+	conn = calloc(1, sizeof(struct fdserver_conn));
+	if (conn == NULL) {
+		ODP_ERR("add_conn: out of memory\n");
+		close(sock);
+		return;
+	}
+
+	conn->poll.type = POLL_CONN;
+	conn->sock = sock;
+	conn->tenant = listener->tenant;
+	conn->seqpacket = listener->seqpacket;
+	/* only v2 clients know of SOCK_SEQPACKET */
+	if (conn->seqpacket)
+		conn->version = 2;
+	/* access checks and lazy opens rely on the credentials, and zeroed
+	 * ones would be those of root */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &conn->cred, &len) != 0) {
+		ODP_ERR("add_conn: SO_PEERCRED: %s\n", strerror(errno));
+		close(sock);
+		free(conn);
+		return;
+	}
+
+	/* v1 clients only, see handle_request(): the others have their
+	 * socket non-blocking, and a client not reading its replies, or
+	 * stalling half way through a request, does not hold up the server */
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	event.events = EPOLLIN;
+	event.data.ptr = &conn->poll;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+		ODP_ERR("add_conn: %s\n", strerror(errno));
+		close(sock);
+		free(conn);
+		return;
+	}
+
+	conn->next = conns;
+	if (conns != NULL)
+		conns->prev = conn;
+	conns = conn;
+}
+
+static void del_conn(struct fdserver_conn *conn)
+{
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		conns = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	cancel_waiters(conn, NULL);
+	while (conn->watches != NULL)
+		free_watch(conn->watches);
+	while (conn->num_events > 0)
+		pop_event(conn, 0);
+	free(conn->events);
+	free(conn->dump);
+	if (conn->partial != NULL) {
+		while (conn->partial->nfds > 0)
+			close(conn->partial->fds[--conn->partial->nfds]);
+		free(conn->partial);
+	}
+
+	close(conn->sock);
+	free(conn);
+}
+
+/* delete the connections killed while handling the last events */
+static void del_dead_conns(void)
+{
+	struct fdserver_conn *conn, *next;
+
+	for (conn = conns; conn != NULL && dead_conns > 0; conn = next) {
+		next = conn->next;
+		if (conn->dead) {
+			del_conn(conn);
+			dead_conns--;
+		}
+	}
+}
+
+static void accept_conn(struct fdserver_listener *listener)
+{
+	int c_socket; /* client connection */
+
+	c_socket = accept4(listener->sock, NULL, NULL,
+			   SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (c_socket == -1) {
+		if (errno != EINTR && errno != EAGAIN &&
+		    errno != ECONNABORTED)
+			ODP_ERR("accept_conn: %s\n", strerror(errno));
+		return;
+	}
+
+	add_conn(listener, c_socket);
+}
+
+/*
+ * server function
+ * wait for events, busy polling for up to config.spin_budget_ns first.
+ * Return the number of events, or -1 on error.
+ */
+static int wait_events(struct epoll_event *events)
+{
+	uint64_t start;
+	int num_events;
+	int timeout;
+	int idle;
+
+	/* until the first pop waiting times out or idle fd is closed */
+	timeout = expire_waiters();
+	lock_tables();
+	idle = expire_lazy();
+	unlock_tables();
+	if (idle >= 0 && (timeout < 0 || idle < timeout))
+		timeout = idle;
+
+	if (config.spin_budget_ns > 0) {
+		start = now_ns();
+		do {
+			num_events = epoll_wait(epoll_fd, events,
+						FDSERVER_MAX_EVENTS, 0);
+			/* let the caller handle signals as well */
+			if (num_events != 0 || do_reload ||
+			    __atomic_load_n(&do_quit, __ATOMIC_ACQUIRE))
+				return num_events;
+		} while (now_ns() - start < config.spin_budget_ns);
+	}
+
+	if (trace_dirty) {
+		fflush(trace_file);
+		trace_dirty = 0;
+	}
+
+	return epoll_wait(epoll_fd, events, FDSERVER_MAX_EVENTS, timeout);
+}
+
+/*
+ * server function
+ * loop forever, handling client requests as they come on any connection
+ */
+static void wait_requests(void)
+{
+	struct epoll_event events[FDSERVER_MAX_EVENTS];
+	struct fdserver_pollable *pollable;
+	struct fdserver_limits limits;
+	struct fdserver_conn *conn;
+	int num_events;
+
+	default_limits(&limits);
+	while (!__atomic_load_n(&do_quit, __ATOMIC_ACQUIRE)) {
+		if (do_reload) {
+			do_reload = 0;
+			if (config.config_path != NULL) {
+				lock_tables();
+				load_config(config.config_path, &limits);
+				unlock_tables();
+			}
+		}
+
+		num_events = wait_events(events);
+		if (num_events == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ODP_ERR("wait_requests: %s\n", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			pollable = events[i].data.ptr;
+			if (pollable->type == POLL_LISTENER) {
+				accept_conn((struct fdserver_listener *)
+					    pollable);
+				continue;
+			}
+			if (pollable->type == POLL_WAKEUP) {
+				uint64_t count;
+
+				if (read(wakeup_fd, &count, sizeof(count)) < 0)
+					ODP_ERR("wakeup: %s\n", strerror(errno));
+				continue;
+			}
+
+			conn = (struct fdserver_conn *)pollable;
+			if (conn->dead)
+				continue;
+			if (events[i].events & EPOLLOUT) {
+				if (conn->dump != NULL)
+					continue_dump(conn);
+				else
+					flush_events(conn);
+			}
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) &&
+			    (!(events[i].events & EPOLLIN) ||
+			     handle_request(conn) != 0))
+				kill_conn(conn);
+		}
+		del_dead_conns();
+	}
+
+	while (conns != NULL)
+		del_conn(conns);
+	dead_conns = 0;
+}
+
+static void setup_signal_handler(void)
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = hangup_handler;
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	action.sa_handler = reload_handler;
+	sigaction(SIGUSR1, &action, NULL);
+}
+
+static int compare_fds(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* close the n file descriptors of fds, with a syscall per contiguous range */
+static void close_fds(int *fds, size_t n)
+{
+	size_t first;
+	size_t last;
+
+	qsort(fds, n, sizeof(int), compare_fds);
+	for (first = 0; first < n; first = last + 1) {
+		last = first;
+		while (last + 1 < n && fds[last + 1] == fds[last] + 1)
+			last++;
+#ifdef SYS_close_range
+		if (last > first &&
+		    syscall(SYS_close_range, fds[first], fds[last], 0) == 0)
+			continue;
+#endif
+		for (size_t i = first; i <= last; i++)
+			close(fds[i]);
+	}
+}
+
+static void *reaper_main(void *arg __attribute__((unused)))
+{
+	int *fds = NULL;
+	size_t max = 0;
+	size_t n;
+	int *swap;
+
+	for (;;) {
+		pthread_mutex_lock(&reap_lock);
+		while (num_reap_fds == 0 && !reaper_quit)
+			pthread_cond_wait(&reap_cond, &reap_lock);
+		/* only quit once everything is closed */
+		if (num_reap_fds == 0) {
+			pthread_mutex_unlock(&reap_lock);
+			break;
+		}
+		swap = fds;
+		fds = reap_fds;
+		reap_fds = swap;
+		n = max;
+		max = max_reap_fds;
+		max_reap_fds = n;
+		n = num_reap_fds;
+		num_reap_fds = 0;
+		pthread_mutex_unlock(&reap_lock);
+
+		close_fds(fds, n);
+	}
+
+	free(fds);
+
+	return NULL;
+}
+
+/*
+ * start the reaper thread, which signals are not delivered to: they must
+ * interrupt the server. Without a reaper, file descriptors are closed by
+ * the server itself.
+ */
+static void start_reaper(void)
+{
+	sigset_t all;
+	sigset_t old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	reaper_quit = 0;
+	reaper_running = pthread_create(&reaper_thread, NULL, reaper_main,
+					NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!reaper_running)
+		ODP_ERR("No reaper thread, closing inline\n");
+}
+
+/* wait for the file descriptors queued to be closed */
+static void stop_reaper(void)
+{
+	if (!reaper_running)
+		return;
+
+	pthread_mutex_lock(&reap_lock);
+	reaper_quit = 1;
+	pthread_cond_signal(&reap_cond);
+	pthread_mutex_unlock(&reap_lock);
+	pthread_join(reaper_thread, NULL);
+	reaper_running = 0;
+
+	free(reap_fds);
+	reap_fds = NULL;
+	max_reap_fds = 0;
+}
+
+static void prepare_seed(void)
+{
+	unsigned int seed = 1001;
+
+#ifdef HAS_SYS_RANDOM
+again:
+	ssize_t num_bytes;
+	num_bytes = getrandom(&seed, sizeof(seed), 0);
+	if (num_bytes == -1) {
+		if (errno == EINTR)
+			goto again;
+	}
+#else
+	struct timeval timeval;
+
+	if (gettimeofday(&timeval, NULL))
+		seed = (unsigned int)(timeval.tv_sec);
+#endif
+
+	srand(seed);
+}
+
+/* a new epoch, different from the previous instances of the server */
+static void new_epoch(void)
+{
+	struct timespec ts;
+	uint64_t epoch;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	epoch = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	server_epoch = epoch > server_epoch ? epoch : server_epoch + 1;
+}
+
+/*
+ * server function
+ * apply the low latency settings: failing to pin the server is an error,
+ * failing to lock its memory (e.g. for lack of privileges) is not.
+ * Return -1 on error, 0 on success.
+ */
+static int setup_low_latency(void)
+{
+	if (config.pin_cpus &&
+	    sched_setaffinity(0, sizeof(config.cpus), &config.cpus) != 0) {
+		ODP_ERR("Cannot pin the server: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (config.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		ODP_ERR("Cannot lock the server memory: %s\n",
+			strerror(errno));
+
+	return 0;
+}
+
+static void _odp_fdserver_term_global(void)
+{
+	/* no more local lookups from here */
+	lock_tables();
+	__atomic_store_n(&serving, 0, __ATOMIC_RELEASE);
+	unlock_tables();
+
+	while (listeners != NULL)
+		del_listener(listeners);
+	free_tenants();
+	stop_reaper();
+	if (wakeup_fd != -1)
+		close(wakeup_fd);
+	wakeup_fd = -1;
+	if (epoll_fd != -1)
+		close(epoll_fd);
+	epoll_fd = -1;
+	if (trace_file != NULL)
+		fclose(trace_file);
+	trace_file = NULL;
+	trace_dirty = 0;
+}
+
+/*
+ * server function
+ * get the server ready to handle requests, see wait_requests().
+ * Return -1 on error, 0 on success.
+ */
+static int _odp_fdserver_init_global(const struct fdserver_server_config
+				     *settings)
+{
+	struct fdserver_limits limits;
+	struct fdserver_tenant *tenant;
+	struct epoll_event event;
+
+	config = *settings;
+	do_quit = 0;
+	do_reload = 0;
+
+	if (config.signals)
+		setup_signal_handler();
+	prepare_seed();
+	new_epoch();
+
+	/* not to compete with the server for its CPUs */
+	start_reaper();
+	if (setup_low_latency() != 0)
+		goto term_exit;
+
+	if (config.trace_path != NULL && open_trace(config.trace_path) != 0)
+		goto term_exit;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	event.events = EPOLLIN;
+	event.data.ptr = &wakeup;
+	if (epoll_fd == -1 || wakeup_fd == -1 ||
+	    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) != 0) {
+		ODP_ERR("_odp_fdserver_init_global: %s\n", strerror(errno));
+		goto term_exit;
+	}
+
+	/* every path given on the command line is a tenant of its own */
+	default_limits(&limits);
+	for (int i = 0; i < config.num_paths; i++) {
+		tenant = get_tenant(config.paths[i], &limits, 1);
+		if (tenant == NULL ||
+		    add_listener(config.paths[i], tenant,
+				 config.seqpacket, 0) != 0)
+			goto term_exit;
+	}
+
+	if (config.config_path != NULL &&
+	    load_config(config.config_path, &limits) != 0)
+		goto term_exit;
+
+	if (listeners == NULL) {
+		ODP_ERR("Nowhere to listen\n");
+		goto term_exit;
+	}
+
+	__atomic_store_n(&serving, 1, __ATOMIC_RELEASE);
+
+	return 0;
+
+term_exit:
+	_odp_fdserver_term_global();
+	return -1;
+}
+
+int fdserver_internal_server_run(const struct fdserver_server_config *settings)
+{
+	if (_odp_fdserver_init_global(settings) != 0)
+		return -1;
+
+	/* wait for clients requests */
+	wait_requests();
+	_odp_fdserver_term_global();
+
+	return 0;
+}
+
+static void *server_thread_main(void *arg __attribute__((unused)))
+{
+	wait_requests();
+
+	return NULL;
+}
+
+/* the child of a fork does not inherit the server thread, only its tables */
+static void server_atfork_child(void)
+{
+	__atomic_store_n(&serving, 0, __ATOMIC_RELEASE);
+	pthread_mutex_init(&table_lock, NULL);
+	/* nor its reaper */
+	reaper_running = 0;
+	pthread_mutex_init(&reap_lock, NULL);
+	pthread_cond_init(&reap_cond, NULL);
+}
+
+static void register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, server_atfork_child);
+}
+
+int fdserver_server_start(const char *path)
+{
+	static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+	static char server_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	static const char *paths[1] = { server_path };
+	struct fdserver_server_config settings = {
+		.paths = paths,
+		.num_paths = 1,
+		.max_contexts = FDSERVER_MAX_CONTEXTS,
+		.max_entries = FDSERVER_MAX_ENTRIES,
+	};
+	int err;
+
+	if (path == NULL)
+		path = FDSERVER_SOCKET_PATH;
+	if (strlen(path) >= sizeof(server_path)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (embedded) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	strcpy(server_path, path);
+	embedded = 1;
+	if (_odp_fdserver_init_global(&settings) != 0) {
+		embedded = 0;
+		return -1;
+	}
+
+	err = pthread_create(&server_thread, NULL, server_thread_main, NULL);
+	if (err != 0) {
+		_odp_fdserver_term_global();
+		embedded = 0;
+		errno = err;
+		return -1;
+	}
+	server_pid = getpid();
+	pthread_once(&atfork_once, register_atfork);
+
+	return 0;
+}
+
+int fdserver_server_stop(void)
+{
+	uint64_t one = 1;
+
+	if (!embedded || server_pid != getpid()) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	__atomic_store_n(&do_quit, 1, __ATOMIC_RELEASE);
+	if (write(wakeup_fd, &one, sizeof(one)) != sizeof(one))
+		return -1;
+	pthread_join(server_thread, NULL);
+
+	_odp_fdserver_term_global();
+	embedded = 0;
+
+	return 0;
+}
+
+/*
+ * Library function
+ * serve a lookup of this process from the tables of its embedded server,
+ * if it listens on path and is of the given epoch (if not 0): up to *nfds
+ * file descriptors of the value are duplicated to fds, and up to *size
+ * bytes of metadata copied to meta, *nfds and *size being set to the
+ * actual number of fds and size of meta.
+ * Return -1 if the lookup is not for the embedded server, otherwise the
+ * status of the lookup.
+ */
+int fdserver_internal_local_lookup(const char *path, uint64_t epoch,
+				   const struct fdserver_context *ctx,
+				   uint64_t key, int *fds, uint32_t *nfds,
+				   void *meta, uint32_t *size,
+				   uint64_t *generation)
+{
+	struct fdserver_context handle = *ctx;
+	struct fdserver_listener *listener;
+	struct fdcontext_entry *context;
+	struct fdentry *fdentry;
+	struct fdvalue *value;
+	int status;
+
+	if (!__atomic_load_n(&serving, __ATOMIC_ACQUIRE))
+		return -1;
+
+	pthread_mutex_lock(&table_lock);
+	listener = serving ? find_listener(path) : NULL;
+	if (listener == NULL || (epoch != 0 && epoch != server_epoch)) {
+		pthread_mutex_unlock(&table_lock);
+		return -1;
+	}
+
+	context = find_context(listener->tenant, &handle);
+	fdentry = context != NULL ? find_fdentry_from_key(context, key) : NULL;
+	if (context == NULL) {
+		status = ESRCH;
+	} else if (fdentry == NULL) {
+		status = ENOENT;
+	} else {
+		lru_touch(context, fdentry);
+		value = fdentry->value;
+		status = value->lazy != NULL ? open_lazy(value) :
+			FD_RETVAL_SUCCESS;
+		if (*nfds > value->nfds)
+			*nfds = value->nfds;
+		for (uint32_t i = 0; status == FD_RETVAL_SUCCESS && i < *nfds;
+		     i++) {
+			fds[i] = fcntl(value->fds[i], F_DUPFD_CLOEXEC, 0);
+			if (fds[i] >= 0)
+				continue;
+			status = errno;
+			while (i > 0)
+				close(fds[--i]);
+			break;
+		}
+		*nfds = value->nfds;
+		if (size != NULL) {
+			if (*size > value->meta_size)
+				*size = value->meta_size;
+			if (*size > 0)
+				memcpy(meta, value->meta, *size);
+			*size = value->meta_size;
+		}
+		if (generation != NULL)
+			*generation = value->generation;
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	return status;
+}
@@ -0,0 +1,237 @@
+/* Copyright (c) 2018, Linaro Limited
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier:     BSD-3-Clause
+ */
+
+/*
+ * Shared memory helpers on top of the file descriptor server.
+ *
+ * The memory is a memfd registered in the server, along with its size and
+ * flags as metadata so that attaching only takes one lookup and one mmap.
+ * Every process keeps a cache of the regions it has mapped, keyed by
+ * {context, key}, so that attaching the same region several times (e.g.
+ * from different threads or modules) reuses the existing mapping instead of
+ * doing a server round trip and adding yet another mapping of the memory.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <fdserver.h>
+#include <fdserver_internal.h>
+
+/* metadata registered along with the memfd */
+struct shm_meta {
+	uint64_t size;
+	uint32_t flags;
+};
+
+struct shm_mapping {
+	struct shm_mapping *next;
+	struct fdserver_context context;
+	uint64_t key;
+	void *addr;
+	size_t size;
+	unsigned int refcount;
+};
+
+static struct shm_mapping *shm_cache = NULL;
+static pthread_mutex_t shm_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with shm_cache_lock held */
+static struct shm_mapping *find_mapping(fdserver_context_t *context,
+					uint64_t key)
+{
+	struct shm_mapping *mapping;
+
+	for (mapping = shm_cache; mapping != NULL; mapping = mapping->next) {
+		if (mapping->key == key &&
+		    mapping->context.index == context->index &&
+		    mapping->context.token == context->token)
+			return mapping;
+	}
+
+	return NULL;
+}
+
+/*
+ * Insert a new mapping in the cache, unless another thread mapped the same
+ * region in the meantime, in which case the new mapping is dropped and the
+ * existing one is returned.
+ * A region just created (fresh) is never merged: a mapping cached for its
+ * key is of a previous region, deregistered since. The new mapping goes in
+ * front of it, found first from then on, and the old one stays until
+ * detached.
+ */
+static void *cache_mapping(fdserver_context_t *context, uint64_t key,
+			   void *addr, size_t size, int fresh)
+{
+	struct shm_mapping *mapping;
+
+	pthread_mutex_lock(&shm_cache_lock);
+	mapping = fresh ? NULL : find_mapping(context, key);
+	if (mapping != NULL) {
+		mapping->refcount++;
+		pthread_mutex_unlock(&shm_cache_lock);
+		munmap(addr, size);
+		return mapping->addr;
+	}
+
+	mapping = malloc(sizeof(struct shm_mapping));
+	if (mapping == NULL) {
+		pthread_mutex_unlock(&shm_cache_lock);
+		munmap(addr, size);
+		return NULL;
+	}
+	mapping->context = *context;
+	mapping->key = key;
+	mapping->addr = addr;
+	mapping->size = size;
+	mapping->refcount = 1;
+	mapping->next = shm_cache;
+	shm_cache = mapping;
+	pthread_mutex_unlock(&shm_cache_lock);
+
+	return addr;
+}
+
+void *fdserver_shm_create(fdserver_context_t *context, uint64_t key,
+			  size_t size, int flags)
+{
+	struct shm_meta meta;
+	unsigned int memfd_flags = MFD_CLOEXEC;
+	void *addr;
+	int fd;
+
+	if (context == NULL || size == 0)
+		return NULL;
+
+	if (flags & FDSERVER_SHM_HUGEPAGES)
+		memfd_flags |= MFD_HUGETLB;
+	if (flags & FDSERVER_SHM_SEAL)
+		memfd_flags |= MFD_ALLOW_SEALING;
+
+	fd = memfd_create("fdserver_shm", memfd_flags);
+	if (fd == -1) {
+		ODP_ERR("memfd_create: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) == -1) {
+		ODP_ERR("ftruncate: %s\n", strerror(errno));
+		goto close_exit;
+	}
+
+	if ((flags & FDSERVER_SHM_SEAL) &&
+	    fcntl(fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+		ODP_ERR("F_ADD_SEALS: %s\n", strerror(errno));
+		goto close_exit;
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ODP_ERR("mmap: %s\n", strerror(errno));
+		goto close_exit;
+	}
+
+	meta.size = size;
+	meta.flags = flags;
+	if (fdserver_register_fd_meta(context, key, fd,
+				      &meta, sizeof(meta)) != 0) {
+		munmap(addr, size);
+		goto close_exit;
+	}
+	close(fd);
+
+	addr = cache_mapping(context, key, addr, size, 1);
+	if (addr == NULL)
+		/* nobody mapped the memfd registered */
+		fdserver_deregister_fd(context, key);
+
+	return addr;
+
+close_exit:
+	close(fd);
+	return NULL;
+}
+
+void *fdserver_shm_attach(fdserver_context_t *context, uint64_t key,
+			  size_t *size)
+{
+	struct shm_mapping *mapping;
+	struct shm_meta meta;
+	size_t meta_size = sizeof(meta);
+	void *addr;
+	int fd;
+
+	if (context == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&shm_cache_lock);
+	mapping = find_mapping(context, key);
+	if (mapping != NULL) {
+		mapping->refcount++;
+		if (size != NULL)
+			*size = mapping->size;
+		pthread_mutex_unlock(&shm_cache_lock);
+		return mapping->addr;
+	}
+	pthread_mutex_unlock(&shm_cache_lock);
+
+	fd = fdserver_lookup_fd_meta(context, key, &meta, &meta_size);
+	if (fd == -1)
+		return NULL;
+
+	if (meta_size != sizeof(meta)) {
+		ODP_ERR("key %" PRIu64 " is not a shared memory\n", key);
+		close(fd);
+		return NULL;
+	}
+
+	addr = mmap(NULL, meta.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		ODP_ERR("mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (size != NULL)
+		*size = meta.size;
+
+	return cache_mapping(context, key, addr, meta.size, 0);
+}
+
+int fdserver_shm_detach(void *addr)
+{
+	struct shm_mapping **prev;
+	struct shm_mapping *mapping;
+
+	pthread_mutex_lock(&shm_cache_lock);
+	for (prev = &shm_cache; *prev != NULL; prev = &(*prev)->next) {
+		mapping = *prev;
+		if (mapping->addr != addr)
+			continue;
+
+		if (--mapping->refcount == 0) {
+			*prev = mapping->next;
+			munmap(mapping->addr, mapping->size);
+			free(mapping);
+		}
+		pthread_mutex_unlock(&shm_cache_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&shm_cache_lock);
+
+	return -1;
+}
@@ -0,0 +1,290 @@
+/* Copyright (c) 2018, Linaro Limited
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier:     BSD-3-Clause
+ */
+
+/*
+ * fdserverctl shows what a running server holds: its contexts, with their
+ * entry counts, memory usage and owner, and optionally every entry with
+ * its key, generation and the type and size of its file descriptor.
+ * The owners command sums up the entries per registering process, which is
+ * how leaking producers stand out.
+ *
+ * The inventory is streamed by the server (see FD_DUMP) and printed as it
+ * comes, so that dumping a huge server takes no memory here and does not
+ * hold up the requests of its clients.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <fdserver.h>
+#include <fdserver_internal.h>
+#include <fdserver_common.h>
+
+/* per process totals for the owners command */
+struct owner {
+	uint32_t pid;
+	uint64_t entries;
+	uint64_t size;
+};
+
+static struct owner *owners;
+static size_t num_owners;
+/* type of the server socket */
+static int seqpacket;
+
+static int connect_server(const char *path)
+{
+	struct sockaddr_un remote;
+	struct fdserver_hello hello;
+	int fds[FDSERVER_MAX_FDS];
+	fdserver_hdr_t hdr;
+	int sock;
+
+	if (strlen(path) >= sizeof(remote.sun_path)) {
+		fprintf(stderr, "Path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	strcpy(remote.sun_path, path);
+
+	/* the server socket is either a SOCK_SEQPACKET or SOCK_STREAM one */
+	seqpacket = 1;
+again:
+	sock = socket(AF_UNIX, (seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) |
+		      SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+		if (errno == EPROTOTYPE && seqpacket) {
+			close(sock);
+			seqpacket = 0;
+			goto again;
+		}
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto close_exit;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = FD_HELLO;
+	hdr.length = sizeof(hello);
+	hello.version = FDSERVER_PROTO_VERSION;
+	hello.capabilities = 0;
+	hello.epoch = 0;
+	if (fdserver_internal_send_frame(sock, &hdr, NULL, &hello) ||
+	    fdserver_internal_recv(sock, seqpacket, &hdr, fds, &hello,
+				   sizeof(hello)) ||
+	    hdr.command != FD_RETVAL_SUCCESS) {
+		fprintf(stderr, "%s: not a fdserver\n", path);
+		goto close_exit;
+	}
+
+	if (!(hello.capabilities & FD_CAP_DUMP)) {
+		fprintf(stderr, "%s: the server cannot dump\n", path);
+		goto close_exit;
+	}
+
+	return sock;
+
+close_exit:
+	close(sock);
+	return -1;
+}
+
+static void count_owner(struct fdserver_dump_entry *entry)
+{
+	struct owner *owner = NULL;
+
+	for (size_t i = 0; i < num_owners; i++) {
+		if (owners[i].pid == entry->owner_pid) {
+			owner = &owners[i];
+			break;
+		}
+	}
+
+	if (owner == NULL) {
+		owner = realloc(owners, (num_owners + 1) * sizeof(*owners));
+		if (owner == NULL)
+			return;
+		owners = owner;
+		owner = &owners[num_owners++];
+		owner->pid = entry->owner_pid;
+		owner->entries = 0;
+		owner->size = 0;
+	}
+
+	owner->entries++;
+	owner->size += entry->size;
+}
+
+static int compare_owners(const void *a, const void *b)
+{
+	const struct owner *x = a;
+	const struct owner *y = b;
+
+	return x->entries < y->entries ? 1 : x->entries > y->entries ? -1 : 0;
+}
+
+/* print the records of the dump as they come */
+static int dump(int sock, int keys, int print)
+{
+	static char payload[FDSERVER_MAX_PAYLOAD];
+	struct fdserver_dump_context context;
+	struct fdserver_dump_entry entry;
+	struct fdserver_dump_end end;
+	int fds[FDSERVER_MAX_FDS];
+	fdserver_hdr_t hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = FD_DUMP;
+	if (keys)
+		hdr.flags = FD_FLAG_DUMP_KEYS;
+	if (fdserver_internal_send_frame(sock, &hdr, NULL, NULL) ||
+	    fdserver_internal_recv(sock, seqpacket, &hdr, fds, NULL, 0) ||
+	    hdr.command != FD_RETVAL_SUCCESS) {
+		fprintf(stderr, "Dump refused\n");
+		return -1;
+	}
+
+	for (;;) {
+		if (fdserver_internal_recv(sock, seqpacket, &hdr, fds, payload,
+					   sizeof(payload)) ||
+		    !(hdr.flags & FD_FLAG_DUMP)) {
+			fprintf(stderr, "Dump interrupted\n");
+			return -1;
+		}
+
+		switch (hdr.command) {
+		case FD_DUMP_CONTEXT:
+			memcpy(&context, payload, sizeof(context));
+			if (!print)
+				break;
+			context.name[FDSERVER_MAX_CONTEXT_NAME - 1] = '\0';
+			printf("context %u", hdr.context.index);
+			if (context.name[0] != '\0')
+				printf(" \"%s\"", context.name);
+			printf(" (token 0x%08x): %u/%u entries, "
+			       "%" PRIu64 " bytes, owner %u, %u subscribers\n",
+			       hdr.context.token,
+			       context.num_entries, context.max_entries,
+			       context.memory, context.owner_pid,
+			       context.subscribers);
+			break;
+
+		case FD_DUMP_ENTRIES:
+			for (uint32_t i = 0; i < hdr.length / sizeof(entry);
+			     i++) {
+				memcpy(&entry, payload + i * sizeof(entry),
+				       sizeof(entry));
+				count_owner(&entry);
+				if (!print)
+					continue;
+				entry.type[FDSERVER_DUMP_TYPE - 1] = '\0';
+				printf("  key %" PRIu64 " gen %" PRIu64
+				       " fd %d %s size %" PRIu64
+				       " meta %u refs %u owner %u",
+				       entry.key, entry.generation, entry.fd,
+				       entry.type, entry.size, entry.meta_size,
+				       entry.refcount, entry.owner_pid);
+				if (entry.nfds > 1)
+					printf(" group of %u fds", entry.nfds);
+				printf("\n");
+			}
+			break;
+
+		case FD_DUMP_END:
+			memcpy(&end, payload, sizeof(end));
+			printf("total: %u contexts, %u entries, %" PRIu64
+			       " bytes\n", end.contexts, end.entries,
+			       end.memory);
+			return 0;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-p path] <command>\n"
+		"  -p, --path  socket path of the server\n"
+		"commands:\n"
+		"  contexts    list the contexts, their size and owner\n"
+		"  dump        list the contexts and all their entries\n"
+		"  owners      count the entries of every registering process\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"path", required_argument, NULL, 'p'},
+		{0, 0, 0, 0}
+	};
+	const char *path = FDSERVER_SOCKET_PATH;
+	const char *command;
+	int option_index = 0;
+	int opt;
+	int sock;
+	int ret;
+
+	while ((opt = getopt_long(argc, argv, ":p:",
+				  long_options, &option_index)) != -1) {
+		switch (opt) {
+		case 'p':
+			path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	command = argv[optind];
+
+	sock = connect_server(path);
+	if (sock < 0)
+		exit(EXIT_FAILURE);
+
+	if (strcmp(command, "contexts") == 0) {
+		ret = dump(sock, 0, 1);
+	} else if (strcmp(command, "dump") == 0) {
+		ret = dump(sock, 1, 1);
+	} else if (strcmp(command, "owners") == 0) {
+		ret = dump(sock, 1, 0);
+		qsort(owners, num_owners, sizeof(*owners), compare_owners);
+		for (size_t i = 0; ret == 0 && i < num_owners; i++)
+			printf("pid %u: %" PRIu64 " entries, %" PRIu64
+			       " bytes\n", owners[i].pid, owners[i].entries,
+			       owners[i].size);
+	} else {
+		usage(argv[0]);
+		ret = -1;
+	}
+
+	free(owners);
+	close(sock);
+
+	exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -5,6 +5,9 @@
  */
 #ifndef FDSERVER_COMMON_H
 #define FDSERVER_COMMON_H
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -21,14 +24,17 @@
  *  either FD_RETVAL_SUCCESS or FD_RETVAL_FAILURE
  * This function make use of the ancillary data (control data) to pass and
  * convert file descriptors over UNIX sockets
+ * If data is not NULL, size bytes of data are sent right after the message,
+ * preceded by their size, to be read with fdserver_internal_recv_data().
  * Return -1 on error, 0 on success.
  */
-static int fdserver_internal_send_msg(int sock, int command,
-				      struct fdserver_context *context,
-				      uint64_t key, int fd_to_send)
+static inline int fdserver_internal_send_msg(int sock, int command,
+					     struct fdserver_context *context,
+					     uint64_t key, int fd_to_send,
+					     const void *data, uint32_t size)
 {
 	struct msghdr socket_message;
-	struct iovec io_vector[1]; /* one msg frgmt only */
+	struct iovec io_vector[3]; /* msg, data size and data */
 	struct cmsghdr *control_message = NULL;
 	int *fd_location;
 	fdserver_msg_t msg;
@@ -49,6 +55,14 @@ static int fdserver_internal_send_msg(int sock, int command,
 	socket_message.msg_iov = io_vector;
 	socket_message.msg_iovlen = 1;
 
+	if (data != NULL) {
+		io_vector[1].iov_base = &size;
+		io_vector[1].iov_len = sizeof(size);
+		io_vector[2].iov_base = (void *)(uintptr_t)data;
+		io_vector[2].iov_len = size;
+		socket_message.msg_iovlen = 3;
+	}
+
 	if (fd_to_send >= 0) {
 		/* provide space for the ancillary data */
 		memset(ancillary_data, 0, CMSG_SPACE(sizeof(int)));
@@ -63,7 +77,7 @@ static int fdserver_internal_send_msg(int sock, int command,
 		fd_location = (int *)(void *)CMSG_DATA(control_message);
 		*fd_location = fd_to_send;
 	}
-	res = sendmsg(sock, &socket_message, 0);
+	res = sendmsg(sock, &socket_message, MSG_NOSIGNAL);
 	if (res < 0)
 		return -1;
 
@@ -82,9 +96,9 @@ static int fdserver_internal_send_msg(int sock, int command,
  * convert file descriptors over UNIX sockets.
  * Return -1 on error, 0 on success.
  */
-static int fdserver_internal_recv_msg(int sock, int *command,
-				      struct fdserver_context *context,
-				      uint64_t *key, int *recvd_fd)
+static inline int fdserver_internal_recv_msg(int sock, int *command,
+					     struct fdserver_context *context,
+					     uint64_t *key, int *recvd_fd)
 {
 	struct msghdr socket_message;
 	struct iovec io_vector[1]; /* one msg frgmt only */
@@ -118,8 +132,9 @@ static int fdserver_internal_recv_msg(int sock, int *command,
 	/* grab the converted file descriptor (if any) */
 	*recvd_fd = -1;
 
-	/* FIXME: we need to tread this properly, if the other end is the
-	 * client, it could wait forever for our reply... */
+	/* the file descriptor did not fit (e.g. the receiver is out of file
+	 * descriptors): go on without it, the server replies to the request
+	 * as if none was passed and clients bound their wait for the reply */
 	if ((socket_message.msg_flags & MSG_CTRUNC) == MSG_CTRUNC)
 		return 0;
 
@@ -137,4 +152,335 @@ static int fdserver_internal_recv_msg(int sock, int *command,
 
 	return 0;
 }
+
+/*
+ * Client and server function
+ * Read exactly len bytes from the socket, retrying on short reads.
+ * Return -1 on error or if the other end closed the connection, 0 on success.
+ */
+static inline int fdserver_internal_recv_all(int sock, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t res;
+
+	while (len > 0) {
+		res = recv(sock, ptr, len, 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		ptr += res;
+		len -= res;
+	}
+
+	return 0;
+}
+
+/*
+ * Client and server function
+ * Read and throw away len bytes from the socket.
+ * Return -1 on error, 0 on success.
+ */
+static inline int fdserver_internal_discard(int sock, size_t len)
+{
+	char discard[64];
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = len < sizeof(discard) ? len : sizeof(discard);
+		if (fdserver_internal_recv_all(sock, discard, chunk))
+			return -1;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Client and server function
+ * Receive the data sent after a fdserver_msg by fdserver_internal_send_msg().
+ * At most *size bytes are stored in data, anything beyond that is read and
+ * discarded. On return *size holds the size announced by the sender.
+ * Return -1 on error, 0 on success.
+ */
+static inline int fdserver_internal_recv_data(int sock, void *data,
+					      uint32_t *size)
+{
+	uint32_t announced;
+	uint32_t len;
+
+	if (fdserver_internal_recv_all(sock, &announced, sizeof(announced)))
+		return -1;
+
+	len = announced < *size ? announced : *size;
+	if (fdserver_internal_recv_all(sock, data, len))
+		return -1;
+
+	if (fdserver_internal_discard(sock, announced - len))
+		return -1;
+
+	*size = announced;
+
+	return 0;
+}
+
+/*
+ * Client and server function
+ * Send a protocol v2 frame: the header, hdr->length bytes of data and
+ * hdr->nfds file descriptors from fds. The magic and version of the header
+ * are filled in by this function.
+ * Return -1 on error, 0 on success.
+ */
+static inline int fdserver_internal_send_frame(int sock, fdserver_hdr_t *hdr,
+					       const int *fds, const void *data)
+{
+	struct msghdr socket_message;
+	struct iovec io_vector[2];
+	struct cmsghdr *control_message;
+	char ancillary_data[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_FDS)];
+	size_t total;
+	ssize_t res;
+
+	if (hdr->nfds > FDSERVER_MAX_FDS || hdr->length > FDSERVER_MAX_PAYLOAD ||
+	    (hdr->nfds > 0 && fds == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hdr->magic = FDSERVER_MAGIC;
+	hdr->version = FDSERVER_PROTO_VERSION;
+
+	io_vector[0].iov_base = hdr;
+	io_vector[0].iov_len = sizeof(fdserver_hdr_t);
+	io_vector[1].iov_base = (void *)(uintptr_t)data;
+	io_vector[1].iov_len = hdr->length;
+	total = sizeof(fdserver_hdr_t) + hdr->length;
+
+	memset(&socket_message, 0, sizeof(struct msghdr));
+	socket_message.msg_iov = io_vector;
+	socket_message.msg_iovlen = hdr->length > 0 ? 2 : 1;
+
+	if (hdr->nfds > 0 && fds != NULL) {
+		memset(ancillary_data, 0, CMSG_SPACE(sizeof(int) * hdr->nfds));
+		socket_message.msg_control = ancillary_data;
+		socket_message.msg_controllen =
+			CMSG_SPACE(sizeof(int) * hdr->nfds);
+
+		control_message = CMSG_FIRSTHDR(&socket_message);
+		control_message->cmsg_level = SOL_SOCKET;
+		control_message->cmsg_type = SCM_RIGHTS;
+		control_message->cmsg_len = CMSG_LEN(sizeof(int) * hdr->nfds);
+		memcpy(CMSG_DATA(control_message), fds,
+		       sizeof(int) * hdr->nfds);
+	}
+
+	for (;;) {
+		res = sendmsg(sock, &socket_message, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return -1;
+
+		total -= res;
+		if (total == 0)
+			return 0;
+
+		/* a signal interrupted the stream socket half way through the
+		 * frame: the file descriptors are gone, send the rest */
+		socket_message.msg_control = NULL;
+		socket_message.msg_controllen = 0;
+		while ((size_t)res >= socket_message.msg_iov->iov_len) {
+			res -= socket_message.msg_iov->iov_len;
+			socket_message.msg_iov++;
+			socket_message.msg_iovlen--;
+		}
+		socket_message.msg_iov->iov_base =
+			(char *)socket_message.msg_iov->iov_base + res;
+		socket_message.msg_iov->iov_len -= res;
+	}
+}
+
+/*
+ * Client and server function
+ * Receive a protocol v2 frame: the header goes to hdr, the payload to data
+ * and the file descriptors passed to fds, which must have room for
+ * FDSERVER_MAX_FDS of them. On return hdr->nfds holds the number of file
+ * descriptors actually received.
+ * A frame whose payload does not fit in max_size is a protocol error.
+ * Return -1 on error (with errno set), 0 on success.
+ */
+static inline int fdserver_internal_recv_frame(int sock, fdserver_hdr_t *hdr,
+					       int *fds, void *data,
+					       uint32_t max_size)
+{
+	struct msghdr socket_message;
+	struct iovec io_vector[1];
+	struct cmsghdr *control_message;
+	char ancillary_data[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_FDS)];
+	uint32_t nfds = 0;
+	ssize_t res;
+
+	memset(&socket_message, 0, sizeof(struct msghdr));
+	io_vector[0].iov_base = hdr;
+	io_vector[0].iov_len = sizeof(fdserver_hdr_t);
+	socket_message.msg_iov = io_vector;
+	socket_message.msg_iovlen = 1;
+	socket_message.msg_control = ancillary_data;
+	socket_message.msg_controllen = sizeof(ancillary_data);
+
+	do {
+		res = recvmsg(sock, &socket_message, MSG_CMSG_CLOEXEC);
+	} while (res < 0 && errno == EINTR);
+	if (res <= 0) {
+		if (res == 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+
+	for (control_message = CMSG_FIRSTHDR(&socket_message);
+	     control_message != NULL;
+	     control_message = CMSG_NXTHDR(&socket_message, control_message)) {
+		if ((control_message->cmsg_level == SOL_SOCKET) &&
+		    (control_message->cmsg_type == SCM_RIGHTS)) {
+			nfds = (control_message->cmsg_len -
+				CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(control_message),
+			       sizeof(int) * nfds);
+			break;
+		}
+	}
+
+	if ((size_t)res < sizeof(fdserver_hdr_t) &&
+	    fdserver_internal_recv_all(sock, (char *)hdr + res,
+				       sizeof(fdserver_hdr_t) - res))
+		goto error;
+
+	if (hdr->magic != FDSERVER_MAGIC ||
+	    hdr->version != FDSERVER_PROTO_VERSION ||
+	    hdr->length > max_size) {
+		errno = EPROTO;
+		goto error;
+	}
+
+	if (fdserver_internal_recv_all(sock, data, hdr->length))
+		goto error;
+
+	hdr->nfds = nfds;
+
+	return 0;
+
+error:
+	while (nfds > 0)
+		close(fds[--nfds]);
+	return -1;
+}
+
+/*
+ * Client and server function
+ * Return the file descriptors passed with a message received, storing them
+ * in fds, which must have room for FDSERVER_MAX_FDS of them.
+ */
+static inline uint32_t fdserver_internal_msg_fds(struct msghdr *msg, int *fds)
+{
+	struct cmsghdr *control_message;
+	uint32_t nfds;
+
+	for (control_message = CMSG_FIRSTHDR(msg); control_message != NULL;
+	     control_message = CMSG_NXTHDR(msg, control_message)) {
+		if ((control_message->cmsg_level == SOL_SOCKET) &&
+		    (control_message->cmsg_type == SCM_RIGHTS)) {
+			nfds = (control_message->cmsg_len -
+				CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(control_message),
+			       sizeof(int) * nfds);
+			return nfds;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Client and server function
+ * Check a frame received as a single message of len bytes, which is a
+ * protocol error if truncated or not as long as its header says.
+ * Return -1 on error (with errno set), 0 on success.
+ */
+static inline int fdserver_internal_check_packet(struct msghdr *msg,
+						 fdserver_hdr_t *hdr,
+						 size_t len)
+{
+	if (len == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	if ((msg->msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+	    len < sizeof(fdserver_hdr_t) ||
+	    hdr->magic != FDSERVER_MAGIC ||
+	    hdr->version != FDSERVER_PROTO_VERSION ||
+	    len != sizeof(fdserver_hdr_t) + hdr->length) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Client and server function
+ * Same as fdserver_internal_recv_frame(), on a SOCK_SEQPACKET socket: the
+ * frame being a message of its own, it is received by a single recvmsg().
+ */
+static inline int fdserver_internal_recv_packet(int sock, fdserver_hdr_t *hdr,
+						int *fds, void *data,
+						uint32_t max_size)
+{
+	struct msghdr socket_message;
+	struct iovec io_vector[2];
+	char ancillary_data[CMSG_SPACE(sizeof(int) * FDSERVER_MAX_FDS)];
+	uint32_t nfds;
+	ssize_t res;
+
+	memset(&socket_message, 0, sizeof(struct msghdr));
+	io_vector[0].iov_base = hdr;
+	io_vector[0].iov_len = sizeof(fdserver_hdr_t);
+	io_vector[1].iov_base = data;
+	io_vector[1].iov_len = max_size;
+	socket_message.msg_iov = io_vector;
+	socket_message.msg_iovlen = 2;
+	socket_message.msg_control = ancillary_data;
+	socket_message.msg_controllen = sizeof(ancillary_data);
+
+	do {
+		res = recvmsg(sock, &socket_message, MSG_CMSG_CLOEXEC);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -1;
+
+	nfds = fdserver_internal_msg_fds(&socket_message, fds);
+	if (fdserver_internal_check_packet(&socket_message, hdr, res) != 0) {
+		while (nfds > 0)
+			close(fds[--nfds]);
+		return -1;
+	}
+	hdr->nfds = nfds;
+
+	return 0;
+}
+
+/*
+ * Client and server function
+ * Receive a frame from a socket of either type.
+ */
+static inline int fdserver_internal_recv(int sock, int seqpacket,
+					 fdserver_hdr_t *hdr, int *fds,
+					 void *data, uint32_t max_size)
+{
+	if (seqpacket)
+		return fdserver_internal_recv_packet(sock, hdr, fds, data,
+						     max_size);
+
+	return fdserver_internal_recv_frame(sock, hdr, fds, data, max_size);
+}
 #endif
@@ -35,9 +35,11 @@ struct fdserver_context {
 };
 
 /*
+ * Protocol v1:
  * define the message struct used for communication between client and server
  * (this single message is used in both direction)
  * The file descriptors are sent out of band as ancillary data for conversion.
+ * A v1 connection carries a single request and its reply.
  */
 typedef struct fd_server_msg {
 	union {
@@ -55,9 +57,272 @@ typedef struct fd_server_msg {
 #define FD_SERVERSTOP_REQ	4 /* client -> server (stops) */
 #define FD_NEW_CONTEXT		5 /* client -> server */
 #define FD_DEL_CONTEXT		6 /* client -> server */
+#define FD_REGISTER_META_REQ	7 /* client -> server, followed by metadata */
+#define FD_LOOKUP_META_REQ	8 /* client -> server, reply has metadata */
+#define FD_HELLO		9 /* client -> server, v2 only */
+#define FD_LOOKUP_BATCH_REQ	10 /* client -> server, v2 only */
+#define FD_CLONE_CONTEXT	11 /* client -> server, v2 only */
+#define FD_REPLACE_REQ		12 /* client -> server, v2 only */
+#define FD_SUBSCRIBE		13 /* client -> server, v2 only */
+#define FD_DUMP			14 /* client -> server, v2 only */
+#define FD_REVERSE_LOOKUP	15 /* client -> server, v2 only */
+#define FD_NEW_NAMED_CONTEXT	16 /* client -> server, v2 only */
+#define FD_OPEN_CONTEXT		17 /* client -> server, v2 only */
+#define FD_QUEUE_PUSH		18 /* client -> server, v2 only */
+#define FD_QUEUE_POP		19 /* client -> server, v2 only */
+#define FD_REGISTER_PATH_REQ	20 /* client -> server, v2 only */
+#define FD_PUBLISH		21 /* client -> server, v2 only */
 
 /* possible return values from the server */
 #define FD_RETVAL_SUCCESS	0
 #define FD_RETVAL_FAILURE	1
 
+/*
+ * Protocol v2:
+ * Connections are persistent and start with a FD_HELLO exchange in which
+ * client and server agree on the protocol version and the server tells
+ * which optional commands it supports.
+ * Every message is a frame made of a fdserver_hdr_t, followed by length
+ * bytes of payload whose layout depends on the command, with nfds file
+ * descriptors passed as ancillary data.
+ * Replies carry in command either FD_RETVAL_SUCCESS or a positive errno
+ * value telling precisely why the request failed.
+ * The magic value can never be mistaken for a v1 command, which is how the
+ * server tells v1 and v2 clients apart.
+ * Requests may carry the deadline after which the client stops waiting for
+ * the reply: the server does not handle them past it, replying ETIMEDOUT.
+ */
+#define FDSERVER_MAGIC		0x32534446 /* "FDS2" */
+#define FDSERVER_PROTO_VERSION	2
+#define FDSERVER_MAX_PAYLOAD	65536
+#define FDSERVER_MAX_FDS	64
+
+typedef struct fdserver_hdr {
+	uint32_t magic;		/* FDSERVER_MAGIC */
+	uint16_t version;	/* FDSERVER_PROTO_VERSION */
+	uint16_t flags;
+	uint32_t length;	/* payload size */
+	int32_t command;	/* request command, or status of the reply */
+	uint32_t seq;		/* request number, echoed back in the reply */
+	uint32_t nfds;		/* file descriptors passed with the frame */
+	struct fdserver_context context;
+	uint64_t key;
+	uint64_t deadline;	/* CLOCK_MONOTONIC ns, 0 for none */
+} fdserver_hdr_t;
+
+/* FD_HELLO payload, in both directions */
+struct fdserver_hello {
+	uint32_t version;
+	uint32_t capabilities;	/* FD_CAP_* supported by the server */
+	uint64_t epoch;		/* reply: changes when the server restarts */
+};
+
+/* server capabilities */
+#define FD_CAP_META		0x1 /* metadata stored with registrations */
+#define FD_CAP_BATCH		0x2 /* FD_LOOKUP_BATCH_REQ */
+#define FD_CAP_CLONE		0x4 /* FD_CLONE_CONTEXT */
+#define FD_CAP_REPLACE		0x8 /* FD_REPLACE_REQ, FD_FLAG_GENERATION */
+#define FD_CAP_SUBSCRIBE	0x10 /* FD_SUBSCRIBE */
+#define FD_CAP_DUMP		0x20 /* FD_DUMP */
+#define FD_CAP_GROUP		0x40 /* registrations of several fds */
+#define FD_CAP_REVERSE		0x80 /* FD_REVERSE_LOOKUP */
+#define FD_CAP_NAMED		0x100 /* FD_NEW_NAMED_CONTEXT, FD_OPEN_CONTEXT */
+#define FD_CAP_EVICT		0x200 /* FD_FLAG_EVICTABLE */
+#define FD_CAP_QUEUE		0x400 /* FD_QUEUE_PUSH, FD_QUEUE_POP */
+#define FD_CAP_LAZY		0x800 /* FD_REGISTER_PATH_REQ */
+#define FD_CAP_PUBLISH		0x1000 /* FD_PUBLISH */
+
+/* request flags */
+#define FD_FLAG_GENERATION	0x1 /* FD_LOOKUP_REQ: reply has the generation */
+#define FD_FLAG_EVENT		0x2 /* server -> client: the frame is an event */
+#define FD_FLAG_EVENT_FDS	0x4 /* FD_SUBSCRIBE: events carry the fds */
+#define FD_FLAG_DUMP		0x8 /* server -> client: the frame is a dump */
+#define FD_FLAG_DUMP_KEYS	0x10 /* FD_DUMP: list the entries as well */
+#define FD_FLAG_EVICTABLE	0x20 /* FD_REGISTER_*, FD_REPLACE_REQ */
+
+/*
+ * Quotas: the server may limit the entries, file descriptors and bytes
+ * of every context, and the file descriptors and bytes it holds overall.
+ * A registration exceeding them fails with ENOSPC, unless evicting
+ * registrations made with FD_FLAG_EVICTABLE, least recently looked up
+ * first, makes room for it: evictions are notified as deregistrations.
+ * For the server quotas, only the registrations of the same tenant are
+ * evicted, and only those whose fds are not shared with a clone.
+ * A replacement is evictable if requested, or if what it replaces was.
+ */
+
+/*
+ * FD_LOOKUP_BATCH_REQ: the request payload is an array of uint64_t keys,
+ * the reply payload an array of int32_t status, one per key, and the file
+ * descriptors of the keys found are passed in order.
+ */
+
+/*
+ * FD_REVERSE_LOOKUP: the request passes a file descriptor, the reply
+ * payload is the array of uint64_t keys of the context registered to the
+ * same open file (at most FDSERVER_MAX_BATCH), alone or in a group.
+ */
+
+/*
+ * FD_QUEUE_PUSH and FD_QUEUE_POP: the key names a queue of the context,
+ * apart from its registrations. A push passes one file descriptor, handed
+ * to the oldest pop waiting or queued (at most FDSERVER_MAX_QUEUE). A pop
+ * gets the oldest fd queued, or waits for a push until its deadline (for
+ * ever without one) and then fails with ETIMEDOUT: the reply is the
+ * decision of the server, each fd being popped once.
+ */
+
+/*
+ * FD_REGISTER_PATH_REQ: registers a path the server opens on the first
+ * lookup of the key, with the file system credentials of the client
+ * registering it. The payload is a struct fdserver_lazy_path, followed by
+ * the NUL terminated path, relative to the directory fd passed with the
+ * request (if any). The fd is closed again once not looked up for idle_ms.
+ */
+struct fdserver_lazy_path {
+	uint32_t flags;		/* O_*, but O_CREAT, O_TRUNC and O_TMPFILE */
+	uint32_t idle_ms;	/* 0 to keep the fd open once opened */
+};
+
+/*
+ * FD_PUBLISH: the file descriptors passed with the request (at most
+ * FDSERVER_MAX_GROUP) are sent to every subscriber of the context, in a
+ * FDSERVER_EVENT_PUBLISH event carrying them all, whatever the flags of the
+ * subscription. Publications are never coalesced: a subscriber with
+ * FDSERVER_PUBLISH_QUEUE of them pending is skipped. The reply payload is a
+ * struct fdserver_publish.
+ */
+struct fdserver_publish {
+	uint32_t subscribers;	/* the publication was sent or queued to */
+	uint32_t skipped;	/* subscribers too far behind */
+};
+
+/*
+ * FD_CLONE_CONTEXT: the request context is the one to clone, the reply
+ * context the new one.
+ */
+
+/*
+ * FD_NEW_NAMED_CONTEXT and FD_OPEN_CONTEXT: the payload is a
+ * struct fdserver_context_name, and the reply context the one created or
+ * opened. Names are unique in a tenant. Access is checked against the
+ * credentials of the client socket (SO_PEERCRED): a named context can be
+ * opened by processes of the uid which created it, of its gid as well with
+ * FDSERVER_CONTEXT_GROUP, by any with FDSERVER_CONTEXT_ANYONE, and is only
+ * deleted by processes of its uid (or root).
+ */
+struct fdserver_context_name {
+	uint32_t access;	/* FDSERVER_CONTEXT_*, on creation */
+	uint32_t reserved;
+	char name[FDSERVER_MAX_CONTEXT_NAME]; /* NUL terminated */
+};
+
+/*
+ * Every registration gets a generation, unique in the server, which
+ * FD_REPLACE_REQ may be conditioned on. FD_LOOKUP_REQ with
+ * FD_FLAG_GENERATION replies with the uint64_t generation as payload.
+ * FD_REPLACE_REQ: registers the file descriptor passed under the key,
+ * replacing the current registration if any. The payload is a
+ * struct fdserver_replace followed by the metadata, and the reply payload
+ * the uint64_t generation of the new registration, or of the current one
+ * when the request fails with ESTALE.
+ */
+struct fdserver_replace {
+	uint64_t expected;	/* generation, 0 for none, if FD_REPLACE_CAS */
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+#define FD_REPLACE_CAS		0x1 /* only replace the expected generation */
+
+/*
+ * FD_SUBSCRIBE: the payload is an array of struct fdserver_context (at most
+ * FDSERVER_MAX_SUBSCRIBE of fdserver.h) to watch. Once the reply is sent,
+ * the connection only carries events from the server, until the client
+ * closes it.
+ * An event is a frame with FD_FLAG_EVENT set, command being one of the
+ * FDSERVER_EVENT_* of fdserver.h, context and key telling what changed, and
+ * the uint64_t generation of the registration as payload. With
+ * FD_FLAG_EVENT_FDS, FDSERVER_EVENT_REGISTER events pass the new fd.
+ */
+/*
+ * FD_DUMP: once the reply is sent, the server streams the inventory of the
+ * contexts of the tenant, as frames with FD_FLAG_DUMP set and the record
+ * type in command: a FD_DUMP_CONTEXT per context, followed with
+ * FD_FLAG_DUMP_KEYS by FD_DUMP_ENTRIES frames holding its entries, and a
+ * final FD_DUMP_END. The dump is sent a chunk at a time in between other
+ * requests: it is no snapshot, entries changing meanwhile may be missed.
+ * Memory sizes are what the server allocated for the context, entries
+ * shared with clones being accounted to every context holding them.
+ */
+#define FD_DUMP_CONTEXT		1 /* struct fdserver_dump_context */
+#define FD_DUMP_ENTRIES		2 /* array of struct fdserver_dump_entry */
+#define FD_DUMP_END		3 /* struct fdserver_dump_end */
+
+struct fdserver_dump_context {
+	uint32_t num_entries;
+	uint32_t max_entries;
+	uint64_t memory;	/* bytes allocated by the server */
+	uint32_t owner_pid;	/* of the process which created it */
+	uint32_t subscribers;
+	char name[FDSERVER_MAX_CONTEXT_NAME]; /* empty if not named */
+};
+
+#define FDSERVER_DUMP_TYPE	48
+
+struct fdserver_dump_entry {
+	uint64_t key;
+	uint64_t generation;
+	uint64_t size;		/* of the file, e.g. of a memfd */
+	uint32_t meta_size;
+	uint32_t refcount;	/* contexts holding the entry */
+	uint32_t owner_pid;	/* of the process which registered it */
+	int32_t fd;		/* in the server, the first of a group */
+	uint32_t nfds;		/* in the group */
+	char type[FDSERVER_DUMP_TYPE]; /* what /proc says the fd is */
+};
+
+struct fdserver_dump_end {
+	uint32_t contexts;
+	uint32_t entries;
+	uint64_t memory;
+};
+
+/*
+ * Request traces, as recorded by the server (--record) and replayed by
+ * fdserver-replay: a fdserver_trace_header_t followed by one record per
+ * request handled, appended as they come.
+ */
+#define FDSERVER_TRACE_MAGIC	0x52544446 /* "FDTR" */
+#define FDSERVER_TRACE_VERSION	1
+
+typedef struct fdserver_trace_header {
+	uint32_t magic;
+	uint32_t version;
+} fdserver_trace_header_t;
+
+typedef struct fdserver_trace_record {
+	uint64_t timestamp;	/* CLOCK_MONOTONIC ns, when received */
+	uint32_t duration;	/* ns spent handling the request */
+	int32_t command;
+	int32_t status;		/* of the reply */
+	uint32_t pid;		/* of the client */
+	struct fdserver_context context; /* of the reply */
+	uint64_t key;		/* first key of a batch */
+	uint32_t count;		/* keys in a batch */
+	uint32_t size;		/* payload size */
+} fdserver_trace_record_t;
+
+/*
+ * Lookup served from the tables of the server embedded in this process, if
+ * it listens on path and its epoch is the given one (unless 0), see
+ * fdserver_server.c.
+ * Return -1 if the lookup is to be sent to the server, otherwise its status.
+ */
+int fdserver_internal_local_lookup(const char *path, uint64_t epoch,
+				   const struct fdserver_context *ctx,
+				   uint64_t key, int *fds, uint32_t *nfds,
+				   void *meta, uint32_t *size,
+				   uint64_t *generation);
+
 #endif
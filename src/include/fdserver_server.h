@@ -0,0 +1,55 @@
+/* Copyright (c) 2018, Linaro Limited
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier:     BSD-3-Clause
+ */
+
+/*
+ * Server core, run by the fdserver program or embedded in an application
+ * by fdserver_server_start(). Users must define _GNU_SOURCE for cpu_set_t.
+ */
+
+#ifndef _FD_SERVER_SERVER_H
+#define _FD_SERVER_SERVER_H
+
+#include <stdint.h>
+#include <sched.h>
+
+/* define the default size of the tables of file descriptors: */
+#define FDSERVER_MAX_ENTRIES 256
+#define FDSERVER_MAX_CONTEXTS 16
+
+struct fdserver_server_config {
+	const char **paths; /* listened on, each with a tenant of its own */
+	int num_paths;
+	const char *config_path; /* listeners and tenants, if not NULL */
+	const char *trace_path; /* trace of the requests, if not NULL */
+	uint32_t max_contexts; /* default limits of the tenants */
+	uint32_t max_entries;
+	uint32_t context_fds; /* default quotas of a context, 0 for none */
+	uint64_t context_bytes;
+	/* quotas of the whole server, 0 for none */
+	uint64_t max_fds;
+	uint64_t max_bytes;
+	int seqpacket; /* the paths are SOCK_SEQPACKET sockets */
+	/*
+	 * low latency mode: the server runs on the given CPUs, and polls its
+	 * sockets for up to spin_budget_ns after the last event before
+	 * sleeping, which spares the wake up latency to the requests coming
+	 * in the meantime
+	 */
+	int pin_cpus;
+	cpu_set_t cpus;
+	int lock_memory;
+	uint64_t spin_budget_ns;
+	/* stop on SIGHUP, SIGINT and SIGTERM, reload on SIGUSR1 */
+	int signals;
+};
+
+/*
+ * Run the server in the calling thread until it is told to stop.
+ * Return -1 if it could not start, 0 otherwise.
+ */
+int fdserver_internal_server_run(const struct fdserver_server_config *config);
+
+#endif
@@ -1,18 +1,38 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <fdserver.h>
+#include <fdserver_internal.h>
+#include <fdserver_common.h>
 
 #define WELL_KNOWN_MESSAGE (int)(0xbadcafe)
 
 #define KEY_READER 0
 #define KEY_WRITER 1
+#define KEY_META 2
+#define KEY_SHM 3
+
+#define SHM_SIZE 8192
+
+#define WELL_KNOWN_METADATA "fdserver metadata"
 
 static fdserver_context_t *context = NULL;
 static char *path = NULL;
+/* socket of another tenant of the same server, if any */
+static char *tenant_path = NULL;
 
 struct Test {
 	int (*run_test)(void);
@@ -34,6 +54,31 @@ static int delete_context(void)
 	return fdserver_del_context(&context);
 }
 
+static int context_in_storage(void)
+{
+	fdserver_context_storage_t storage;
+	fdserver_context_t *ctx;
+	int fd[2];
+	int ret = 1;
+
+	if (fdserver_new_context_at(&storage, &ctx) != 0)
+		return 1;
+
+	if (ctx != (fdserver_context_t *)&storage || pipe(fd) == -1)
+		goto del_exit;
+
+	if (fdserver_register_fd(ctx, KEY_READER, fd[0]) == 0)
+		ret = 0;
+	close(fd[0]);
+	close(fd[1]);
+
+del_exit:
+	if (fdserver_del_context_at(ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
 static int delete_unexisting_context(void)
 {
 	return fdserver_del_context(&context) ? 0: 1;
@@ -49,7 +94,7 @@ static int request_missing_fd(void)
 		return 1;
 	}
 
-	return 0;
+	return errno != ENOENT;
 }
 
 static int register_fds(void)
@@ -109,6 +154,67 @@ static int lookup_reader(void)
 	return 0;
 }
 
+static int lookup_batch(void)
+{
+	uint64_t keys[] = { KEY_WRITER, 42, KEY_READER };
+	int fds[3];
+	int ret = 0;
+
+	if (fdserver_lookup_batch(context, keys, 3, fds) != 2)
+		return 1;
+
+	if (fds[0] < 0 || fds[1] != -1 || fds[2] < 0)
+		ret = 1;
+
+	for (int i = 0; i < 3; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	return ret;
+}
+
+/* a v1 client sends a single fdserver_msg_t per connection */
+static int lookup_v1(void)
+{
+	struct sockaddr_un remote;
+	struct fdserver_context ctx = *context;
+	uint64_t key = KEY_WRITER;
+	int command;
+	int sock;
+	int fd = -1;
+	int ret = 1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return 1;
+
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	strncpy(remote.sun_path, path != NULL ? path : FDSERVER_SOCKET_PATH,
+		sizeof(remote.sun_path) - 1);
+	if (connect(sock, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+		/* v1 clients cannot talk to a SOCK_SEQPACKET server */
+		if (errno == EPROTOTYPE)
+			ret = 0;
+		goto close_exit;
+	}
+
+	if (fdserver_internal_send_msg(sock, FD_LOOKUP_REQ, &ctx, key, -1,
+				       NULL, 0) ||
+	    fdserver_internal_recv_msg(sock, &command, &ctx, &key, &fd))
+		goto close_exit;
+
+	if (command == FD_RETVAL_SUCCESS && fd >= 0)
+		ret = 0;
+
+close_exit:
+	if (fd >= 0)
+		close(fd);
+	close(sock);
+	return ret;
+}
+
 static int deregister_fds(void)
 {
 	int retval = 0;
@@ -121,57 +227,1579 @@ static int deregister_fds(void)
 	return retval;
 }
 
-struct Test tests_suite[] = {
-	{ do_init, "Initialize library" },
-	{ create_context, "Create context" },
-	{ delete_context, "Delete context" },
-	{ create_context, "Create context Again" },
-	{ request_missing_fd, "Request missing fd" },
-	{ register_fds, "Register two file descriptors" },
-	{ lookup_writer, "Lookup writer fd" },
-	{ lookup_reader, "Lookup reader fd" },
-	{ deregister_fds, "Deregistering file descriptors" },
-	{ request_missing_fd, "Request missing fd" },
-	{ delete_context, "Delete context" },
-	{ delete_unexisting_context, "Try to delete unexisting context"},
-	{ NULL, NULL }
-};
+/* both ends of a pipe registered, looked up and deregistered at once */
+static int fd_group(void)
+{
+	int message = WELL_KNOWN_MESSAGE;
+	int received = 0;
+	int group[2];
+	int fds[2];
+	int fd;
+	int ret = 1;
+
+	if (pipe(group) != 0)
+		return 1;
+
+	if (fdserver_register_fds(context, KEY_READER, group, 2) != 0)
+		goto close_exit;
+
+	if (fdserver_lookup_fds(context, KEY_READER, fds, 1) != -1 ||
+	    errno != EMSGSIZE)
+		goto deregister_exit;
+	if (fdserver_lookup_fds(context, KEY_READER, fds, 2) != 2)
+		goto deregister_exit;
+
+	if (write(fds[1], &message, sizeof(message)) == sizeof(message) &&
+	    read(fds[0], &received, sizeof(received)) == sizeof(received) &&
+	    received == message)
+		ret = 0;
+	close(fds[0]);
+	close(fds[1]);
 
-static int run_tests(void)
+	/* other lookups get the first fd of the group */
+	fd = fdserver_lookup_fd(context, KEY_READER);
+	if (fd < 0 || write(group[1], &message, sizeof(message)) !=
+	    sizeof(message) ||
+	    read(fd, &received, sizeof(received)) != sizeof(received))
+		ret = 1;
+	if (fd >= 0)
+		close(fd);
+
+deregister_exit:
+	if (fdserver_deregister_fd(context, KEY_READER) != 0 ||
+	    fdserver_lookup_fds(context, KEY_READER, fds, 2) != -1)
+		ret = 1;
+close_exit:
+	close(group[0]);
+	close(group[1]);
+
+	return ret;
+}
+
+static int register_fd_meta(void)
 {
-	struct Test *test;
-	int errors = 0;
+	int fd[2];
+	int ret;
 
-	test = &tests_suite[0];
-	while (test->run_test != NULL) {
-		int ret = test->run_test();
-		if (ret == 0) {
-			printf("PASS: ");
-		} else {
-			errors++;
-			printf("FAIL: ");
+	if (pipe(fd) == -1)
+		return 1;
+
+	ret = fdserver_register_fd_meta(context, KEY_META, fd[0],
+					WELL_KNOWN_METADATA,
+					sizeof(WELL_KNOWN_METADATA));
+	close(fd[0]);
+	close(fd[1]);
+
+	return ret;
+}
+
+static int lookup_fd_meta(void)
+{
+	char meta[FDSERVER_MAX_METADATA];
+	size_t size = sizeof(meta);
+	int fd;
+
+	fd = fdserver_lookup_fd_meta(context, KEY_META, meta, &size);
+	if (fd == -1)
+		return 1;
+	close(fd);
+
+	if (size != sizeof(WELL_KNOWN_METADATA) ||
+	    memcmp(meta, WELL_KNOWN_METADATA, size))
+		return 1;
+
+	/* metadata is truncated to the buffer given */
+	size = 4;
+	memset(meta, 0, sizeof(meta));
+	fd = fdserver_lookup_fd_meta(context, KEY_META, meta, &size);
+	if (fd == -1)
+		return 1;
+	close(fd);
+
+	if (size != sizeof(WELL_KNOWN_METADATA) ||
+	    memcmp(meta, WELL_KNOWN_METADATA, 4) || meta[4] != 0)
+		return 1;
+
+	return fdserver_deregister_fd(context, KEY_META) == -1;
+}
+
+static int create_shm(void)
+{
+	char *addr;
+
+	addr = fdserver_shm_create(context, KEY_SHM, SHM_SIZE,
+				   FDSERVER_SHM_SEAL);
+	if (addr == NULL)
+		return 1;
+
+	memset(addr, 0x5a, SHM_SIZE);
+
+	return fdserver_shm_detach(addr);
+}
+
+static int attach_shm(void)
+{
+	char *addr, *again, *fresh;
+	size_t size = 0;
+	int ret = 0;
+
+	addr = fdserver_shm_attach(context, KEY_SHM, &size);
+	if (addr == NULL)
+		return 1;
+
+	if (size != SHM_SIZE || addr[0] != 0x5a || addr[SHM_SIZE - 1] != 0x5a)
+		ret = 1;
+
+	/* second attach reuses the cached mapping */
+	again = fdserver_shm_attach(context, KEY_SHM, NULL);
+	if (again != addr)
+		ret = 1;
+	if (again != NULL)
+		fdserver_shm_detach(again);
+
+	/* a region created again under the key is not the cached one */
+	if (fdserver_deregister_fd(context, KEY_SHM) == -1)
+		ret = 1;
+	fresh = fdserver_shm_create(context, KEY_SHM, SHM_SIZE, 0);
+	if (fresh == NULL || fresh == addr) {
+		ret = 1;
+	} else {
+		again = fdserver_shm_attach(context, KEY_SHM, NULL);
+		if (again != fresh)
+			ret = 1;
+		if (again != NULL)
+			fdserver_shm_detach(again);
+		fdserver_shm_detach(fresh);
+	}
+
+	if (fdserver_shm_detach(addr))
+		ret = 1;
+	/* fully detached now */
+	if (fdserver_shm_detach(addr) == 0)
+		ret = 1;
+
+	if (fdserver_deregister_fd(context, KEY_SHM) == -1)
+		ret = 1;
+
+	return ret;
+}
+
+/*
+ * a key is swapped to another fd in one request, conditionally or not
+ */
+static int replace_fd(void)
+{
+	uint64_t generation, current;
+	int fd[2];
+	int lfd;
+	int ret = 1;
+
+	if (pipe(fd) == -1)
+		return 1;
+
+	if (fdserver_register_fd(context, KEY_META, fd[0]) != 0 ||
+	    fdserver_register_fd(context, KEY_META, fd[1]) != -1 ||
+	    errno != EEXIST)
+		goto close_exit;
+
+	lfd = fdserver_lookup_fd_generation(context, KEY_META, &generation);
+	if (lfd == -1)
+		goto deregister_exit;
+	close(lfd);
+
+	if (fdserver_replace_fd(context, KEY_META, fd[1], &current) != 0 ||
+	    current == generation)
+		goto deregister_exit;
+
+	/* the replaced generation is stale */
+	if (fdserver_compare_replace_fd(context, KEY_META, fd[0], generation,
+					&generation) != -1 ||
+	    errno != ESTALE || generation != current)
+		goto deregister_exit;
+
+	if (fdserver_compare_replace_fd(context, KEY_META, fd[0], current,
+					&generation) != 0 ||
+	    generation == current)
+		goto deregister_exit;
+
+	/* a generation of 0 only matches unregistered keys */
+	if (fdserver_compare_replace_fd(context, KEY_META, fd[0], 0,
+					NULL) != -1 || errno != ESTALE)
+		goto deregister_exit;
+
+	ret = 0;
+
+deregister_exit:
+	if (fdserver_deregister_fd(context, KEY_META) != 0)
+		ret = 1;
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+
+	return ret;
+}
+
+static int expect_event(fdserver_subscription_t *subscription, int type,
+			fdserver_context_t *ctx, uint64_t key)
+{
+	fdserver_event_t event;
+
+	if (fdserver_next_event(subscription, &event) != 0)
+		return 1;
+	if (event.fd >= 0)
+		close(event.fd);
+
+	return event.type != type || event.context != ctx ||
+		(type != FDSERVER_EVENT_CONTEXT_DELETED && event.key != key);
+}
+
+/*
+ * changes made to a context are streamed to its subscribers
+ */
+static int subscribe_context(void)
+{
+	fdserver_subscription_t *subscription;
+	fdserver_context_t *ctx, *subscribed;
+	fdserver_event_t event;
+	uint64_t generation;
+	int fd[2];
+	int ret = 1;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+
+	subscription = fdserver_subscribe(&ctx, 1, FDSERVER_SUBSCRIBE_FDS);
+	if (subscription == NULL || pipe(fd) == -1) {
+		fdserver_del_context(&ctx);
+		fdserver_unsubscribe(subscription);
+		return 1;
+	}
+
+	if (fdserver_register_fd(ctx, KEY_WRITER, fd[1]) != 0 ||
+	    fdserver_next_event(subscription, &event) != 0)
+		goto close_exit;
+
+	/* the event passes the fd just registered */
+	if (event.type != FDSERVER_EVENT_REGISTER || event.context != ctx ||
+	    event.key != KEY_WRITER || event.fd < 0 ||
+	    write(event.fd, &ret, sizeof(ret)) != sizeof(ret) ||
+	    read(fd[0], &ret, sizeof(ret)) != sizeof(ret)) {
+		if (event.fd >= 0)
+			close(event.fd);
+		goto close_exit;
+	}
+	close(event.fd);
+	ret = 1;
+
+	if (fdserver_replace_fd(ctx, KEY_WRITER, fd[0], &generation) != 0 ||
+	    fdserver_next_event(subscription, &event) != 0)
+		goto close_exit;
+	close(event.fd);
+	if (event.type != FDSERVER_EVENT_REGISTER ||
+	    event.generation != generation)
+		goto close_exit;
+
+	if (fdserver_deregister_fd(ctx, KEY_WRITER) != 0 ||
+	    expect_event(subscription, FDSERVER_EVENT_DEREGISTER, ctx,
+			 KEY_WRITER) != 0)
+		goto close_exit;
+
+	ret = 0;
+
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+	/* the handle given to fdserver_subscribe() is what events refer to */
+	subscribed = ctx;
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+	else if (ret == 0)
+		ret = expect_event(subscription, FDSERVER_EVENT_CONTEXT_DELETED,
+				   subscribed, 0);
+	fdserver_unsubscribe(subscription);
+
+	return ret;
+}
+
+/*
+ * a single publication reaches every subscriber of the context, with all
+ * the fds published
+ */
+static int publish_fds(void)
+{
+	fdserver_subscription_t *subscriptions[3] = { NULL, NULL, NULL };
+	fdserver_context_t *ctx;
+	fdserver_event_t event;
+	int skipped = -1;
+	int fd[2];
+	int ret = 1;
+	int i;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+	if (pipe(fd) == -1) {
+		fdserver_del_context(&ctx);
+		return 1;
+	}
+
+	/* nobody to publish to yet */
+	if (fdserver_publish(ctx, KEY_WRITER, fd, 2, &skipped) != 0 ||
+	    skipped != 0)
+		goto close_exit;
+
+	for (i = 0; i < 3; i++) {
+		subscriptions[i] = fdserver_subscribe(&ctx, 1, 0);
+		if (subscriptions[i] == NULL)
+			goto close_exit;
+	}
+
+	if (fdserver_publish(ctx, KEY_WRITER, fd, 2, &skipped) != 3 ||
+	    skipped != 0)
+		goto close_exit;
+
+	for (i = 0; i < 3; i++) {
+		if (fdserver_next_event(subscriptions[i], &event) != 0)
+			goto close_exit;
+		/* the write end received writes to the read end we hold */
+		if (event.type != FDSERVER_EVENT_PUBLISH ||
+		    event.context != ctx || event.key != KEY_WRITER ||
+		    event.nfds != 2 || event.fd != event.fds[0] ||
+		    write(event.fds[1], &i, sizeof(i)) != sizeof(i) ||
+		    read(fd[0], &ret, sizeof(ret)) != sizeof(ret) ||
+		    ret != i) {
+			ret = 1;
+			while (event.nfds > 0)
+				close(event.fds[--event.nfds]);
+			goto close_exit;
 		}
-		printf("%s\n", test->name);
-		test++;
+		ret = 1;
+		while (event.nfds > 0)
+			close(event.fds[--event.nfds]);
 	}
 
-	return errors;
+	ret = 0;
+
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+	for (i = 0; i < 3; i++)
+		fdserver_unsubscribe(subscriptions[i]);
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
 }
 
-int main(int argc, char *argv[])
+/*
+ * a server embedded in this process serves its lookups directly, and those
+ * of other processes over its socket
+ */
+static int embedded_server(void)
 {
-	static struct option long_options[] = {
-		{"path", required_argument, NULL, 'p'},
-		{0 , 0, 0, 0}
-	};
-	int opt;
-	int option_index = 0;
+	const char *server_path = path != NULL ? path : FDSERVER_SOCKET_PATH;
+	char embedded_path[64];
+	int message = WELL_KNOWN_MESSAGE;
+	fdserver_context_t *ctx = NULL;
+	uint64_t generation = 0;
+	int received = 0;
+	int status;
+	int fd[2];
+	int rfd, wfd;
+	int ret = 1;
+	pid_t pid;
 
-	while ((opt = getopt_long(argc, argv,
-				  ":p:", long_options, &option_index)) != -1) {
-		switch (opt) {
-		case 'p':
-			path = strdup(optarg);
+	snprintf(embedded_path, sizeof(embedded_path),
+		 "/tmp/fdserver_embedded.%d", getpid());
+	if (fdserver_server_start(embedded_path) != 0)
+		return 1;
+	if (fdserver_server_start(embedded_path) != -1 || errno != EBUSY)
+		goto stop_exit;
+
+	if (fdserver_init(embedded_path) != 0 ||
+	    fdserver_new_context(&ctx) != 0 ||
+	    pipe(fd) != 0)
+		goto stop_exit;
+
+	if (fdserver_register_fd(ctx, KEY_READER, fd[0]) != 0 ||
+	    fdserver_register_fd(ctx, KEY_WRITER, fd[1]) != 0)
+		goto close_exit;
+
+	/* the child is another process as far as the server is concerned */
+	pid = fork();
+	if (pid == 0) {
+		wfd = fdserver_lookup_fd(ctx, KEY_WRITER);
+		if (wfd < 0 ||
+		    write(wfd, &message, sizeof(message)) != sizeof(message))
+			_exit(1);
+		_exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		goto close_exit;
+
+	rfd = fdserver_lookup_fd_generation(ctx, KEY_READER, &generation);
+	if (rfd < 0)
+		goto close_exit;
+	if (generation != 0 &&
+	    read(rfd, &received, sizeof(received)) == sizeof(received) &&
+	    received == message &&
+	    fdserver_lookup_fd(ctx, KEY_META) == -1 && errno == ENOENT)
+		ret = 0;
+	close(rfd);
+
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+stop_exit:
+	if (ctx != NULL && fdserver_del_context(&ctx) != 0)
+		ret = 1;
+	if (fdserver_server_stop() != 0 ||
+	    fdserver_init(server_path) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+#define KEY_REVERSE 0x101
+
+/* the keys registered to an open file, whichever end of a pipe it is */
+static int reverse_lookup(void)
+{
+	uint64_t keys[4];
+	int group[2];
+	int other[2];
+	int fd;
+	int n;
+	int ret = 1;
+
+	fd = fdserver_lookup_fd(context, KEY_WRITER);
+	if (fd == -1)
+		return 1;
+	if (pipe(other) == -1)
+		goto close_exit;
+
+	/* the reader shares the inode of the writer, but not its file */
+	n = fdserver_reverse_lookup(context, fd, keys, 4);
+	if (n != 1 || keys[0] != KEY_WRITER)
+		goto pipe_exit;
+
+	group[0] = other[0];
+	group[1] = fd;
+	if (fdserver_register_fds(context, KEY_REVERSE, group, 2) != 0)
+		goto pipe_exit;
+	n = fdserver_reverse_lookup(context, fd, keys, 4);
+	if (n != 2 || keys[0] == keys[1] ||
+	    (keys[0] != KEY_REVERSE && keys[0] != KEY_WRITER) ||
+	    (keys[1] != KEY_REVERSE && keys[1] != KEY_WRITER))
+		goto deregister_exit;
+
+	if (fdserver_reverse_lookup(context, other[1], keys, 4) != -1 ||
+	    errno != ENOENT)
+		goto deregister_exit;
+	ret = 0;
+
+deregister_exit:
+	if (fdserver_deregister_fd(context, KEY_REVERSE) != 0)
+		ret = 1;
+pipe_exit:
+	close(other[0]);
+	close(other[1]);
+close_exit:
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * connect to the server without the library, whatever the type of its
+ * socket, and say hello. Return the socket, or -1 on error.
+ */
+static int connect_raw(int *seqpacket, struct fdserver_hello *hello)
+{
+	struct sockaddr_un remote;
+	int fds[FDSERVER_MAX_FDS];
+	fdserver_hdr_t hdr;
+	int sock;
+
+	memset(&remote, 0, sizeof(remote));
+	remote.sun_family = AF_UNIX;
+	strncpy(remote.sun_path, path != NULL ? path : FDSERVER_SOCKET_PATH,
+		sizeof(remote.sun_path) - 1);
+
+	*seqpacket = 1;
+again:
+	sock = socket(AF_UNIX, *seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+	if (sock == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+		close(sock);
+		if (errno == EPROTOTYPE && *seqpacket) {
+			*seqpacket = 0;
+			goto again;
+		}
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = FD_HELLO;
+	hdr.length = sizeof(*hello);
+	hello->version = FDSERVER_PROTO_VERSION;
+	hello->capabilities = 0;
+	if (fdserver_internal_send_frame(sock, &hdr, NULL, hello) ||
+	    fdserver_internal_recv(sock, *seqpacket, &hdr, fds, hello,
+				   sizeof(*hello))) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+#define KEY_PIPELINED 0x100
+/* keys of the same fd, more than the replies queued together can take */
+#define KEY_ALIAS 0x200
+#define NUM_ALIASES 40
+
+/*
+ * requests sent without waiting for the replies are answered in order,
+ * lookups being answered together on a SOCK_SEQPACKET socket
+ */
+static int pipelined_requests(void)
+{
+	uint64_t keys[FDSERVER_MAX_BATCH];
+	struct fdserver_hello hello;
+	int fds[FDSERVER_MAX_FDS];
+	fdserver_hdr_t hdr;
+	int pipefd[2];
+	int seqpacket;
+	int aliases;
+	int sock;
+	int ret = 1;
+	/* a registration amid lookups, which must see it */
+	static const struct {
+		int command;
+		uint64_t key;
+		int status;
+		uint32_t nfds;
+	} requests[] = {
+		{ FD_LOOKUP_REQ, KEY_WRITER, FD_RETVAL_SUCCESS, 1 },
+		{ FD_LOOKUP_REQ, KEY_PIPELINED, ENOENT, 0 },
+		{ FD_REVERSE_LOOKUP, 0, FD_RETVAL_SUCCESS, 0 },
+		{ FD_LOOKUP_REQ, KEY_WRITER, FD_RETVAL_SUCCESS, 1 },
+		{ FD_REGISTER_REQ, KEY_PIPELINED, FD_RETVAL_SUCCESS, 0 },
+		{ FD_LOOKUP_REQ, KEY_PIPELINED, FD_RETVAL_SUCCESS, 1 },
+		{ FD_DEREGISTER_REQ, KEY_PIPELINED, FD_RETVAL_SUCCESS, 0 },
+		{ FD_LOOKUP_REQ, KEY_PIPELINED, ENOENT, 0 },
+	};
+	const int n = sizeof(requests) / sizeof(requests[0]);
+	/* sent at once, for the server to receive them together */
+	struct mmsghdr msgs[sizeof(requests) / sizeof(requests[0])];
+	fdserver_hdr_t hdrs[sizeof(requests) / sizeof(requests[0])];
+	struct iovec iov[sizeof(requests) / sizeof(requests[0])];
+	char control[sizeof(requests) / sizeof(requests[0])]
+		[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+
+	if (pipe(pipefd) != 0)
+		return 1;
+
+	for (aliases = 0; aliases < NUM_ALIASES; aliases++)
+		if (fdserver_register_fd(context, KEY_ALIAS + aliases,
+					 pipefd[1]) != 0)
+			goto close_exit;
+
+	sock = connect_raw(&seqpacket, &hello);
+	if (sock < 0)
+		goto close_exit;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < n; i++) {
+		memset(&hdrs[i], 0, sizeof(hdrs[i]));
+		hdrs[i].magic = FDSERVER_MAGIC;
+		hdrs[i].version = FDSERVER_PROTO_VERSION;
+		hdrs[i].command = requests[i].command;
+		hdrs[i].seq = i + 1;
+		hdrs[i].context = *context;
+		hdrs[i].key = requests[i].key;
+		iov[i].iov_base = &hdrs[i];
+		iov[i].iov_len = sizeof(hdrs[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (requests[i].command != FD_REGISTER_REQ &&
+		    requests[i].command != FD_REVERSE_LOOKUP)
+			continue;
+		/* the reverse lookup is for the fd of the aliases */
+		hdrs[i].nfds = 1;
+		msgs[i].msg_hdr.msg_control = control[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), requests[i].command == FD_REGISTER_REQ ?
+		       &pipefd[0] : &pipefd[1], sizeof(int));
+	}
+	if (sendmmsg(sock, msgs, n, MSG_NOSIGNAL) != n)
+		goto sock_exit;
+
+	for (int i = 0; i < n; i++) {
+		if (fdserver_internal_recv(sock, seqpacket, &hdr, fds,
+					   keys, sizeof(keys)))
+			goto sock_exit;
+		while (hdr.nfds > 0)
+			close(fds[--hdr.nfds]);
+		if (hdr.seq != (uint32_t)i + 1 ||
+		    hdr.command != requests[i].status ||
+		    (requests[i].command == FD_REVERSE_LOOKUP &&
+		     hdr.length != NUM_ALIASES * sizeof(uint64_t)))
+			goto sock_exit;
+	}
+	ret = 0;
+
+sock_exit:
+	close(sock);
+close_exit:
+	while (aliases-- > 0)
+		fdserver_deregister_fd(context, KEY_ALIAS + aliases);
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	return ret;
+}
+
+/*
+ * a client stalling half way through a frame does not hold up the others:
+ * the server gets the rest of the frame when it comes
+ */
+static int stalled_client(void)
+{
+	struct fdserver_hello hello;
+	int fds[FDSERVER_MAX_FDS];
+	fdserver_hdr_t hdr;
+	int seqpacket;
+	int sock;
+	int fd;
+	int ret = 1;
+
+	sock = connect_raw(&seqpacket, &hello);
+	if (sock < 0)
+		return 1;
+	/* frames are messages of their own there, never received in part */
+	if (seqpacket) {
+		close(sock);
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FDSERVER_MAGIC;
+	hdr.version = FDSERVER_PROTO_VERSION;
+	hdr.command = FD_LOOKUP_REQ;
+	hdr.seq = 1;
+	hdr.context = *context;
+	hdr.key = KEY_WRITER;
+	if (send(sock, &hdr, sizeof(hdr) / 2, MSG_NOSIGNAL) !=
+	    sizeof(hdr) / 2)
+		goto close_exit;
+
+	/* well within the time a blocking server would wait */
+	if (fdserver_set_timeout(200) != 0)
+		goto close_exit;
+	fd = fdserver_lookup_fd(context, KEY_WRITER);
+	fdserver_set_timeout(-1);
+	if (fd < 0)
+		goto close_exit;
+	close(fd);
+
+	if (send(sock, (char *)&hdr + sizeof(hdr) / 2,
+		 sizeof(hdr) - sizeof(hdr) / 2, MSG_NOSIGNAL) !=
+	    sizeof(hdr) - sizeof(hdr) / 2 ||
+	    fdserver_internal_recv(sock, 0, &hdr, fds, NULL, 0))
+		goto close_exit;
+	while (hdr.nfds > 0)
+		close(fds[--hdr.nfds]);
+	if (hdr.seq == 1 && hdr.command == FD_RETVAL_SUCCESS)
+		ret = 0;
+
+close_exit:
+	close(sock);
+
+	return ret;
+}
+
+/*
+ * the dump of the server lists a context with its entries, and the type of
+ * the file descriptors registered
+ */
+static int dump_inventory(void)
+{
+	static char payload[FDSERVER_MAX_PAYLOAD];
+	struct fdserver_context ctx;
+	struct fdserver_hello hello;
+	struct fdserver_dump_context record;
+	struct fdserver_dump_entry entry;
+	int fds[FDSERVER_MAX_FDS];
+	fdserver_context_t *dumped;
+	fdserver_hdr_t hdr;
+	int found = 0;
+	int pipefd[2];
+	int seqpacket;
+	int sock = -1;
+	int ret = 1;
+
+	if (fdserver_new_context(&dumped) != 0)
+		return 1;
+	ctx = *dumped;
+	if (pipe(pipefd) != 0)
+		goto del_exit;
+	if (fdserver_register_fd(dumped, KEY_READER, pipefd[0]) != 0)
+		goto close_exit;
+
+	sock = connect_raw(&seqpacket, &hello);
+	if (sock < 0 || !(hello.capabilities & FD_CAP_DUMP))
+		goto close_exit;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.command = FD_DUMP;
+	hdr.flags = FD_FLAG_DUMP_KEYS;
+	if (fdserver_internal_send_frame(sock, &hdr, NULL, NULL) ||
+	    fdserver_internal_recv(sock, seqpacket, &hdr, fds, NULL, 0) ||
+	    hdr.command != FD_RETVAL_SUCCESS)
+		goto close_exit;
+
+	for (;;) {
+		if (fdserver_internal_recv(sock, seqpacket, &hdr, fds, payload,
+					   sizeof(payload)) ||
+		    !(hdr.flags & FD_FLAG_DUMP))
+			goto close_exit;
+		if (hdr.command == FD_DUMP_END)
+			break;
+		if (hdr.context.index != ctx.index ||
+		    hdr.context.token != ctx.token)
+			continue;
+
+		if (hdr.command == FD_DUMP_CONTEXT) {
+			memcpy(&record, payload, sizeof(record));
+			if (record.num_entries == 1 &&
+			    record.owner_pid == (uint32_t)getpid())
+				found++;
+		} else if (hdr.command == FD_DUMP_ENTRIES &&
+			   hdr.length == sizeof(entry)) {
+			memcpy(&entry, payload, sizeof(entry));
+			if (entry.key == KEY_READER &&
+			    strncmp(entry.type, "pipe:[", 6) == 0)
+				found++;
+		}
+	}
+
+	if (found == 2)
+		ret = 0;
+
+close_exit:
+	if (sock >= 0)
+		close(sock);
+	close(pipefd[0]);
+	close(pipefd[1]);
+del_exit:
+	if (fdserver_del_context(&dumped) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+/*
+ * calls give up on a server which never replies, and on their deadline
+ */
+static int deadlines(void)
+{
+	struct sockaddr_un local = { .sun_family = AF_UNIX };
+	const char *server_path = path != NULL ? path : FDSERVER_SOCKET_PATH;
+	fdserver_context_t *ctx = NULL;
+	struct timespec now;
+	int sock;
+	int ret = 1;
+
+	/* a server accepting connections but never reading them */
+	snprintf(local.sun_path, sizeof(local.sun_path),
+		 "/tmp/fdserver_wedged.%d", getpid());
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return 1;
+	unlink(local.sun_path);
+	if (bind(sock, (struct sockaddr *)&local, sizeof(local)) != 0 ||
+	    listen(sock, 1) != 0)
+		goto close_exit;
+
+	if (fdserver_init(local.sun_path) != 0 ||
+	    fdserver_set_timeout(100) != 0)
+		goto restore_exit;
+
+	if (fdserver_new_context(&ctx) != -1 || errno != ETIMEDOUT)
+		goto restore_exit;
+
+	if (fdserver_init(server_path) != 0 ||
+	    fdserver_set_timeout(-1) != 0 ||
+	    fdserver_new_context(&ctx) != 0)
+		goto restore_exit;
+
+	/* a deadline already passed */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (fdserver_set_deadline(&now) != 0 ||
+	    fdserver_lookup_fd(ctx, KEY_READER) != -1 ||
+	    errno != ETIMEDOUT)
+		goto restore_exit;
+
+	ret = 0;
+
+restore_exit:
+	fdserver_set_deadline(NULL);
+	fdserver_set_timeout(-1);
+	if (fdserver_init(server_path) != 0 ||
+	    (ctx != NULL && fdserver_del_context(&ctx) != 0))
+		ret = 1;
+close_exit:
+	close(sock);
+	unlink(local.sun_path);
+
+	return ret;
+}
+
+/*
+ * a clone starts with the registrations of its source, then both evolve
+ * independently, the shared file descriptors outliving the source
+ */
+static int clone_context(void)
+{
+	fdserver_context_t *base, *clone;
+	int message = WELL_KNOWN_MESSAGE;
+	int received = 0;
+	int fd[2];
+	int rfd, wfd;
+	int ret = 1;
+
+	if (fdserver_new_context(&base) != 0)
+		return 1;
+
+	if (pipe(fd) == -1)
+		goto del_base;
+
+	if (fdserver_register_fd(base, KEY_READER, fd[0]) != 0 ||
+	    fdserver_register_fd(base, KEY_WRITER, fd[1]) != 0 ||
+	    fdserver_clone_context(base, &clone) != 0)
+		goto close_exit;
+
+	/* diverge: the clone drops a key the base keeps */
+	if (fdserver_deregister_fd(clone, KEY_READER) != 0 ||
+	    fdserver_lookup_fd(clone, KEY_READER) != -1 || errno != ENOENT)
+		goto del_clone;
+
+	rfd = fdserver_lookup_fd(base, KEY_READER);
+	if (rfd == -1)
+		goto del_clone;
+
+	/* the writer registered in the base lives on in the clone */
+	if (fdserver_del_context(&base) != 0) {
+		close(rfd);
+		goto del_clone;
+	}
+	close(fd[0]);
+	close(fd[1]);
+	fd[0] = fd[1] = -1;
+
+	wfd = fdserver_lookup_fd(clone, KEY_WRITER);
+	if (wfd != -1) {
+		if (write(wfd, &message, sizeof(message)) == sizeof(message) &&
+		    read(rfd, &received, sizeof(received)) == sizeof(received) &&
+		    received == message)
+			ret = 0;
+		close(wfd);
+	}
+	close(rfd);
+
+del_clone:
+	if (fdserver_del_context(&clone) != 0)
+		ret = 1;
+close_exit:
+	if (fd[0] >= 0) {
+		close(fd[0]);
+		close(fd[1]);
+	}
+del_base:
+	if (base != NULL && fdserver_del_context(&base) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+#define NUM_REAPED 32
+
+/*
+ * the server closes the fds of a deleted context, if in the background:
+ * the readers of the pipes it held the only writers of get a hangup
+ */
+static int delete_closes_fds(void)
+{
+	struct pollfd readers[NUM_REAPED];
+	fdserver_context_t *ctx;
+	int num_pipes = 0;
+	int hangups;
+	int fd[2];
+	int ret = 1;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+
+	for (; num_pipes < NUM_REAPED; num_pipes++) {
+		if (pipe(fd) == -1)
+			break;
+		readers[num_pipes].fd = fd[0];
+		readers[num_pipes].events = POLLIN;
+		if (fdserver_register_fd(ctx, num_pipes, fd[1]) != 0) {
+			close(fd[0]);
+			close(fd[1]);
+			break;
+		}
+		close(fd[1]);
+	}
+
+	if (fdserver_del_context(&ctx) != 0 || num_pipes < NUM_REAPED)
+		goto close_exit;
+
+	for (hangups = 0; hangups < num_pipes;) {
+		if (poll(readers, num_pipes, 2000) <= 0)
+			goto close_exit;
+		for (int i = 0; i < num_pipes; i++) {
+			if (readers[i].revents & POLLHUP) {
+				readers[i].fd = -readers[i].fd - 1;
+				hangups++;
+			}
+		}
+	}
+	ret = 0;
+
+close_exit:
+	if (ctx != NULL)
+		fdserver_del_context(&ctx);
+	for (int i = 0; i < num_pipes; i++)
+		close(readers[i].fd < 0 ? -readers[i].fd - 1 : readers[i].fd);
+
+	return ret;
+}
+
+#define KEY_PINNED 0x1000
+#define KEY_EVICTABLE 0x2000
+#define MAX_FILL 4096
+
+static int lookup_found(fdserver_context_t *ctx, uint64_t key)
+{
+	int fd;
+
+	fd = fdserver_lookup_fd(ctx, key);
+	if (fd < 0)
+		return 0;
+	close(fd);
+
+	return 1;
+}
+
+/*
+ * once a quota is reached, registering evicts the least recently looked up
+ * of the evictable entries, and fails if there is none
+ */
+static int evict_entries(void)
+{
+	fdserver_context_t *ctx;
+	int fd[2];
+	int n;
+	int ret = 1;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+	if (pipe(fd) == -1)
+		goto del_exit;
+
+	for (n = 0; n < MAX_FILL; n++)
+		if (fdserver_register_fd(ctx, KEY_PINNED + n, fd[0]) != 0)
+			break;
+	if (n < 3 || n == MAX_FILL || errno != ENOSPC)
+		goto close_exit;
+
+	/* room for two evictable entries, of which the second is used */
+	if (fdserver_deregister_fd(ctx, KEY_PINNED) != 0 ||
+	    fdserver_deregister_fd(ctx, KEY_PINNED + 1) != 0 ||
+	    fdserver_register_fd_flags(ctx, KEY_EVICTABLE, fd[0], NULL, 0,
+				       FDSERVER_REGISTER_EVICTABLE) != 0 ||
+	    fdserver_register_fd_flags(ctx, KEY_EVICTABLE + 1, fd[0], NULL, 0,
+				       FDSERVER_REGISTER_EVICTABLE) != 0 ||
+	    !lookup_found(ctx, KEY_EVICTABLE + 1))
+		goto close_exit;
+
+	if (fdserver_register_fd(ctx, KEY_PINNED, fd[0]) != 0 ||
+	    lookup_found(ctx, KEY_EVICTABLE) ||
+	    !lookup_found(ctx, KEY_EVICTABLE + 1))
+		goto close_exit;
+
+	if (fdserver_register_fd(ctx, KEY_PINNED + 1, fd[0]) != 0 ||
+	    lookup_found(ctx, KEY_EVICTABLE + 1))
+		goto close_exit;
+
+	/* nothing left to evict */
+	if (fdserver_register_fd(ctx, KEY_PINNED + n, fd[0]) == 0 ||
+	    errno != ENOSPC)
+		goto close_exit;
+	ret = 0;
+
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+del_exit:
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+/* name of the contexts of the tests, unique to the process */
+static void context_name(char *name)
+{
+	snprintf(name, FDSERVER_MAX_CONTEXT_NAME, "fdserver_api.%d",
+		 (int)getpid());
+}
+
+/* a context found by its name rather than handed over */
+static int named_context(void)
+{
+	char name[FDSERVER_MAX_CONTEXT_NAME];
+	fdserver_context_t *created;
+	fdserver_context_t *opened;
+	fdserver_context_t *other;
+	int fd[2];
+	int found;
+	int ret = 1;
+
+	context_name(name);
+	if (fdserver_new_named_context(name, 0, &created) != 0)
+		return 1;
+
+	if (pipe(fd) == -1)
+		goto del_exit;
+	if (fdserver_register_fd(created, KEY_READER, fd[0]) != 0 ||
+	    fdserver_open_context(name, &opened) != 0)
+		goto close_exit;
+
+	found = fdserver_lookup_fd(opened, KEY_READER);
+	if (found >= 0) {
+		close(found);
+		ret = 0;
+	}
+	if (fdserver_close_context(&opened) != 0 || opened != NULL)
+		ret = 1;
+
+	/* names are unique */
+	if (fdserver_new_named_context(name, 0, &other) == 0) {
+		fdserver_del_context(&other);
+		ret = 1;
+	} else if (errno != EEXIST) {
+		ret = 1;
+	}
+
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+del_exit:
+	if (fdserver_del_context(&created) != 0)
+		ret = 1;
+
+	/* the name goes with the context */
+	if (fdserver_open_context(name, &opened) == 0) {
+		fdserver_close_context(&opened);
+		ret = 1;
+	} else if (errno != ENOENT) {
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * a context of one tenant cannot be used through the socket of another
+ * tenant, even though both are served by the same server
+ */
+static int tenant_isolation(void)
+{
+	fdserver_context_t *ctx;
+	int fd[2];
+	int ret = 1;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+
+	if (pipe(fd) == -1)
+		goto del_exit;
+
+	if (fdserver_register_fd(ctx, KEY_READER, fd[0]) != 0)
+		goto close_exit;
+
+	if (fdserver_init(tenant_path) != 0)
+		goto close_exit;
+
+	if (fdserver_lookup_fd(ctx, KEY_READER) == -1 && errno == ESRCH)
+		ret = 0;
+
+	if (fdserver_init(path) != 0)
+		ret = 1;
+
+	if (fdserver_lookup_fd(ctx, KEY_READER) == -1)
+		ret = 1;
+
+close_exit:
+	close(fd[0]);
+	close(fd[1]);
+del_exit:
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+/* names are only known to the tenant of the named context */
+static int tenant_names(void)
+{
+	char name[FDSERVER_MAX_CONTEXT_NAME];
+	fdserver_context_t *ctx;
+	fdserver_context_t *opened;
+	int ret = 1;
+
+	context_name(name);
+	if (fdserver_new_named_context(name, 0, &ctx) != 0)
+		return 1;
+
+	if (fdserver_init(tenant_path) != 0)
+		goto del_exit;
+
+	if (fdserver_open_context(name, &opened) == 0)
+		fdserver_close_context(&opened);
+	else if (errno == ENOENT)
+		ret = 0;
+
+	if (fdserver_init(path) != 0)
+		ret = 1;
+
+del_exit:
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+#define KEY_LAZY 0x2800
+#define KEY_LAZY_RELATIVE 0x2801
+#define KEY_LAZY_MISSING 0x2802
+#define KEY_LAZY_CREATE 0x2803
+#define KEY_LAZY_FIFO 0x2804
+#define KEY_LAZY_FIFO_WRITER 0x2805
+
+/*
+ * a path registered is only opened by the server on lookup, and closed
+ * again once idle
+ */
+static int lazy_registration(void)
+{
+	char file[] = "/tmp/fdserver_lazy.XXXXXX";
+	char buf[sizeof(WELL_KNOWN_METADATA)];
+	fdserver_context_t *ctx;
+	uint64_t keys[4];
+	int relative = -1;
+	int dir = -1;
+	int fd = -1;
+	int ret = 1;
+	int tmp;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+	tmp = mkstemp(file);
+	if (tmp < 0)
+		goto delete_exit;
+	if (write(tmp, WELL_KNOWN_METADATA, sizeof(buf)) != sizeof(buf))
+		goto close_exit;
+	dir = open("/tmp", O_RDONLY | O_DIRECTORY);
+	if (dir < 0)
+		goto close_exit;
+
+	if (fdserver_register_path(ctx, KEY_LAZY, AT_FDCWD, file, O_RDONLY,
+				   100) != 0 ||
+	    fdserver_register_path(ctx, KEY_LAZY_RELATIVE, dir,
+				   file + strlen("/tmp/"), O_RDONLY, 0) != 0 ||
+	    fdserver_register_path(ctx, KEY_LAZY_MISSING, AT_FDCWD,
+				   "/nonexistent/fdserver", O_RDONLY, 0) != 0)
+		goto close_exit;
+	if (fdserver_register_path(ctx, KEY_LAZY_CREATE, AT_FDCWD, file,
+				   O_RDWR | O_CREAT, 0) != -1 ||
+	    errno != EINVAL)
+		goto close_exit;
+
+	fd = fdserver_lookup_fd(ctx, KEY_LAZY);
+	if (fd < 0 || pread(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    strcmp(buf, WELL_KNOWN_METADATA) != 0)
+		goto close_exit;
+	relative = fdserver_lookup_fd(ctx, KEY_LAZY_RELATIVE);
+	if (relative < 0 ||
+	    pread(relative, buf, sizeof(buf), 0) != sizeof(buf))
+		goto close_exit;
+	if (fdserver_lookup_fd(ctx, KEY_LAZY_MISSING) != -1 ||
+	    errno != ENOENT)
+		goto close_exit;
+
+	/* the idle one is closed by the server, the other one stays open */
+	usleep(300000);
+	if (fdserver_reverse_lookup(ctx, fd, keys, 4) != -1 ||
+	    errno != ENOENT ||
+	    fdserver_reverse_lookup(ctx, relative, keys, 4) != 1 ||
+	    keys[0] != KEY_LAZY_RELATIVE)
+		goto close_exit;
+
+	/* and opened again on the next lookup */
+	close(fd);
+	fd = fdserver_lookup_fd(ctx, KEY_LAZY);
+	if (fd < 0 || fdserver_reverse_lookup(ctx, fd, keys, 4) != 1 ||
+	    keys[0] != KEY_LAZY)
+		goto close_exit;
+	ret = 0;
+
+close_exit:
+	if (fd >= 0)
+		close(fd);
+	if (relative >= 0)
+		close(relative);
+	if (dir >= 0)
+		close(dir);
+	close(tmp);
+	unlink(file);
+delete_exit:
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+/*
+ * opening a registered FIFO never waits for its other end: the read end
+ * opens at once, blocking as registered, the write end fails until there
+ * is a reader
+ */
+static int lazy_fifo(void)
+{
+	char fifo[64];
+	fdserver_context_t *ctx;
+	int fd = -1;
+	int ret = 1;
+
+	snprintf(fifo, sizeof(fifo), "/tmp/fdserver_fifo.%d", (int)getpid());
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+	if (mkfifo(fifo, 0600) != 0)
+		goto delete_exit;
+
+	if (fdserver_register_path(ctx, KEY_LAZY_FIFO, AT_FDCWD, fifo,
+				   O_RDONLY, 0) != 0 ||
+	    fdserver_register_path(ctx, KEY_LAZY_FIFO_WRITER, AT_FDCWD, fifo,
+				   O_WRONLY, 0) != 0)
+		goto unlink_exit;
+
+	/* no reader yet */
+	if (fdserver_lookup_fd(ctx, KEY_LAZY_FIFO_WRITER) != -1 ||
+	    errno != ENXIO)
+		goto unlink_exit;
+
+	fd = fdserver_lookup_fd(ctx, KEY_LAZY_FIFO);
+	if (fd < 0 || (fcntl(fd, F_GETFL) & O_NONBLOCK))
+		goto unlink_exit;
+	close(fd);
+
+	/* the server holds the read end open now */
+	fd = fdserver_lookup_fd(ctx, KEY_LAZY_FIFO_WRITER);
+	if (fd < 0)
+		goto unlink_exit;
+	ret = 0;
+
+unlink_exit:
+	if (fd >= 0)
+		close(fd);
+	unlink(fifo);
+delete_exit:
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+#define KEY_QUEUE 0x3000
+/* fds queued at most, under as many keys, to hit the quota of the server */
+#define MAX_QUEUED 128
+
+/* pop the fd queued under key, and close it */
+static int pop_closed(fdserver_context_t *ctx, uint64_t key)
+{
+	int fd = fdserver_queue_pop(ctx, key, 0);
+
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * fds pushed are popped once each, in order, by whoever pops first or
+ * was already waiting
+ */
+static int work_queue(void)
+{
+	int message = WELL_KNOWN_MESSAGE;
+	fdserver_context_t *ctx;
+	int received = 0;
+	int status;
+	int n;
+	int fd[2];
+	int rfd = -1, wfd = -1;
+	int ret = 1;
+	pid_t pid;
+
+	if (fdserver_new_context(&ctx) != 0)
+		return 1;
+	if (pipe(fd) != 0)
+		goto delete_exit;
+
+	if (fdserver_queue_push(ctx, KEY_QUEUE, fd[1]) != 0 ||
+	    fdserver_queue_push(ctx, KEY_QUEUE, fd[0]) != 0)
+		goto close_exit;
+
+	wfd = fdserver_queue_pop(ctx, KEY_QUEUE, 0);
+	rfd = fdserver_queue_pop(ctx, KEY_QUEUE, 0);
+	if (wfd < 0 || rfd < 0 ||
+	    write(wfd, &message, sizeof(message)) != sizeof(message) ||
+	    read(rfd, &received, sizeof(received)) != sizeof(received) ||
+	    received != message)
+		goto close_exit;
+
+	/* empty: nothing to take, then nothing pushed in time */
+	if (fdserver_queue_pop(ctx, KEY_QUEUE, 0) != -1 ||
+	    errno != ETIMEDOUT ||
+	    fdserver_queue_pop(ctx, KEY_QUEUE, 100) != -1 ||
+	    errno != ETIMEDOUT)
+		goto close_exit;
+
+	/* a consumer waiting gets the fd pushed next */
+	pid = fork();
+	if (pid == 0) {
+		int popped = fdserver_queue_pop(ctx, KEY_QUEUE, 5000);
+
+		if (popped < 0 ||
+		    write(popped, &message, sizeof(message)) !=
+		    sizeof(message))
+			_exit(1);
+		_exit(0);
+	}
+	if (pid < 0)
+		goto close_exit;
+	usleep(100000);
+	if (fdserver_queue_push(ctx, KEY_QUEUE, wfd) != 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		goto close_exit;
+	}
+	received = 0;
+	if (waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    read(rfd, &received, sizeof(received)) != sizeof(received) ||
+	    received != message)
+		goto close_exit;
+
+	/* the fd went to the consumer only */
+	if (fdserver_queue_pop(ctx, KEY_QUEUE, 0) != -1 || errno != ETIMEDOUT)
+		goto close_exit;
+
+	/* queued fds count in the quotas, and are given back once popped */
+	for (n = 0; n < MAX_QUEUED; n++)
+		if (fdserver_queue_push(ctx, KEY_QUEUE + n, fd[0]) != 0)
+			break;
+	if (n < MAX_QUEUED &&
+	    (errno != ENOSPC || n == 0 || pop_closed(ctx, KEY_QUEUE) != 0 ||
+	     fdserver_queue_push(ctx, KEY_QUEUE, fd[0]) != 0))
+		goto close_exit;
+	while (n-- > 0)
+		if (pop_closed(ctx, KEY_QUEUE + n) != 0)
+			goto close_exit;
+	ret = 0;
+
+close_exit:
+	if (rfd >= 0)
+		close(rfd);
+	if (wfd >= 0)
+		close(wfd);
+	close(fd[0]);
+	close(fd[1]);
+delete_exit:
+	if (fdserver_del_context(&ctx) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+/*
+ * with the journal, the contexts and registrations of the process outlive
+ * a restart of the server, under the same handles
+ */
+static int journal_restart(void)
+{
+	const char *server_path = path != NULL ? path : FDSERVER_SOCKET_PATH;
+	char journal_path[64];
+	char meta[sizeof(WELL_KNOWN_METADATA)];
+	size_t size = sizeof(meta);
+	int message = WELL_KNOWN_MESSAGE;
+	fdserver_context_t *ctx = NULL;
+	int received = 0;
+	int fd[2];
+	int rfd = -1, wfd = -1;
+	int ret = 1;
+
+	snprintf(journal_path, sizeof(journal_path),
+		 "/tmp/fdserver_journal.%d", getpid());
+	if (fdserver_server_start(journal_path) != 0)
+		return 1;
+	if (fdserver_init(journal_path) != 0 ||
+	    fdserver_set_journal(1) != 0 ||
+	    fdserver_new_context(&ctx) != 0 ||
+	    pipe(fd) != 0)
+		goto stop_exit;
+
+	if (fdserver_register_fd_meta(ctx, KEY_WRITER, fd[1],
+				      WELL_KNOWN_METADATA,
+				      sizeof(WELL_KNOWN_METADATA)) != 0 ||
+	    fdserver_register_fd(ctx, KEY_READER, fd[0]) != 0 ||
+	    fdserver_register_fd(ctx, KEY_META, fd[0]) != 0 ||
+	    fdserver_deregister_fd(ctx, KEY_META) != 0)
+		goto close_exit;
+
+	if (fdserver_server_stop() != 0 ||
+	    fdserver_server_start(journal_path) != 0)
+		goto close_exit;
+
+	wfd = fdserver_lookup_fd_meta(ctx, KEY_WRITER, meta, &size);
+	rfd = fdserver_lookup_fd(ctx, KEY_READER);
+	if (wfd < 0 || rfd < 0 || size != sizeof(WELL_KNOWN_METADATA) ||
+	    strcmp(meta, WELL_KNOWN_METADATA) != 0 ||
+	    write(wfd, &message, sizeof(message)) != sizeof(message) ||
+	    read(rfd, &received, sizeof(received)) != sizeof(received) ||
+	    received != message)
+		goto close_exit;
+
+	if (fdserver_lookup_fd(ctx, KEY_META) != -1 || errno != ENOENT)
+		goto close_exit;
+	ret = 0;
+
+close_exit:
+	if (rfd >= 0)
+		close(rfd);
+	if (wfd >= 0)
+		close(wfd);
+	close(fd[0]);
+	close(fd[1]);
+stop_exit:
+	if (ctx != NULL && fdserver_del_context(&ctx) != 0)
+		ret = 1;
+	fdserver_set_journal(0);
+	if (fdserver_server_stop() != 0 ||
+	    fdserver_init(server_path) != 0)
+		ret = 1;
+
+	return ret;
+}
+
+struct Test tests_suite[] = {
+	{ do_init, "Initialize library" },
+	{ create_context, "Create context" },
+	{ delete_context, "Delete context" },
+	{ create_context, "Create context Again" },
+	{ request_missing_fd, "Request missing fd" },
+	{ register_fds, "Register two file descriptors" },
+	{ lookup_writer, "Lookup writer fd" },
+	{ lookup_reader, "Lookup reader fd" },
+	{ lookup_batch, "Lookup several fds in one request" },
+	{ lookup_v1, "Lookup fd with a v1 client" },
+	{ pipelined_requests, "Pipelined requests" },
+	{ stalled_client, "Client stalling amid a frame" },
+	{ reverse_lookup, "Find the keys of an fd" },
+	{ deregister_fds, "Deregistering file descriptors" },
+	{ replace_fd, "Replace file descriptor" },
+	{ fd_group, "Register a group of file descriptors" },
+	{ register_fd_meta, "Register fd with metadata" },
+	{ lookup_fd_meta, "Lookup fd with metadata" },
+	{ create_shm, "Create shared memory" },
+	{ attach_shm, "Attach shared memory" },
+	{ request_missing_fd, "Request missing fd" },
+	{ delete_context, "Delete context" },
+	{ delete_unexisting_context, "Try to delete unexisting context"},
+	{ context_in_storage, "Context in caller provided storage" },
+	{ named_context, "Open a context by name" },
+	{ delete_closes_fds, "Deleting a context closes its fds" },
+	{ evict_entries, "Evict the least recently used entries" },
+	{ clone_context, "Clone context" },
+	{ subscribe_context, "Subscribe to context changes" },
+	{ publish_fds, "Publish fds to the subscribers" },
+	{ dump_inventory, "Dump the server inventory" },
+	{ deadlines, "Time out on deadlines" },
+	{ work_queue, "Hand fds over through a work queue" },
+	{ lazy_registration, "Open registered paths on lookup" },
+	{ lazy_fifo, "Open a registered FIFO without blocking" },
+	{ embedded_server, "Embedded server" },
+	{ journal_restart, "Replay the journal to a restarted server" },
+	{ NULL, NULL }
+};
+
+/* only run when the socket of another tenant is given */
+struct Test tenant_tests_suite[] = {
+	{ tenant_isolation, "Context not visible from another tenant" },
+	{ tenant_names, "Context name not visible from another tenant" },
+	{ NULL, NULL }
+};
+
+static int run_tests(struct Test *test)
+{
+	int errors = 0;
+
+	while (test->run_test != NULL) {
+		int ret = test->run_test();
+		if (ret == 0) {
+			printf("PASS: ");
+		} else {
+			errors++;
+			printf("FAIL: ");
+		}
+		printf("%s\n", test->name);
+		test++;
+	}
+
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"path", required_argument, NULL, 'p'},
+		{"tenant", required_argument, NULL, 't'},
+		{0 , 0, 0, 0}
+	};
+	int opt;
+	int option_index = 0;
+
+	while ((opt = getopt_long(argc, argv,
+				  ":p:t:", long_options, &option_index)) != -1) {
+		switch (opt) {
+		case 'p':
+			path = strdup(optarg);
+			break;
+		case 't':
+			tenant_path = strdup(optarg);
 			break;
 		case ':':
 			fprintf(stderr, "Missing argument for %s\n",
@@ -186,9 +1814,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	opt = run_tests();
+	opt = run_tests(tests_suite);
+	if (tenant_path != NULL)
+		opt += run_tests(tenant_tests_suite);
 
 	free(path);
+	free(tenant_path);
 
 	return opt;
 }
@@ -0,0 +1,179 @@
+#include <unistd.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <getopt.h>
+
+#include <fdserver.hpp>
+
+#define WELL_KNOWN_MESSAGE (int)(0xbadcafe)
+
+#define KEY_READER 0
+#define KEY_WRITER 1
+
+static fdserver::Context context;
+static char *path = NULL;
+
+struct Test {
+	int (*run_test)(void);
+	const char *name;
+};
+
+static int do_init(void)
+{
+	return fdserver_init(path);
+}
+
+static int create_context(void)
+{
+	return context.create();
+}
+
+static int register_fds(void)
+{
+	int fd[2];
+
+	if (pipe(fd) == -1)
+		return 1;
+
+	fdserver::UniqueFd reader(fd[0]);
+	fdserver::UniqueFd writer(fd[1]);
+
+	if (context.register_fd(KEY_READER, reader.get()) ||
+	    context.register_fd(KEY_WRITER, writer.get(), "w", 1))
+		return 1;
+
+	return 0;
+}
+
+static int lookup_fds(void)
+{
+	char meta[FDSERVER_MAX_METADATA];
+	size_t size = sizeof(meta);
+	int msg = WELL_KNOWN_MESSAGE;
+
+	fdserver::UniqueFd writer = context.lookup_fd(KEY_WRITER, meta, &size);
+	fdserver::UniqueFd reader = context.lookup_fd(KEY_READER);
+	if (!writer || !reader || size != 1 || meta[0] != 'w')
+		return 1;
+
+	if (write(writer.get(), &msg, sizeof(msg)) != sizeof(msg))
+		return 1;
+	msg = 0;
+	if (read(reader.get(), &msg, sizeof(msg)) != sizeof(msg))
+		return 1;
+
+	return msg != WELL_KNOWN_MESSAGE;
+}
+
+static int lookup_batch(void)
+{
+	uint64_t keys[] = { KEY_READER, 42, KEY_WRITER };
+	fdserver::UniqueFd fds[3];
+
+	if (context.lookup_batch(keys, 3, fds) != 2)
+		return 1;
+
+	return !fds[0] || fds[1] || !fds[2];
+}
+
+static int move_context(void)
+{
+	fdserver::Context other(std::move(context));
+
+	if (context || !other || !other.lookup_fd(KEY_READER))
+		return 1;
+
+	context = std::move(other);
+
+	return !context || other;
+}
+
+static int clone_context(void)
+{
+	fdserver::Context clone;
+
+	if (clone.clone(context) != 0 || clone.deregister_fd(KEY_READER) != 0)
+		return 1;
+
+	/* the source keeps what the clone dropped */
+	return clone.lookup_fd(KEY_READER) || !clone.lookup_fd(KEY_WRITER) ||
+		!context.lookup_fd(KEY_READER);
+}
+
+static int delete_context(void)
+{
+	if (context.reset() != 0)
+		return 1;
+
+	return context ? 1 : 0;
+}
+
+static struct Test tests_suite[] = {
+	{ do_init, "Initialize library" },
+	{ create_context, "Create context" },
+	{ register_fds, "Register two file descriptors" },
+	{ lookup_fds, "Lookup file descriptors" },
+	{ lookup_batch, "Lookup several fds in one request" },
+	{ move_context, "Move context" },
+	{ clone_context, "Clone context" },
+	{ delete_context, "Delete context" },
+	{ NULL, NULL }
+};
+
+static int run_tests(void)
+{
+	struct Test *test;
+	int errors = 0;
+
+	test = &tests_suite[0];
+	while (test->run_test != NULL) {
+		int ret = test->run_test();
+		if (ret == 0) {
+			printf("PASS: ");
+		} else {
+			errors++;
+			printf("FAIL: ");
+		}
+		printf("%s\n", test->name);
+		test++;
+	}
+
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"path", required_argument, NULL, 'p'},
+		{0 , 0, 0, 0}
+	};
+	int opt;
+	int option_index = 0;
+
+	while ((opt = getopt_long(argc, argv,
+				  ":p:", long_options, &option_index)) != -1) {
+		switch (opt) {
+		case 'p':
+			path = strdup(optarg);
+			break;
+		case ':':
+			fprintf(stderr, "Missing argument for %s\n",
+				argv[optind - 1]);
+			exit(EXIT_FAILURE);
+			break;
+		case '?':
+			/* fall-through */
+		default:
+			fprintf(stderr, "Unknown option %c\n", (char)opt);
+			break;
+		}
+	}
+
+	opt = run_tests();
+
+	free(path);
+
+	return opt;
+}
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+NEW_PATH=$(mktemp -p "" -u fdserver_socket.XXXX)
+
+../src/fdserver -p ${NEW_PATH} &>/dev/null &
+server=$!
+
+# give time for the server to start
+sleep 1
+
+./fdserver_cpp -p ${NEW_PATH} 2>/dev/null
+retval=$?
+
+kill -HUP $server
+wait $server
+
+exit $retval
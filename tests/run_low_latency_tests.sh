@@ -0,0 +1,19 @@
+#!/bin/bash
+
+NEW_PATH=$(mktemp -p "" -u fdserver_socket.XXXX)
+
+# pinned to the first CPU we may run on, polling for 100us before sleeping
+CPU=$(taskset -pc $$ | sed 's/.*: *\([0-9]*\).*/\1/')
+../src/fdserver -p ${NEW_PATH} --cpus ${CPU} --busy-poll 100 &>/dev/null &
+server=$!
+
+# give time for the server to start
+sleep 1
+
+./fdserver_api -p ${NEW_PATH} 2>/dev/null
+retval=$?
+
+kill -HUP $server
+wait $server
+
+exit $retval
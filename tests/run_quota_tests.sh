@@ -0,0 +1,18 @@
+#!/bin/bash
+
+NEW_PATH=$(mktemp -p "" -u fdserver_socket.XXXX)
+
+# the server quota is reached before that of the contexts
+../src/fdserver -p ${NEW_PATH} --max-fds 64 --max-bytes 65536 &>/dev/null &
+server=$!
+
+# give time for the server to start
+sleep 1
+
+./fdserver_api -p ${NEW_PATH} 2>/dev/null
+retval=$?
+
+kill -HUP $server
+wait $server
+
+exit $retval
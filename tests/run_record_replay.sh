@@ -0,0 +1,27 @@
+#!/bin/bash
+
+NEW_PATH=$(mktemp -p "" -u fdserver_socket.XXXX)
+TRACE=$(mktemp -p "" fdserver_trace.XXXX)
+rm ${TRACE}
+
+# record the traffic of the API tests
+../src/fdserver -p ${NEW_PATH} -r ${TRACE} &>/dev/null &
+server=$!
+sleep 1
+./fdserver_api -p ${NEW_PATH} &>/dev/null
+kill -HUP $server
+wait $server
+
+# and replay it against a fresh server
+../src/fdserver -p ${NEW_PATH} &>/dev/null &
+server=$!
+sleep 1
+../src/fdserver-replay -p ${NEW_PATH} -j 2 -s 0 ${TRACE} 2>/dev/null
+retval=$?
+
+kill -HUP $server
+wait $server
+
+rm -f ${TRACE}
+
+exit $retval
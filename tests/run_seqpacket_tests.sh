@@ -0,0 +1,18 @@
+#!/bin/bash
+
+NEW_PATH=$(mktemp -p "" -u fdserver_socket.XXXX)
+
+# SOCK_SEQPACKET listener, to which the library connects first
+../src/fdserver -S -p ${NEW_PATH} &>/dev/null &
+server=$!
+
+# give time for the server to start
+sleep 1
+
+./fdserver_api -p ${NEW_PATH} 2>/dev/null
+retval=$?
+
+kill -HUP $server
+wait $server
+
+exit $retval
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+PATH_A=$(mktemp -p "" -u fdserver_socket.XXXX)
+PATH_B=$(mktemp -p "" -u fdserver_socket.XXXX)
+
+# one server, one tenant per socket
+../src/fdserver -p ${PATH_A} -p ${PATH_B} &>/dev/null &
+server=$!
+
+# give time for the server to start
+sleep 1
+
+./fdserver_api -p ${PATH_A} -t ${PATH_B} 2>/dev/null
+retval=$?
+
+kill -HUP $server
+wait $server
+
+exit $retval